@@ -0,0 +1,5691 @@
+// Image processing library, see image_processing.h
+#include "image_processing.h"
+#include <iostream>
+#include <vector>
+#include <fstream>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <cstdio>
+#include <iomanip>
+#include <sstream>
+#include <filesystem>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define IMAGE_MMAP 1
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IMAGE_X86 1
+#endif
+using namespace std;
+
+//***************************************************************************************************//
+//                               Below code in this section was provided from professor              //
+//***************************************************************************************************//
+
+// The pool every Image takes its buffer from
+BufferPool buffer_pool;
+
+/**
+ * Gets a little-endian integer from a buffer holding the file headers.
+ * Helper function for read_image()
+ * @param header the header bytes
+ * @param offset the offset at which to read the integer
+ * @param bytes  the number of bytes to read
+ * @return the integer starting at the given offset
+ */ 
+int get_int(const unsigned char header[], int offset, int bytes)
+{
+    int result = 0;
+    int base = 1;
+    for (int i = 0; i < bytes; i++)
+    {   
+        result = result + header[offset + i] * base;
+        base = base * 256;
+    }
+    return result;
+}
+
+// The largest file a BMP header can describe, since its size fields are
+// unsigned 32-bit integers
+const long long BMP_MAX_FILE_SIZE = 0xFFFFFFFFLL;
+
+/**
+ * Gets a little-endian unsigned 32-bit integer from a buffer holding the
+ * file headers. get_int() would overflow on sizes of 2 GiB and more.
+ * Helper function for parse_bmp_header()
+ * @param header the header bytes
+ * @param offset the offset at which to read the integer
+ * @return the integer starting at the given offset
+ */
+long long get_uint32(const unsigned char header[], int offset)
+{
+    long long result = 0;
+    for (int i = 3; i >= 0; i--)
+    {
+        result = result * 256 + header[offset + i];
+    }
+    return result;
+}
+
+/**
+ * Gets the size of the 24-bit BMP file write_image() writes for an image
+ * @param width_pixels  image width
+ * @param height_pixels image height
+ * @return the file size in bytes, headers included
+ */
+long long bmp_file_size(int width_pixels, int height_pixels)
+{
+    long long width_bytes = ((long long)width_pixels * 3 + 3) / 4 * 4;
+    return 54 + width_bytes * height_pixels;
+}
+
+// Properties of a BMP file, taken from its headers
+struct BmpInfo
+{
+    long long file_size = 0;
+    int start = 0;              // Offset of the pixel array
+    int width = 0;
+    int height = 0;
+    int bytes_per_pixel = 0;    // 3 or 4
+    long long file_stride = 0;  // Bytes per scanline, including padding
+    bool too_large = false;     // Set if the pixels need more than 4 GiB
+};
+
+/**
+ * Checks the headers of a BMP file. 24-bit and 32-bit images are supported.
+ * Helper function for read_bmp_info() and decode_bmp()
+ * @param header the BMP and DIB headers (the first 54 bytes of the file)
+ * @param info   receives the image properties
+ * @return true if the file is a BMP this program can read
+ */
+bool parse_bmp_header(const unsigned char header[], BmpInfo& info)
+{
+    const int HEADER_SIZE = 54;
+    if (header[0] != 'B' || header[1] != 'M')
+    {
+        return false;
+    }
+
+    // Get the image properties
+    info.file_size = get_uint32(header, 2);
+    info.start = get_int(header, 10, 4);
+    info.width = get_int(header, 18, 4);
+    info.height = get_int(header, 22, 4);
+    int bits_per_pixel = get_int(header, 28, 2);
+    info.bytes_per_pixel = bits_per_pixel / 8;
+
+    if (info.width <= 0 || info.height <= 0 || info.start < HEADER_SIZE
+        || (bits_per_pixel != 24 && bits_per_pixel != 32))
+    {
+        return false;
+    }
+
+    // Scan lines must occupy multiples of four bytes
+    long long scanline_size = (long long)info.width * info.bytes_per_pixel;
+    long long padding = (4 - scanline_size % 4) % 4;
+    info.file_stride = scanline_size + padding;
+
+    // The size fields cannot describe anything bigger
+    if (info.start + info.file_stride * info.height > BMP_MAX_FILE_SIZE)
+    {
+        info.too_large = true;
+        return false;
+    }
+
+    // Not a valid image if the sizes do not add up
+    if (info.file_size != info.start + info.file_stride * info.height)
+    {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Reads and checks the headers of a BMP file, and leaves the stream at the
+ * start of the pixel array
+ * Helper function for read_image()
+ * @param stream the open file
+ * @param info   receives the image properties
+ * @return true if the file is a BMP this program can read
+ */
+bool read_bmp_info(fstream& stream, BmpInfo& info)
+{
+    // Read the BMP and DIB headers in one go
+    const int HEADER_SIZE = 54;
+    unsigned char header[HEADER_SIZE] = {0};
+    stream.read((char*)header, HEADER_SIZE);
+    if (stream.gcount() != HEADER_SIZE || !parse_bmp_header(header, info))
+    {
+        return false;
+    }
+
+    stream.seekg(info.start);
+    return true;
+}
+
+/**
+ * Describes why a file could not be read as a BMP
+ * @param filename the file
+ * @return the error message
+ */
+string bmp_read_error(const string& filename)
+{
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+    BmpInfo info;
+    read_bmp_info(stream, info);
+    if (info.too_large)
+    {
+        return "cannot read " + filename + ": BMP files over 4 GiB are not supported";
+    }
+    return "cannot read " + filename + " as a 24 or 32-bit BMP";
+}
+
+/**
+ * Converts one scanline of a BMP file to Pixels, skipping the padding and
+ * the alpha channel of 32-bit images
+ * Helper function for read_image()
+ * @param src             the scanline in the file
+ * @param dst             the image row
+ * @param width           pixels in the row
+ * @param bytes_per_pixel 3 or 4
+ * @return nothing
+ */
+void unpack_scanline(const unsigned char* src, Pixel* dst, int width, int bytes_per_pixel)
+{
+    if (bytes_per_pixel == 3)
+    {
+        // Same blue, green, red layout, so copy the scanline as is
+        memcpy(dst, src, (size_t)width * 3);
+    }
+    else
+    {
+        for (int j = 0; j < width; j++)
+        {
+            dst[j].blue = src[0];
+            dst[j].green = src[1];
+            dst[j].red = src[2];
+            src += 4;
+        }
+    }
+}
+
+/**
+ * Reads the BMP image specified and returns the resulting image.
+ * The headers are read once and the pixel array is pulled in blocks of
+ * whole scanlines, which are then converted row by row. 24-bit and 32-bit
+ * images are supported; the alpha channel of a 32-bit image is dropped.
+ * @param filename BMP image filename
+ * @param stats    optional, receives the bytes read and time taken
+ * @return the image, or an empty Image if the file is not a valid BMP
+ */
+Image read_image(string filename, DecodeStats* stats)
+{
+    auto start_time = chrono::steady_clock::now();
+
+    // Open the binary file
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+
+    // Get the image properties, return an empty image if this is not a
+    // valid image
+    BmpInfo info;
+    if (!read_bmp_info(stream, info))
+    {
+        return Image();
+    }
+    int width = info.width;
+    int height = info.height;
+    long long file_stride = info.file_stride;
+
+    // Create an image the size of the input image
+    Image image(width, height);
+
+    // Read as many whole scanlines as fit in a 4 MB block at a time
+    const long long BLOCK_SIZE = 4 << 20;
+    int block_rows = max(1LL, BLOCK_SIZE / file_stride);
+    vector<unsigned char> block((size_t)(file_stride * min(block_rows, height)));
+
+    // Note: BMP files store rows from bottom to top, so file row 0 is the
+    // last row of the image
+    for (int file_row = 0; file_row < height; file_row += block_rows)
+    {
+        int rows = min(block_rows, height - file_row);
+        stream.read((char*)block.data(), file_stride * rows);
+        if (stream.gcount() != file_stride * rows)
+        {
+            return Image();
+        }
+
+        for (int i = 0; i < rows; i++)
+        {
+            unpack_scanline(block.data() + file_stride * i, image[height - 1 - (file_row + i)],
+                            width, info.bytes_per_pixel);
+        }
+    }
+
+    // Close the stream and return the image
+    stream.close();
+
+    if (stats != nullptr)
+    {
+        stats->bytes = info.file_size;
+        stats->pixels = (long long)info.width * info.height;
+        stats->seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    }
+    return image;
+}
+
+/**
+ * Decodes a BMP file that is already in memory, e.g. one received over a
+ * socket. Accepts the same files as read_image().
+ * @param data the file contents
+ * @param size the number of bytes in data
+ * @return the image, or an empty Image if the data is not a valid BMP
+ */
+Image decode_bmp(const unsigned char* data, size_t size)
+{
+    BmpInfo info;
+    if (size < 54 || !parse_bmp_header(data, info) || size < (size_t)info.file_size)
+    {
+        return Image();
+    }
+
+    // Note: BMP files store rows from bottom to top
+    Image image(info.width, info.height);
+    const unsigned char* pixels = data + info.start;
+    parallel_rows(info.height, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            unpack_scanline(pixels + info.file_stride * (info.height - 1 - row), image[row],
+                            info.width, info.bytes_per_pixel);
+        }
+    });
+    return image;
+}
+
+// Defined with the downscaling filters
+int reduction_shift(int width, int height, int min_side);
+Image decode_reduced(const BmpInfo& info, int shift, const function<const unsigned char*(int, int)>& fetch);
+
+/**
+ * Reads a BMP file reduced while it is decoded, see image_processing.h.
+ * Falls back to read_image() if the image is too small to halve.
+ * @param filename BMP image filename
+ * @param min_side the smallest longer side the image may be reduced to
+ * @param stats    optional, receives the bytes read and time taken
+ * @return the image, or an empty Image if the file is not a valid BMP
+ */
+Image read_image_reduced(string filename, int min_side, DecodeStats* stats)
+{
+    auto start_time = chrono::steady_clock::now();
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+    BmpInfo info;
+    if (!read_bmp_info(stream, info))
+    {
+        return Image();
+    }
+    int shift = reduction_shift(info.width, info.height, min_side);
+    if (shift == 0)
+    {
+        stream.close();
+        return read_image(filename, stats);
+    }
+
+    vector<unsigned char> block;
+    Image image = decode_reduced(info, shift, [&](int, int rows) -> const unsigned char*
+    {
+        // Bands come in file order, so each one is the next part of the file
+        block.resize((size_t)(info.file_stride * rows));
+        stream.read((char*)block.data(), info.file_stride * rows);
+        return stream.gcount() == info.file_stride * rows ? block.data() : nullptr;
+    });
+
+    if (stats != nullptr && !image.empty())
+    {
+        stats->bytes = info.file_size;
+        stats->pixels = (long long)info.width * info.height;
+        stats->seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    }
+    return image;
+}
+
+Image decode_bmp_reduced(const unsigned char* data, size_t size, int min_side)
+{
+    BmpInfo info;
+    if (size < 54 || !parse_bmp_header(data, info) || size < (size_t)info.file_size)
+    {
+        return Image();
+    }
+    int shift = reduction_shift(info.width, info.height, min_side);
+    if (shift == 0)
+    {
+        return decode_bmp(data, size);
+    }
+    return decode_reduced(info, shift, [&](int file_row, int)
+    {
+        return data + info.start + info.file_stride * file_row;
+    });
+}
+
+/**
+ * Sets a value to the char array starting at the offset using the size
+ * specified by the bytes.
+ * This is a helper function for write_image()
+ * @param arr    Array to set values for
+ * @param offset Starting index offset
+ * @param bytes  Number of bytes to set
+ * @param value  Value to set
+ * @return nothing
+ */
+void set_bytes(unsigned char arr[], int offset, int bytes, long long value)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        arr[offset+i] = (unsigned char)(value>>(i*8));
+    }
+}
+
+/**
+ * Fills in the BMP and DIB headers for a 24-bit image
+ * Helper function for write_image()
+ * @param headers       receives the 54 header bytes
+ * @param width_pixels  image width
+ * @param height_pixels image height
+ * @return nothing
+ */
+void make_bmp_headers(unsigned char headers[], int width_pixels, int height_pixels)
+{
+    // Calculate the width in bytes incorporating padding (4 byte alignment)
+    long long width_bytes = (long long)width_pixels * 3;
+    long long padding_bytes = 0;
+    padding_bytes = (4 - width_bytes % 4) % 4;
+    width_bytes = width_bytes + padding_bytes;
+
+    // Pixel array size in bytes, including padding. Callers refuse images
+    // whose file would be over BMP_MAX_FILE_SIZE.
+    long long array_bytes = width_bytes * height_pixels;
+
+    // Create the BMP and DIB Headers
+    const int BMP_HEADER_SIZE = 14;
+    const int DIB_HEADER_SIZE = 40;
+    unsigned char bmp_header[BMP_HEADER_SIZE] = {0};
+    unsigned char dib_header[DIB_HEADER_SIZE] = {0};
+
+    // BMP Header
+    set_bytes(bmp_header,  0, 1, 'B');              // ID field
+    set_bytes(bmp_header,  1, 1, 'M');              // ID field
+    set_bytes(bmp_header,  2, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes); // Size of BMP file
+    set_bytes(bmp_header,  6, 2, 0);                // Reserved
+    set_bytes(bmp_header,  8, 2, 0);                // Reserved
+    set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE); // Pixel array offset
+
+    // DIB Header
+    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
+    set_bytes(dib_header,  4, 4, width_pixels);     // Width of bitmap in pixels
+    set_bytes(dib_header,  8, 4, height_pixels);    // Height of bitmap in pixels
+    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
+    set_bytes(dib_header, 14, 2, 24);               // Number of bits per pixel
+    set_bytes(dib_header, 16, 4, 0);                // Compression method (0=BI_RGB)
+    set_bytes(dib_header, 20, 4, array_bytes);      // Size of raw bitmap data (including padding)                     
+    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 32, 4, 0);                // Number of colors in palette
+    set_bytes(dib_header, 36, 4, 0);                // Number of important colors
+
+    memcpy(headers, bmp_header, sizeof(bmp_header));
+    memcpy(headers + sizeof(bmp_header), dib_header, sizeof(dib_header));
+}
+
+/**
+ * Writes the BMP and DIB headers for a 24-bit image
+ * Helper function for write_image()
+ * @param stream        the file, positioned at its start
+ * @param width_pixels  image width
+ * @param height_pixels image height
+ * @return nothing
+ */
+void write_bmp_headers(fstream& stream, int width_pixels, int height_pixels)
+{
+    unsigned char headers[54];
+    make_bmp_headers(headers, width_pixels, height_pixels);
+
+    // Write the BMP and DIB Headers to the file
+    stream.write((char*)headers, sizeof(headers));
+}
+
+// Side of the square tiles used to gather transposed rows. The stored
+// rows and displayed rows of one tile (64 * 64 * 3 bytes each) stay in
+// cache.
+const int ROTATE_TILE = 64;
+
+/**
+ * Copies displayed rows of an image (its stored pixels put in the order
+ * its orientation gives) to a buffer. Transposed rows are gathered one
+ * tile at a time, so each cache line of the image is loaded once per tile
+ * instead of once per pixel. Only the pixels are written, not padding.
+ * Helper function for write_image()
+ * @param image      the image
+ * @param begin      first displayed row
+ * @param end        one past the last displayed row
+ * @param dst        where displayed row begin goes
+ * @param dst_stride bytes from one displayed row to the next (may be negative)
+ * @return nothing
+ */
+void gather_rows(const Image& image, int begin, int end, unsigned char* dst, ptrdiff_t dst_stride)
+{
+    const Orientation& orientation = image.orientation;
+    int num_rows = image.height;
+    int num_columns = image.width;
+    if (!orientation.transpose)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            const Pixel* in = image[orientation.mirror_rows ? num_rows - 1 - row : row];
+            Pixel* out = (Pixel*)(dst + (row - begin) * dst_stride);
+            if (orientation.mirror_columns)
+            {
+                reverse_copy(in, in + num_columns, out);
+            }
+            else
+            {
+                memcpy(out, in, num_columns * 3);
+            }
+        }
+        return;
+    }
+
+    // Displayed row r is stored column r (or its mirror), read down the
+    // stored rows (or up them)
+    for (int row0 = begin; row0 < end; row0 += ROTATE_TILE)
+    {
+        int row1 = min(row0 + ROTATE_TILE, end);
+        for (int col0 = 0; col0 < num_rows; col0 += ROTATE_TILE)
+        {
+            int col1 = min(col0 + ROTATE_TILE, num_rows);
+            int first_row = orientation.mirror_rows ? num_rows - 1 - col0 : col0;
+            ptrdiff_t step = orientation.mirror_rows ? -(ptrdiff_t)image.stride : image.stride;
+            for (int row = row0; row < row1; row++)
+            {
+                Pixel* out = (Pixel*)(dst + (row - begin) * dst_stride);
+                int stored_column = orientation.mirror_columns ? num_columns - 1 - row : row;
+                const unsigned char* in = (const unsigned char*)(image[first_row] + stored_column);
+                for (int col = col0; col < col1; col++, in += step)
+                {
+                    out[col] = *(const Pixel*)in;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Writes rows of an image to a BMP pixel array, bottom row first. Whole
+ * padded scanlines are packed into a 4 MB block and each block is written
+ * in one call, instead of writing each pixel separately. The rows are put
+ * in displayed order while they are packed, so a rotated image is
+ * rearranged here and nowhere else.
+ * Helper function for write_image()
+ * @param stream the file, positioned where the rows go
+ * @param image  the image holding the rows
+ * @param begin  first displayed row to write (written last)
+ * @param end    one past the last displayed row to write (written first)
+ * @return nothing
+ */
+void write_scanlines(fstream& stream, const Image& image, int begin, int end)
+{
+    int pixel_bytes = image.display_width() * 3;
+    int padding_bytes = (4 - pixel_bytes % 4) % 4;
+    int width_bytes = pixel_bytes + padding_bytes;
+
+    const int BLOCK_SIZE = 4 << 20;
+    int block_rows = max(1, BLOCK_SIZE / max(1, width_bytes));
+    // The padding bytes start as zero and are never written
+    vector<unsigned char> block((size_t)width_bytes * min(block_rows, end - begin));
+
+    // Pixel Array (Left to right, bottom to top, with padding)
+    int h = end;
+    while (h > begin)
+    {
+        int rows = min(block_rows, h - begin);
+        // The highest row goes first in the block
+        gather_rows(image, h - rows, h, block.data() + (size_t)width_bytes * (rows - 1), -width_bytes);
+        stream.write((char*)block.data(), (streamsize)width_bytes * rows);
+        h -= rows;
+    }
+}
+
+/**
+ * Write the input image to a BMP file name specified
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @return True if successful and false otherwise
+ */
+bool write_image(string filename, const Image& image)
+{
+    // The headers cannot describe a file over 4 GiB
+    if (bmp_file_size(image.display_width(), image.display_height()) > BMP_MAX_FILE_SIZE)
+    {
+        return false;
+    }
+
+    // Open a file stream for writing to a binary file
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+
+    // If there was a problem opening the file, return false
+    if (!stream.is_open())
+    {
+        return false;
+    }
+
+    write_bmp_headers(stream, image.display_width(), image.display_height());
+    write_scanlines(stream, image, 0, image.display_height());
+
+    // Close the stream and return whether everything was written
+    bool written = stream.good();
+    stream.close();
+    return written;
+}
+
+/**
+ * Encodes an image as a 24-bit BMP file in memory, byte for byte what
+ * write_image() would write. The buffer comes from buffer_pool, so a
+ * caller that encodes many images can give it back once it is sent.
+ * @param image the image
+ * @return the file contents, or nothing if the file would be over 4 GiB
+ */
+vector<unsigned char> encode_bmp(const Image& image)
+{
+    int width = image.display_width();
+    int height = image.display_height();
+    if (bmp_file_size(width, height) > BMP_MAX_FILE_SIZE)
+    {
+        return vector<unsigned char>();
+    }
+    size_t pixel_bytes = (size_t)width * 3;
+    size_t width_bytes = (pixel_bytes + 3) / 4 * 4;
+    vector<unsigned char> file = buffer_pool.take(54 + width_bytes * height);
+    make_bmp_headers(file.data(), width, height);
+
+    // Rows go bottom to top, so each band is written from its highest row
+    // down. A reused buffer holds old bytes, so the padding is cleared too.
+    parallel_rows(height, [&](int begin, int end)
+    {
+        unsigned char* first = file.data() + 54 + width_bytes * (height - 1 - begin);
+        gather_rows(image, begin, end, first, -(ptrdiff_t)width_bytes);
+        if (width_bytes != pixel_bytes)
+        {
+            for (int row = begin; row < end; row++)
+            {
+                memset(first - width_bytes * (row - begin) + pixel_bytes, 0, width_bytes - pixel_bytes);
+            }
+        }
+    });
+    return file;
+}
+
+//***************************************************************************************************//
+//                                End of proffessor provided code                                    //
+//***************************************************************************************************//
+
+
+//***************************************************************************************************//
+//                                 Parallel row-band executor                                        //
+//***************************************************************************************************//
+
+// Runs a loop over rows on a pool of worker threads. The rows are split
+// into bands and each band is handed to one thread. The calling thread
+// works on bands too, so the pool never deadlocks when a band itself runs
+// a parallel loop or when several threads submit loops at once. Every row
+// is computed by the same code whichever thread gets it, so the result is
+// identical to running single-threaded.
+class RowExecutor
+{
+public:
+    RowExecutor()
+    {
+        set_threads(thread::hardware_concurrency());
+    }
+
+    ~RowExecutor()
+    {
+        stop_workers();
+    }
+
+    /**
+     * Sets the number of threads used for each loop, including the caller.
+     * Not thread safe; call it while no loop is running.
+     * @param count number of threads, values below 1 mean 1
+     * @return nothing
+     */
+    void set_threads(int count)
+    {
+        stop_workers();
+        num_threads = max(1, count);
+        stopping = false;
+        for (int i = 1; i < num_threads; i++)
+        {
+            workers.emplace_back([this] { worker_loop(); });
+        }
+    }
+
+    int threads() const
+    {
+        return num_threads;
+    }
+
+    /**
+     * Calls body(begin, end) for row bands that together cover
+     * [0, num_rows), and returns once all of them have finished
+     * @param num_rows number of rows to cover
+     * @param body     function that processes rows [begin, end)
+     * @return nothing
+     */
+    void run(int num_rows, const function<void(int, int)>& body)
+    {
+        // A few bands per thread evens out the load when some bands are
+        // slower than others
+        int num_bands = min(num_rows, num_threads * 4);
+        if (num_bands <= 1)
+        {
+            if (num_rows > 0)
+            {
+                body(0, num_rows);
+            }
+            return;
+        }
+
+        Job job;
+        job.body = &body;
+        job.num_rows = num_rows;
+        job.num_bands = num_bands;
+
+        unique_lock<mutex> guard(lock);
+        jobs.push_back(&job);
+        work_ready.notify_all();
+        while (job.next_band < job.num_bands)
+        {
+            run_band(&job, guard);
+        }
+        job_done.wait(guard, [&] { return job.finished == job.num_bands; });
+    }
+
+private:
+    struct Job
+    {
+        const function<void(int, int)>* body;
+        int num_rows;
+        int num_bands;
+        int next_band = 0;
+        int finished = 0;
+    };
+
+    int num_threads = 1;
+    vector<thread> workers;
+    mutex lock;
+    condition_variable work_ready;
+    condition_variable job_done;
+    deque<Job*> jobs;
+    bool stopping = false;
+
+    // Claims the next band of a job and runs it with the lock released.
+    // The job leaves the queue once all its bands are claimed.
+    void run_band(Job* job, unique_lock<mutex>& guard)
+    {
+        int band = job->next_band++;
+        if (job->next_band == job->num_bands)
+        {
+            jobs.erase(find(jobs.begin(), jobs.end(), job));
+        }
+
+        int begin = (long long)job->num_rows * band / job->num_bands;
+        int end = (long long)job->num_rows * (band + 1) / job->num_bands;
+        guard.unlock();
+        (*job->body)(begin, end);
+        guard.lock();
+
+        if (++job->finished == job->num_bands)
+        {
+            job_done.notify_all();
+        }
+    }
+
+    void worker_loop()
+    {
+        unique_lock<mutex> guard(lock);
+        while (true)
+        {
+            work_ready.wait(guard, [this] { return stopping || !jobs.empty(); });
+            if (stopping)
+            {
+                return;
+            }
+            run_band(jobs.front(), guard);
+        }
+    }
+
+    void stop_workers()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (thread& worker : workers)
+        {
+            worker.join();
+        }
+        workers.clear();
+    }
+};
+
+RowExecutor executor;
+
+/**
+ * Runs body(begin, end) over row bands covering [0, num_rows) on the
+ * shared executor
+ * @param num_rows number of rows
+ * @param body     function that processes rows [begin, end)
+ * @return nothing
+ */
+void parallel_rows(int num_rows, const function<void(int, int)>& body)
+{
+    executor.run(num_rows, body);
+}
+
+/**
+ * Sets the number of threads of the shared executor. Not thread safe;
+ * call it before any filters run.
+ * @param count threads, including the calling one (at least 1 is used)
+ * @return nothing
+ */
+void set_filter_threads(int count)
+{
+    executor.set_threads(count);
+}
+
+// The number of threads of the shared executor
+int filter_threads()
+{
+    return executor.threads();
+}
+
+//***************************************************************************************************//
+//                Row kernels for the per-pixel filters (process_1, 2, 3, 7, 8, 9, 10)               //
+//***************************************************************************************************//
+
+// Each kernel reads num_columns pixels from in and writes the filtered
+// pixels to out. in and out may point at the same row, which is how the
+// fused pipeline chains several kernels over one row. Vignette,
+// grayscale, high contrast, primary colors, clarendon and the tone filters
+// have plain _pixels versions that handle the columns [begin, end); their
+// _row versions below add SIMD kernels.
+
+ScaleMode scale_mode = ScaleMode::Exact;
+
+/**
+ * Selects how the scale-factor filters compute, see ScaleMode. Not thread
+ * safe; call it before any filters run.
+ * @param mode the mode
+ * @return nothing
+ */
+void set_scale_mode(ScaleMode mode)
+{
+    scale_mode = mode;
+}
+
+// The scale mode in use
+ScaleMode active_scale_mode()
+{
+    return scale_mode;
+}
+
+// Name of a scale mode, for reports
+const char* scale_mode_name(ScaleMode mode)
+{
+    return mode == ScaleMode::Fast ? "fast" : "exact";
+}
+
+// Lookup table mapping each 8-bit channel value to its filtered value.
+// The tone filters (lighten, darken and clarendon) only depend on the
+// channel value and the scale factor, so the double-precision formula is
+// evaluated once per possible value and the kernel becomes table lookups.
+//
+// The SIMD kernels use the table's fixed-point form instead:
+// value[c] == g(c) for a darkening table and 255 - g(255 - c) for a
+// lightening one, where g(x) = (x * multiplier + bias) >> 16 and bias is
+// 0xFFFF if round_up is set and 0 otherwise. If fixed is false no 16-bit
+// multiplier reproduces the table and only the table is used.
+struct ToneTable
+{
+    unsigned char value[256];
+    bool fixed = false;
+    bool complement = false;    // g is applied to 255 - c
+    bool round_up = false;
+    unsigned int multiplier = 0;
+};
+
+// g(x) of a table's fixed-point form, see ToneTable
+inline int fixed_tone(const ToneTable& table, int x)
+{
+    return (x * table.multiplier + (table.round_up ? 0xFFFF : 0)) >> 16;
+}
+
+/**
+ * Gives a table its fixed-point form (see ToneTable).
+ * In Exact mode the multiplier is worked out from the table: every entry
+ * bounds it to a range, and the smallest multiplier in all the ranges is
+ * used, after checking it against all 256 entries. If the ranges do not
+ * meet the table keeps no fixed-point form.
+ * In Fast mode the multiplier is scaling_factor rounded down to 16 bits
+ * and the table is rewritten from it, so the table and the SIMD kernels
+ * agree. The multiplier is then at most 2^-16 below the factor, so x times
+ * it is less than 255/65536 below x times the factor: g(x) is the exact
+ * value or 1 less, and so every channel is the Exact result or differs
+ * from it by 1.
+ * @param table          the table, filled in from the double formula
+ * @param scaling_factor the scale factor it was built from
+ * @param complement     true for a lightening table
+ * @return nothing
+ */
+void set_fixed_point(ToneTable& table, double scaling_factor, bool complement)
+{
+    table.complement = complement;
+    int flip = complement ? 255 : 0;
+
+    if (scale_mode == ScaleMode::Fast && scaling_factor >= 0 && scaling_factor <= 1)
+    {
+        table.multiplier = min(65535, (int)(scaling_factor * 65536));
+        table.round_up = complement;
+        table.fixed = true;
+        for (int c = 0; c < 256; c++)
+        {
+            table.value[c] = fixed_tone(table, c ^ flip) ^ flip;
+        }
+        return;
+    }
+
+    for (int round_up = 0; round_up < 2; round_up++)
+    {
+        // target << 16 <= x * multiplier + bias < (target + 1) << 16
+        long long bias = round_up ? 0xFFFF : 0;
+        long long low = 0;
+        long long high = 0xFFFF;
+        for (int x = 1; x < 256; x++)
+        {
+            long long target = table.value[x ^ flip] ^ flip;
+            long long least = (target << 16) - bias;
+            long long most = ((target + 1) << 16) - 1 - bias;
+            low = max(low, least <= 0 ? 0 : (least + x - 1) / x);
+            high = min(high, most < 0 ? -1 : most / x);
+        }
+        if (low > high)
+        {
+            continue;
+        }
+        table.multiplier = low;
+        table.round_up = round_up;
+        table.fixed = true;
+        for (int c = 0; c < 256; c++)
+        {
+            if ((fixed_tone(table, c ^ flip) ^ flip) != table.value[c])
+            {
+                table.fixed = false;
+            }
+        }
+        if (table.fixed)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * Builds the table for 255 - (255 - c) * scaling_factor (process_8 and the
+ * bright pixels of process_2), truncated the same way as the formula
+ * @param scaling_factor the lighten scale factor
+ * @return the table
+ */
+ToneTable make_lighten_table(double scaling_factor)
+{
+    ToneTable table;
+    for (int c = 0; c < 256; c++)
+    {
+        table.value[c] = (int)(255 - (255 - c)*scaling_factor);
+    }
+    set_fixed_point(table, scaling_factor, true);
+    return table;
+}
+
+/**
+ * Builds the table for c * scaling_factor (process_9 and the dark pixels of
+ * process_2), truncated the same way as the formula
+ * @param scaling_factor the darken scale factor
+ * @return the table
+ */
+ToneTable make_darken_table(double scaling_factor)
+{
+    ToneTable table;
+    for (int c = 0; c < 256; c++)
+    {
+        table.value[c] = (int)(c*scaling_factor);
+    }
+    set_fixed_point(table, scaling_factor, false);
+    return table;
+}
+
+/**
+ * The vignette scale factor of the original process_1 at a distance from
+ * the centre, worked out with the same double-precision expression
+ * @param dr       row distance from the centre
+ * @param dc       column distance from the centre
+ * @param num_rows image height
+ * @param strength VignetteParams::strength
+ * @return the factor; negative in the far corners of wide images
+ */
+double vignette_factor(int dr, int dc, int num_rows, double strength)
+{
+    double distance = sqrt(pow(dc,2) + pow(dr,2));
+    return (num_rows-strength*distance)/num_rows;
+}
+
+// Precomputed vignette scale factors for one image size. The factor only
+// depends on the row and column distance from the centre, so only one
+// quarter is stored: factor[(dr - first_distance) * mask_columns + dc] for
+// dr = |row - centre row| and dc = |column - centre column|. A mask can
+// also cover just the distances needed by a band of rows.
+//
+// Factors are stored in fixed point, as floor(|f| * 65536) with the sign
+// of the double factor f, so the kernels scale channels with integer
+// multiplies. For a channel c, c * floor(|f| * 65536) is at most c below
+// c * |f| * 65536, so its top bits are trunc(c * f) unless its low 16 bits
+// are within c of the next multiple of 65536. Exact mode redoes just
+// those channels with the double factor; Fast mode keeps the fixed-point
+// result, which is then 1 closer to zero than the double one.
+struct VignetteMask
+{
+    int num_rows = 0;
+    int num_columns = 0;
+    VignetteParams params;
+    int center_row = 0;
+    int center_column = 0;
+    int first_distance = 0;
+    int mask_rows = 0;
+    int mask_columns = 0;
+    vector<int> factor;
+    // False if a factor is too large for fixed point (|f| of 128 or more,
+    // from an extreme strength); every channel then uses the double factor
+    bool fixed = true;
+
+    // The factors for the distances from the centre column, for an image row
+    const int* row(int image_row) const
+    {
+        return factor.data() + (size_t)(abs(image_row - center_row) - first_distance) * mask_columns;
+    }
+};
+
+/**
+ * Scales a pixel by a vignette factor, giving the same bytes as
+ * (int)(channel * f) with the double factor f (see VignetteMask)
+ * @param in     the input pixel
+ * @param out    where the result goes (may be the same as in)
+ * @param fixed  the fixed-point factor
+ * @param dr     row distance from the centre
+ * @param dc     column distance from the centre
+ * @param mask   the mask the factor is from
+ * @return nothing
+ */
+inline void vignette_pixel(const Pixel& in, Pixel& out, int fixed, int dr, int dc, const VignetteMask& mask)
+{
+    unsigned int red_color = in.red;
+    unsigned int green_color = in.green;
+    unsigned int blue_color = in.blue;
+    unsigned int magnitude = abs(fixed);
+    unsigned int red = red_color * magnitude;
+    unsigned int green = green_color * magnitude;
+    unsigned int blue = blue_color * magnitude;
+    // Each sum is below 0x20000, so the OR reaches 0x10000 if any does
+    unsigned int near_step = ((red & 0xFFFF) + red_color) | ((green & 0xFFFF) + green_color)
+                             | ((blue & 0xFFFF) + blue_color);
+    if (near_step >= 0x10000 || !mask.fixed)
+    {
+        // The factor is negative in the far corners of wide images, so
+        // truncate to int first and let the byte wrap around
+        double scaling_factor = vignette_factor(dr, dc, mask.num_rows, mask.params.strength);
+        out.red = (int)(red_color * scaling_factor);
+        out.green = (int)(green_color * scaling_factor);
+        out.blue = (int)(blue_color * scaling_factor);
+        return;
+    }
+    int sign = fixed >> 31;
+    out.red = ((int)(red >> 16) ^ sign) - sign;
+    out.green = ((int)(green >> 16) ^ sign) - sign;
+    out.blue = ((int)(blue >> 16) ^ sign) - sign;
+}
+
+// Fast mode version of vignette_pixel(). A negative factor goes the exact
+// way: truncating its magnitude wraps a channel to 0 where truncating the
+// product toward zero wraps it to 255, so those are not within 1.
+inline void vignette_pixel_fast(const Pixel& in, Pixel& out, int fixed, int dr, int dc, const VignetteMask& mask)
+{
+    if (fixed < 0)
+    {
+        vignette_pixel(in, out, fixed, dr, dc, mask);
+        return;
+    }
+    out.red = (in.red * fixed) >> 16;
+    out.green = (in.green * fixed) >> 16;
+    out.blue = (in.blue * fixed) >> 16;
+}
+
+/**
+ * Computes a vignette mask. The factors are worked out with the same
+ * double-precision expression as the original process_1 before they are
+ * put in fixed point, so in Exact mode the filtered pixels are
+ * bit-identical.
+ * @param num_rows    image height
+ * @param num_columns image width
+ * @param params      vignette settings
+ * @param row_begin   first image row the mask must cover
+ * @param row_end     one past the last row (-1 for all rows)
+ * @return the mask
+ */
+VignetteMask make_vignette_mask(int num_rows, int num_columns, const VignetteParams& params,
+                                int row_begin = 0, int row_end = -1)
+{
+    if (row_end < 0)
+    {
+        row_end = num_rows;
+    }
+
+    VignetteMask mask;
+    mask.num_rows = num_rows;
+    mask.num_columns = num_columns;
+    mask.params = params;
+    mask.center_row = params.center_row < 0 ? num_rows/2 : params.center_row;
+    mask.center_column = params.center_column < 0 ? num_columns/2 : params.center_column;
+
+    // Range of row distances from the centre within [row_begin, row_end)
+    int near = abs(row_begin - mask.center_row);
+    int far = abs(row_end - 1 - mask.center_row);
+    bool spans_center = row_begin <= mask.center_row && mask.center_row < row_end;
+    mask.first_distance = spans_center ? 0 : min(near, far);
+    mask.mask_rows = max(near, far) - mask.first_distance + 1;
+    mask.mask_columns = max(mask.center_column, num_columns - 1 - mask.center_column) + 1;
+    mask.factor.resize((size_t)mask.mask_rows * mask.mask_columns);
+
+    atomic<bool> fixed{true};
+    parallel_rows(mask.mask_rows, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            int dr = mask.first_distance + i;
+            int* factor = mask.factor.data() + (size_t)i * mask.mask_columns;
+            for (int dc = 0; dc < mask.mask_columns; dc++)
+            {
+                double f = vignette_factor(dr, dc, num_rows, params.strength);
+                if (abs(f) >= 128)
+                {
+                    fixed = false;
+                    f = 0;
+                }
+                int magnitude = (int)floor(abs(f) * 65536);
+                factor[dc] = f < 0 ? -magnitude : magnitude;
+            }
+        }
+    });
+    mask.fixed = fixed;
+    return mask;
+}
+
+// Keeps the most recently used vignette masks so a batch of same-size
+// photos computes the falloff once. Safe to use from several threads.
+class VignetteMaskCache
+{
+public:
+    // At most this many masks, and this many bytes of masks, are kept
+    static const int MAX_ENTRIES = 4;
+    static const size_t MAX_BYTES = 256 << 20;
+
+    /**
+     * Returns the mask for an image size, computing it on a miss
+     * @param num_rows    image height
+     * @param num_columns image width
+     * @param params      vignette settings
+     * @return the mask
+     */
+    shared_ptr<const VignetteMask> get(int num_rows, int num_columns, const VignetteParams& params)
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            for (auto it = entries.begin(); it != entries.end(); ++it)
+            {
+                const VignetteMask& mask = **it;
+                if (mask.num_rows == num_rows && mask.num_columns == num_columns && mask.params == params)
+                {
+                    // Move to the front, it is now the most recently used
+                    entries.splice(entries.begin(), entries, it);
+                    hits++;
+                    return entries.front();
+                }
+            }
+            misses++;
+        }
+
+        auto mask = make_shared<const VignetteMask>(make_vignette_mask(num_rows, num_columns, params));
+        size_t bytes = mask->factor.size() * sizeof(int);
+        if (bytes <= MAX_BYTES)
+        {
+            lock_guard<mutex> guard(lock);
+            entries.push_front(mask);
+            held_bytes += bytes;
+            while ((int)entries.size() > MAX_ENTRIES || held_bytes > MAX_BYTES)
+            {
+                held_bytes -= entries.back()->factor.size() * sizeof(int);
+                entries.pop_back();
+            }
+        }
+        return mask;
+    }
+
+    long long hit_count() const
+    {
+        return hits;
+    }
+
+    long long miss_count() const
+    {
+        return misses;
+    }
+
+private:
+    mutex lock;
+    list<shared_ptr<const VignetteMask>> entries;
+    size_t held_bytes = 0;
+    atomic<long long> hits{0};
+    atomic<long long> misses{0};
+};
+
+VignetteMaskCache vignette_masks;
+
+void vignette_pixels(const Pixel* in, Pixel* out, int row, int begin, int end, const VignetteMask& mask)
+{
+    const int* factor = mask.row(row);
+    int dr = abs(row - mask.center_row);
+    if (scale_mode == ScaleMode::Fast && mask.fixed)
+    {
+        for (int col = begin; col < end; col++)
+        {
+            int dc = abs(col - mask.center_column);
+            vignette_pixel_fast(in[col], out[col], factor[dc], dr, dc, mask);
+        }
+        return;
+    }
+
+    for (int col = begin; col < end; col++)
+    {
+        int dc = abs(col - mask.center_column);
+        vignette_pixel(in[col], out[col], factor[dc], dr, dc, mask);
+    }
+}
+
+void clarendon_pixels(const Pixel* in, Pixel* out, int begin, int end, const ToneTable& bright, const ToneTable& dark)
+{
+    for (int col = begin; col < end; col++)
+    {
+        int red_color = in[col].red;
+        int green_color = in[col].green; 
+        int blue_color = in[col].blue;
+        
+        int average_value = (red_color + green_color + blue_color)/3;
+        
+        // Pick the table by the pixel average: bright pixels are lightened,
+        // dark pixels are darkened and the rest are left alone
+        const ToneTable* table = nullptr;
+        if (average_value >= 170)
+        {
+            table = &bright;
+        }
+        else if (average_value < 90)
+        {
+            table = &dark;
+        }
+        
+        if (table != nullptr)
+        {
+            out[col].red = table->value[red_color];
+            out[col].green = table->value[green_color];
+            out[col].blue = table->value[blue_color];
+        }
+        else
+        {
+            out[col] = in[col];
+        }
+    }
+}
+
+void grayscale_pixels(const Pixel* in, Pixel* out, int begin, int end)
+{
+    for (int col = begin; col < end; col++)
+    {
+        int red_color = in[col].red;
+        int green_color = in[col].green; 
+        int blue_color = in[col].blue;
+        
+        int gray_value = (red_color + green_color + blue_color)/3;
+        out[col].red = gray_value;
+        out[col].green = gray_value;
+        out[col].blue = gray_value;
+    }
+}
+
+void high_contrast_pixels(const Pixel* in, Pixel* out, int begin, int end)
+{
+    for (int col = begin; col < end; col++)
+    {
+        int red_color = in[col].red;
+        int green_color = in[col].green; 
+        int blue_color = in[col].blue;
+        
+        int gray_value = (red_color + green_color + blue_color)/3;
+        int value = gray_value >= 255/2 ? 255 : 0;
+        out[col].red = value;
+        out[col].green = value;
+        out[col].blue = value;
+    }
+}
+
+void tone_pixels(const Pixel* in, Pixel* out, int begin, int end, const ToneTable& table)
+{
+    for (int col = begin; col < end; col++)
+    {
+        out[col].red = table.value[in[col].red];
+        out[col].green = table.value[in[col].green];
+        out[col].blue = table.value[in[col].blue];
+    }
+}
+
+void primary_colors_pixels(const Pixel* in, Pixel* out, int begin, int end)
+{
+    for (int col = begin; col < end; col++)
+    {
+        int red_color = in[col].red;
+        int green_color = in[col].green; 
+        int blue_color = in[col].blue;
+        
+        int max_a = max(red_color, green_color);
+        int max_color = max(max_a, blue_color);
+        
+        if (red_color + green_color + blue_color >= 550)
+        {
+            out[col] = {255, 255, 255};
+        }
+        else if (red_color + green_color + blue_color <= 150)
+        {
+            out[col] = {0, 0, 0};
+        }
+        else if (max_color == red_color)
+        {
+            out[col] = {0, 0, 255};
+        }
+        else if (max_color == green_color)
+        {
+            out[col] = {0, 255, 0};
+        }
+        else
+        {
+            out[col] = {255, 0, 0};
+        }
+    }
+}
+
+
+//***************************************************************************************************//
+//                                     SIMD row kernels                                              //
+//***************************************************************************************************//
+
+// These kernels work directly on packed blue, green, red bytes. Every byte
+// lane is given the three channels of the pixel it belongs to: the row is
+// loaded five times, shifted by -2 to +2 bytes, and each lane picks its
+// blue, green and red bytes from those loads by its position in the pixel
+// (its phase). The filter is then computed in every lane and each lane
+// keeps the channel it holds. A group of three registers covers a whole
+// number of pixels, so all lanes of a pixel are in the same group.
+//
+// A kernel starts at column 1 (so the load two bytes back stays inside the
+// row), handles as many whole groups as fit and returns the column where
+// it stopped. The wrappers run the scalar code for column 0 and the tail.
+// All loads of a group are done before its stores, and a lane only uses
+// bytes of its own pixel, so in and out may be the same row.
+//
+// The sum of a pixel needs 16 bits. (r+g+b)/3 is computed exactly for all
+// sums 0..765 as (sum * 43691) >> 17.
+
+// Signature of a SIMD row kernel, see above
+typedef int (*SimdRowKernel)(const Pixel* in, Pixel* out, int num_columns);
+
+int scalar_kernel(const Pixel*, Pixel*, int)
+{
+    return 1;
+}
+
+// Shuffle plan for repeating every pixel of a row xscale times (xscale of
+// 2 or more) with 16-byte shuffles. Output chunk j, bytes 16j to 16j+15,
+// is a shuffle of the 16 source bytes starting at offsets[j % period] +
+// 48 * (j / period), using the mask at 16 * (j % period). One period of
+// 3 * xscale chunks uses up exactly 16 source pixels (48 bytes).
+struct ReplicatePlan
+{
+    int xscale = 1;
+    int period = 0;
+    vector<unsigned char> masks;
+    vector<int> offsets;
+};
+
+ReplicatePlan make_replicate_plan(int xscale)
+{
+    ReplicatePlan plan;
+    plan.xscale = xscale;
+    plan.period = 3 * xscale;
+    plan.masks.resize(16 * plan.period);
+    plan.offsets.resize(plan.period);
+    for (int j = 0; j < plan.period; j++)
+    {
+        int first = 3 * (16 * j / (3 * xscale));
+        plan.offsets[j] = first;
+        for (int k = 0; k < 16; k++)
+        {
+            int byte = 16 * j + k;
+            plan.masks[16 * j + k] = 3 * (byte / (3 * xscale)) + byte % 3 - first;
+        }
+    }
+    return plan;
+}
+
+// Signature of a kernel that repeats pixels horizontally. It writes whole
+// chunks from the start of the output row and returns the first output
+// column that still needs to be written.
+typedef int (*SimdReplicateKernel)(const Pixel* in, Pixel* out, int num_columns, const ReplicatePlan& plan);
+
+int scalar_replicate_kernel(const Pixel*, Pixel*, int, const ReplicatePlan&)
+{
+    return 0;
+}
+
+// Signatures of the kernels for lighten and darken (one table) and for
+// clarendon (a lightening and a darkening table). They use the tables'
+// fixed-point form (see ToneTable). A tone kernel makes no shifted loads,
+// so it starts at column 0; a clarendon kernel needs the pixel sums and
+// starts at column 1 like the kernels above.
+typedef int (*SimdToneKernel)(const Pixel* in, Pixel* out, int num_columns, const ToneTable& table);
+typedef int (*SimdClarendonKernel)(const Pixel* in, Pixel* out, int num_columns,
+                                   const ToneTable& bright, const ToneTable& dark);
+
+int scalar_tone_kernel(const Pixel*, Pixel*, int, const ToneTable&)
+{
+    return 0;
+}
+
+int scalar_clarendon_kernel(const Pixel*, Pixel*, int, const ToneTable&, const ToneTable&)
+{
+    return 1;
+}
+
+// Signature of the vignette kernel. It filters the columns from begin
+// towards end, which must both be on the same side of the centre column,
+// and returns the column it stopped at.
+typedef int (*SimdVignetteKernel)(const Pixel* in, Pixel* out, int row, int begin, int end, const VignetteMask& mask);
+
+int scalar_vignette_kernel(const Pixel*, Pixel*, int, int begin, int, const VignetteMask&)
+{
+    return begin;
+}
+
+// Downscale weights are in Q14. The vertical pass keeps 7 fractional bits
+// in its 16-bit results, so both passes fit their sums in 32 bits.
+const int DOWNSCALE_WEIGHT_BITS = 14;
+const int DOWNSCALE_ONE = 1 << DOWNSCALE_WEIGHT_BITS;
+const int DOWNSCALE_MID_BITS = 7;
+
+// The source positions and weights of every output position along one
+// axis of a downscale. Output position i is the sum over k < count of
+// weight[i * count + k] times source position start[i] + k. Every output
+// has count taps; the unused ones at the end have weight 0 and may be
+// past the end of the source. pairs holds the weights two by two, packed
+// in 32 bits for madd, padded with a zero weight if count is odd.
+struct DownscaleTaps
+{
+    int count = 0;
+    int pair_count = 0;
+    vector<int> start;
+    vector<short> weight;
+    vector<int> pairs;
+};
+
+/**
+ * Weighs source rows together, the vertical pass of a downscale
+ * @param rows    the source rows of an output row, as bytes
+ * @param weights one per source row, in Q14
+ * @param taps    the number of source rows
+ * @param out     receives one value per channel byte, with
+ *                DOWNSCALE_MID_BITS fractional bits
+ * @param begin   first channel byte
+ * @param end     one past the last
+ * @return nothing
+ */
+void downscale_vertical_values(const unsigned char* const* rows, const short* weights, int taps, short* out,
+                               int begin, int end)
+{
+    int shift = DOWNSCALE_WEIGHT_BITS - DOWNSCALE_MID_BITS;
+    for (int i = begin; i < end; i++)
+    {
+        int sum = 1 << (shift - 1);
+        for (int k = 0; k < taps; k++)
+        {
+            sum += weights[k] * rows[k][i];
+        }
+        out[i] = sum >> shift;
+    }
+}
+
+/**
+ * Weighs the values of the vertical pass together along the row, the
+ * horizontal pass of a downscale
+ * @param in    values from downscale_vertical_values(), 3 per source column
+ * @param out   the output row
+ * @param begin first output column
+ * @param end   one past the last
+ * @param taps  the horizontal taps
+ * @return nothing
+ */
+void downscale_horizontal_pixels(const short* in, Pixel* out, int begin, int end, const DownscaleTaps& taps)
+{
+    int shift = DOWNSCALE_WEIGHT_BITS + DOWNSCALE_MID_BITS;
+    unsigned char* dst = (unsigned char*)out;
+    for (int col = begin; col < end; col++)
+    {
+        const short* src = in + 3 * taps.start[col];
+        const short* weight = taps.weight.data() + (size_t)col * taps.count;
+        int sum[3] = {1 << (shift - 1), 1 << (shift - 1), 1 << (shift - 1)};
+        for (int k = 0; k < taps.count; k++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                sum[c] += weight[k] * src[3 * k + c];
+            }
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            dst[3 * col + c] = sum[c] >> shift;
+        }
+    }
+}
+
+// Signatures of the downscale kernels. The vertical kernel computes
+// channel bytes from 0 and the horizontal kernel output columns from 0;
+// both return where they stopped. They give the same results as the
+// scalar passes above.
+typedef int (*SimdDownscaleVerticalKernel)(const unsigned char* const* rows, const short* weights, int taps,
+                                           short* out, int num_values);
+typedef int (*SimdDownscaleHorizontalKernel)(const short* in, Pixel* out, int num_columns, const DownscaleTaps& taps);
+
+int scalar_downscale_vertical_kernel(const unsigned char* const*, const short*, int, short*, int)
+{
+    return 0;
+}
+
+int scalar_downscale_horizontal_kernel(const short*, Pixel*, int, const DownscaleTaps&)
+{
+    return 0;
+}
+
+/**
+ * Weighs rows of channel bytes together, the inner loop of convolve().
+ * Each row pointer is one tap of the kernel, already moved to its column,
+ * so a single call covers a whole 2D kernel.
+ * @param rows    one per tap
+ * @param weights one per tap, with shift fractional bits
+ * @param taps    the number of taps
+ * @param shift   fractional bits of the weights
+ * @param out     receives the channel bytes, clamped to 0..255
+ * @param begin   first channel byte
+ * @param end     one past the last
+ * @return nothing
+ */
+void convolve_bytes(const unsigned char* const* rows, const short* weights, int taps, int shift, unsigned char* out,
+                    int begin, int end)
+{
+    int round = shift > 0 ? 1 << (shift - 1) : 0;
+    for (int i = begin; i < end; i++)
+    {
+        int sum = round;
+        for (int k = 0; k < taps; k++)
+        {
+            sum += weights[k] * rows[k][i];
+        }
+        out[i] = max(0, min(255, sum >> shift));
+    }
+}
+
+/**
+ * Weighs the values of a vertical pass together along the row, the
+ * horizontal pass of a separable blur: out[i] is the sum over the taps of
+ * weights[k] * in[k][i]
+ * @param in      one per tap, into values from downscale_vertical_values()
+ *                moved along by 3 values (one pixel) per tap
+ * @param weights one per tap, in Q14
+ * @param taps    the number of taps
+ * @param out     receives the channel bytes
+ * @param begin   first channel byte
+ * @param end     one past the last
+ * @return nothing
+ */
+void convolve_values(const short* const* in, const short* weights, int taps, unsigned char* out, int begin, int end)
+{
+    int shift = DOWNSCALE_WEIGHT_BITS + DOWNSCALE_MID_BITS;
+    for (int i = begin; i < end; i++)
+    {
+        int sum = 1 << (shift - 1);
+        for (int k = 0; k < taps; k++)
+        {
+            sum += weights[k] * in[k][i];
+        }
+        out[i] = max(0, min(255, sum >> shift));
+    }
+}
+
+/**
+ * The magnitude of the Sobel gradient, rounded to nearest even like
+ * cvtps2dq, for channel bytes of a row. The three rows are padded by one
+ * pixel on the left, so channel byte i is at offset i + 3.
+ * @param above the row above
+ * @param row   the row itself
+ * @param below the row below
+ * @param out   receives the channel bytes
+ * @param begin first channel byte
+ * @param end   one past the last
+ * @return nothing
+ */
+void sobel_values(const unsigned char* above, const unsigned char* row, const unsigned char* below, unsigned char* out,
+                  int begin, int end)
+{
+    for (int i = begin; i < end; i++)
+    {
+        int gx = (above[i + 6] + 2 * row[i + 6] + below[i + 6]) - (above[i] + 2 * row[i] + below[i]);
+        int gy = (below[i] + 2 * below[i + 3] + below[i + 6]) - (above[i] + 2 * above[i + 3] + above[i + 6]);
+        out[i] = min(255L, lrintf(sqrtf((float)(gx * gx + gy * gy))));
+    }
+}
+
+// Rounded division by the odd number of pixels in a box blur window, as
+// a multiply: (sum + half) * multiplier >> (32 + shift). With shift =
+// floor(log2(count)) and the multiplier rounded up this is exact for
+// every sum up to 255 * count, as long as count is below 2^23.
+struct BoxDivisor
+{
+    unsigned int half = 0;
+    unsigned int multiplier = 0;
+    int shift = 0;
+};
+
+/**
+ * Slides the column sums of a box blur down one row
+ * @param sums  one per channel byte
+ * @param add   the row entering the window
+ * @param sub   the row leaving it
+ * @param begin first channel byte
+ * @param end   one past the last
+ * @return nothing
+ */
+void box_add_rows(int* sums, const unsigned char* add, const unsigned char* sub, int begin, int end)
+{
+    for (int i = begin; i < end; i++)
+    {
+        sums[i] += add[i] - sub[i];
+    }
+}
+
+/**
+ * Turns the window sums of a box blur into means
+ * @param sums    one per channel byte
+ * @param out     receives the channel bytes
+ * @param begin   first channel byte
+ * @param end     one past the last
+ * @param divisor the window size
+ * @return nothing
+ */
+void box_divide(const int* sums, unsigned char* out, int begin, int end, const BoxDivisor& divisor)
+{
+    for (int i = begin; i < end; i++)
+    {
+        unsigned long long product = (unsigned long long)(unsigned int)(sums[i] + divisor.half) * divisor.multiplier;
+        out[i] = (unsigned int)(product >> 32) >> divisor.shift;
+    }
+}
+
+// Signatures of the convolution kernels. Each computes channel bytes from
+// 0 and returns where it stopped, with the same results as the scalar
+// functions above.
+typedef int (*SimdConvolveBytesKernel)(const unsigned char* const* rows, const short* weights, int taps, int shift,
+                                       unsigned char* out, int num_values);
+typedef int (*SimdConvolveValuesKernel)(const short* const* in, const short* weights, int taps, unsigned char* out,
+                                        int num_values);
+typedef int (*SimdSobelKernel)(const unsigned char* above, const unsigned char* row, const unsigned char* below,
+                               unsigned char* out, int num_values);
+typedef int (*SimdBoxAddKernel)(int* sums, const unsigned char* add, const unsigned char* sub, int num_values);
+typedef int (*SimdBoxDivideKernel)(const int* sums, unsigned char* out, int num_values, const BoxDivisor& divisor);
+
+int scalar_convolve_bytes_kernel(const unsigned char* const*, const short*, int, int, unsigned char*, int)
+{
+    return 0;
+}
+
+int scalar_convolve_values_kernel(const short* const*, const short*, int, unsigned char*, int)
+{
+    return 0;
+}
+
+int scalar_sobel_kernel(const unsigned char*, const unsigned char*, const unsigned char*, unsigned char*, int)
+{
+    return 0;
+}
+
+int scalar_box_add_kernel(int*, const unsigned char*, const unsigned char*, int)
+{
+    return 0;
+}
+
+int scalar_box_divide_kernel(const int*, unsigned char*, int, const BoxDivisor&)
+{
+    return 0;
+}
+
+#if defined(IMAGE_X86)
+
+// Byte masks of the lanes holding blue (0), green (1) and red (2) for a
+// group of three registers of up to 64 bytes
+struct PhaseMasks
+{
+    alignas(64) unsigned char bytes[3][192];
+    __mmask64 bits[3][3];   // [register][phase] for 64-byte registers
+
+    PhaseMasks()
+    {
+        for (int phase = 0; phase < 3; phase++)
+        {
+            for (int k = 0; k < 192; k++)
+            {
+                bytes[phase][k] = k % 3 == phase ? 0xFF : 0;
+            }
+            for (int j = 0; j < 3; j++)
+            {
+                bits[j][phase] = 0;
+                for (int i = 0; i < 64; i++)
+                {
+                    if ((64 * j + i) % 3 == phase)
+                    {
+                        bits[j][phase] |= (__mmask64)1 << i;
+                    }
+                }
+            }
+        }
+    }
+};
+
+const PhaseMasks phase_masks;
+
+// SSE2, 16 pixels per group
+
+struct Planes128
+{
+    __m128i blue, green, red;               // Channels of each lane's pixel
+    __m128i is_blue, is_green, is_red;      // Phase masks
+    __m128i sum_lo, sum_hi;                 // 16-bit channel sums
+};
+
+__attribute__((target("sse2")))
+inline Planes128 load_planes_sse2(const unsigned char* group, int j)
+{
+    const unsigned char* p = group + 16 * j;
+    Planes128 planes;
+    planes.is_blue = _mm_load_si128((const __m128i*)(phase_masks.bytes[0] + 16 * j));
+    planes.is_green = _mm_load_si128((const __m128i*)(phase_masks.bytes[1] + 16 * j));
+    planes.is_red = _mm_load_si128((const __m128i*)(phase_masks.bytes[2] + 16 * j));
+    __m128i m2 = _mm_loadu_si128((const __m128i*)(p - 2));
+    __m128i m1 = _mm_loadu_si128((const __m128i*)(p - 1));
+    __m128i p0 = _mm_loadu_si128((const __m128i*)p);
+    __m128i p1 = _mm_loadu_si128((const __m128i*)(p + 1));
+    __m128i p2 = _mm_loadu_si128((const __m128i*)(p + 2));
+    auto pick = [&](__m128i if_blue, __m128i if_green, __m128i if_red)
+    {
+        return _mm_or_si128(_mm_or_si128(_mm_and_si128(planes.is_blue, if_blue),
+                                         _mm_and_si128(planes.is_green, if_green)),
+                            _mm_and_si128(planes.is_red, if_red));
+    };
+    planes.blue = pick(p0, m1, m2);
+    planes.green = pick(p1, p0, m1);
+    planes.red = pick(p2, p1, p0);
+
+    __m128i zero = _mm_setzero_si128();
+    planes.sum_lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(planes.blue, zero),
+                                                _mm_unpacklo_epi8(planes.green, zero)),
+                                  _mm_unpacklo_epi8(planes.red, zero));
+    planes.sum_hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(planes.blue, zero),
+                                                _mm_unpackhi_epi8(planes.green, zero)),
+                                  _mm_unpackhi_epi8(planes.red, zero));
+    return planes;
+}
+
+__attribute__((target("sse2")))
+inline __m128i divide_by_3_sse2(__m128i sum)
+{
+    return _mm_srli_epi16(_mm_mulhi_epu16(sum, _mm_set1_epi16((short)43691)), 1);
+}
+
+__attribute__((target("sse2")))
+int grayscale_sse2(const Pixel* in, Pixel* out, int num_columns)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    int col = 1;
+    for (; col + 17 <= num_columns; col += 16)
+    {
+        __m128i result[3];
+        for (int j = 0; j < 3; j++)
+        {
+            Planes128 planes = load_planes_sse2(src + 3 * col, j);
+            result[j] = _mm_packus_epi16(divide_by_3_sse2(planes.sum_lo), divide_by_3_sse2(planes.sum_hi));
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            _mm_storeu_si128((__m128i*)(dst + 3 * col + 16 * j), result[j]);
+        }
+    }
+    return col;
+}
+
+__attribute__((target("sse2")))
+int high_contrast_sse2(const Pixel* in, Pixel* out, int num_columns)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    // (r+g+b)/3 >= 127 exactly when r+g+b > 380
+    const __m128i threshold = _mm_set1_epi16(380);
+    int col = 1;
+    for (; col + 17 <= num_columns; col += 16)
+    {
+        __m128i result[3];
+        for (int j = 0; j < 3; j++)
+        {
+            Planes128 planes = load_planes_sse2(src + 3 * col, j);
+            result[j] = _mm_packs_epi16(_mm_cmpgt_epi16(planes.sum_lo, threshold),
+                                        _mm_cmpgt_epi16(planes.sum_hi, threshold));
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            _mm_storeu_si128((__m128i*)(dst + 3 * col + 16 * j), result[j]);
+        }
+    }
+    return col;
+}
+
+__attribute__((target("sse2")))
+int primary_colors_sse2(const Pixel* in, Pixel* out, int num_columns)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    const __m128i white_threshold = _mm_set1_epi16(549);
+    const __m128i black_threshold = _mm_set1_epi16(151);
+    const __m128i ones = _mm_set1_epi8(-1);
+    int col = 1;
+    for (; col + 17 <= num_columns; col += 16)
+    {
+        __m128i result[3];
+        for (int j = 0; j < 3; j++)
+        {
+            Planes128 planes = load_planes_sse2(src + 3 * col, j);
+            __m128i white = _mm_packs_epi16(_mm_cmpgt_epi16(planes.sum_lo, white_threshold),
+                                            _mm_cmpgt_epi16(planes.sum_hi, white_threshold));
+            __m128i black = _mm_packs_epi16(_mm_cmplt_epi16(planes.sum_lo, black_threshold),
+                                            _mm_cmplt_epi16(planes.sum_hi, black_threshold));
+
+            // Red wins ties, then green, as in the scalar code
+            __m128i max_color = _mm_max_epu8(_mm_max_epu8(planes.red, planes.green), planes.blue);
+            __m128i red_max = _mm_cmpeq_epi8(planes.red, max_color);
+            __m128i green_max = _mm_andnot_si128(red_max, _mm_cmpeq_epi8(planes.green, max_color));
+            __m128i blue_max = _mm_andnot_si128(_mm_or_si128(red_max, green_max), ones);
+
+            __m128i channel = _mm_or_si128(_mm_or_si128(_mm_and_si128(planes.is_blue, blue_max),
+                                                        _mm_and_si128(planes.is_green, green_max)),
+                                           _mm_and_si128(planes.is_red, red_max));
+            result[j] = _mm_or_si128(white, _mm_andnot_si128(black, channel));
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            _mm_storeu_si128((__m128i*)(dst + 3 * col + 16 * j), result[j]);
+        }
+    }
+    return col;
+}
+
+// Fixed-point form of a tone table, see ToneTable
+struct Tone128
+{
+    __m128i multiplier;
+    __m128i flip;       // All ones for a lightening table, as x ^ 255 is 255 - x
+    __m128i round_up;   // All ones to round up
+};
+
+__attribute__((target("sse2")))
+inline Tone128 load_tone_sse2(const ToneTable& table)
+{
+    Tone128 tone;
+    tone.multiplier = _mm_set1_epi16((short)table.multiplier);
+    tone.flip = _mm_set1_epi8(table.complement ? -1 : 0);
+    tone.round_up = _mm_set1_epi16(table.round_up ? -1 : 0);
+    return tone;
+}
+
+// g(x) in 16-bit lanes: the high half of x * multiplier, plus 1 when
+// rounding up and the low half is not zero
+__attribute__((target("sse2")))
+inline __m128i fixed_tone_sse2(__m128i x, const Tone128& tone)
+{
+    __m128i high = _mm_mulhi_epu16(x, tone.multiplier);
+    __m128i exact = _mm_cmpeq_epi16(_mm_mullo_epi16(x, tone.multiplier), _mm_setzero_si128());
+    return _mm_sub_epi16(high, _mm_andnot_si128(exact, tone.round_up));
+}
+
+// Applies a tone table to 16 channel bytes
+__attribute__((target("sse2")))
+inline __m128i apply_tone_sse2(__m128i bytes, const Tone128& tone)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i x = _mm_xor_si128(bytes, tone.flip);
+    __m128i low = fixed_tone_sse2(_mm_unpacklo_epi8(x, zero), tone);
+    __m128i high = fixed_tone_sse2(_mm_unpackhi_epi8(x, zero), tone);
+    return _mm_xor_si128(_mm_packus_epi16(low, high), tone.flip);
+}
+
+__attribute__((target("sse2")))
+int tone_sse2(const Pixel* in, Pixel* out, int num_columns, const ToneTable& table)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    Tone128 tone = load_tone_sse2(table);
+    int col = 0;
+    for (; col + 16 <= num_columns; col += 16)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(src + 3 * col + 16 * j));
+            _mm_storeu_si128((__m128i*)(dst + 3 * col + 16 * j), apply_tone_sse2(bytes, tone));
+        }
+    }
+    return col;
+}
+
+__attribute__((target("sse2")))
+int clarendon_sse2(const Pixel* in, Pixel* out, int num_columns, const ToneTable& bright, const ToneTable& dark)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    Tone128 lighten = load_tone_sse2(bright);
+    Tone128 darken = load_tone_sse2(dark);
+    // An average of 170 or more is a sum over 509; below 90, a sum under 270
+    const __m128i bright_threshold = _mm_set1_epi16(509);
+    const __m128i dark_threshold = _mm_set1_epi16(270);
+    int col = 1;
+    for (; col + 17 <= num_columns; col += 16)
+    {
+        __m128i result[3];
+        for (int j = 0; j < 3; j++)
+        {
+            Planes128 planes = load_planes_sse2(src + 3 * col, j);
+            __m128i is_bright = _mm_packs_epi16(_mm_cmpgt_epi16(planes.sum_lo, bright_threshold),
+                                                _mm_cmpgt_epi16(planes.sum_hi, bright_threshold));
+            __m128i is_dark = _mm_packs_epi16(_mm_cmplt_epi16(planes.sum_lo, dark_threshold),
+                                              _mm_cmplt_epi16(planes.sum_hi, dark_threshold));
+            __m128i value = _mm_loadu_si128((const __m128i*)(src + 3 * col + 16 * j));
+            __m128i kept = _mm_andnot_si128(_mm_or_si128(is_bright, is_dark), value);
+            result[j] = _mm_or_si128(kept, _mm_or_si128(_mm_and_si128(is_bright, apply_tone_sse2(value, lighten)),
+                                                        _mm_and_si128(is_dark, apply_tone_sse2(value, darken))));
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            _mm_storeu_si128((__m128i*)(dst + 3 * col + 16 * j), result[j]);
+        }
+    }
+    return col;
+}
+
+// SSSE3: horizontal pixel replication for enlarge, one shuffle per 16
+// output bytes
+
+__attribute__((target("ssse3")))
+int replicate_ssse3(const Pixel* in, Pixel* out, int num_columns, const ReplicatePlan& plan)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    long long in_bytes = 3LL * num_columns;
+    long long out_bytes = in_bytes * plan.xscale;
+    long long base = 0;
+    int phase = 0;
+    long long o = 0;
+    for (; o + 16 <= out_bytes; o += 16)
+    {
+        long long s = base + plan.offsets[phase];
+        if (s + 16 > in_bytes)
+        {
+            break;
+        }
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(src + s));
+        __m128i mask = _mm_loadu_si128((const __m128i*)(plan.masks.data() + 16 * phase));
+        _mm_storeu_si128((__m128i*)(dst + o), _mm_shuffle_epi8(pixels, mask));
+        if (++phase == plan.period)
+        {
+            phase = 0;
+            base += 48;
+        }
+    }
+    return o / 3;
+}
+
+// Downscale, vertical pass, 16 channel bytes per group. Two source rows
+// are interleaved byte by byte and widened to 16 bits, so each 32-bit
+// lane holds the same byte of both rows and one madd weighs them.
+
+__attribute__((target("sse2")))
+int downscale_vertical_sse2(const unsigned char* const* rows, const short* weights, int taps, short* out,
+                            int num_values)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const int shift = DOWNSCALE_WEIGHT_BITS - DOWNSCALE_MID_BITS;
+    const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+    int i = 0;
+    for (; i + 16 <= num_values; i += 16)
+    {
+        __m128i sum[4] = {round, round, round, round};
+        for (int k = 0; k < taps; k += 2)
+        {
+            // An odd last row is paired with zeros
+            bool pair = k + 1 < taps;
+            __m128i a = _mm_loadu_si128((const __m128i*)(rows[k] + i));
+            __m128i b = pair ? _mm_loadu_si128((const __m128i*)(rows[k + 1] + i)) : zero;
+            __m128i weight = _mm_set1_epi32((unsigned short)weights[k] | (pair ? weights[k + 1] << 16 : 0));
+            __m128i low = _mm_unpacklo_epi8(a, b);
+            __m128i high = _mm_unpackhi_epi8(a, b);
+            sum[0] = _mm_add_epi32(sum[0], _mm_madd_epi16(_mm_unpacklo_epi8(low, zero), weight));
+            sum[1] = _mm_add_epi32(sum[1], _mm_madd_epi16(_mm_unpackhi_epi8(low, zero), weight));
+            sum[2] = _mm_add_epi32(sum[2], _mm_madd_epi16(_mm_unpacklo_epi8(high, zero), weight));
+            sum[3] = _mm_add_epi32(sum[3], _mm_madd_epi16(_mm_unpackhi_epi8(high, zero), weight));
+        }
+        for (int j = 0; j < 2; j++)
+        {
+            __m128i values = _mm_packs_epi32(_mm_srai_epi32(sum[2 * j], shift), _mm_srai_epi32(sum[2 * j + 1], shift));
+            _mm_storeu_si128((__m128i*)(out + i + 8 * j), values);
+        }
+    }
+    return i;
+}
+
+// Downscale, horizontal pass, one output pixel at a time. A load covers
+// two neighbouring source pixels, and a shuffle pairs up their channels
+// so one madd weighs two taps of all three channels. The 4 bytes stored
+// run one byte into the next pixel, so the last column is left to the
+// scalar code.
+
+__attribute__((target("ssse3")))
+int downscale_horizontal_ssse3(const short* in, Pixel* out, int num_columns, const DownscaleTaps& taps)
+{
+    unsigned char* dst = (unsigned char*)out;
+    const int shift = DOWNSCALE_WEIGHT_BITS + DOWNSCALE_MID_BITS;
+    const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+    const __m128i pair_channels = _mm_setr_epi8(0, 1, 6, 7, 2, 3, 8, 9, 4, 5, 10, 11, -1, -1, -1, -1);
+    int col = 0;
+    for (; col + 1 < num_columns; col++)
+    {
+        const short* src = in + 3 * taps.start[col];
+        const int* pairs = taps.pairs.data() + (size_t)col * taps.pair_count;
+        __m128i sum = round;
+        for (int k = 0; k < taps.pair_count; k++)
+        {
+            __m128i values = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 6 * k)), pair_channels);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(values, _mm_set1_epi32(pairs[k])));
+        }
+        sum = _mm_srai_epi32(sum, shift);
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(sum, sum), sum);
+        int value = _mm_cvtsi128_si32(bytes);
+        memcpy(dst + 3 * col, &value, 4);
+    }
+    return col;
+}
+
+// Convolution, 16 channel bytes per group, the same interleave and madd
+// as the downscale vertical pass with signed weights, a shift that
+// depends on the kernel and the sums packed with saturation to bytes
+
+__attribute__((target("sse2")))
+int convolve_bytes_sse2(const unsigned char* const* rows, const short* weights, int taps, int shift,
+                        unsigned char* out, int num_values)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(shift > 0 ? 1 << (shift - 1) : 0);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    int i = 0;
+    for (; i + 16 <= num_values; i += 16)
+    {
+        __m128i sum[4] = {round, round, round, round};
+        for (int k = 0; k < taps; k += 2)
+        {
+            bool pair = k + 1 < taps;
+            __m128i a = _mm_loadu_si128((const __m128i*)(rows[k] + i));
+            __m128i b = pair ? _mm_loadu_si128((const __m128i*)(rows[k + 1] + i)) : zero;
+            __m128i weight = _mm_set1_epi32((unsigned short)weights[k]
+                                            | (pair ? (unsigned int)(unsigned short)weights[k + 1] << 16 : 0));
+            __m128i low = _mm_unpacklo_epi8(a, b);
+            __m128i high = _mm_unpackhi_epi8(a, b);
+            sum[0] = _mm_add_epi32(sum[0], _mm_madd_epi16(_mm_unpacklo_epi8(low, zero), weight));
+            sum[1] = _mm_add_epi32(sum[1], _mm_madd_epi16(_mm_unpackhi_epi8(low, zero), weight));
+            sum[2] = _mm_add_epi32(sum[2], _mm_madd_epi16(_mm_unpacklo_epi8(high, zero), weight));
+            sum[3] = _mm_add_epi32(sum[3], _mm_madd_epi16(_mm_unpackhi_epi8(high, zero), weight));
+        }
+        __m128i low = _mm_packs_epi32(_mm_sra_epi32(sum[0], count), _mm_sra_epi32(sum[1], count));
+        __m128i high = _mm_packs_epi32(_mm_sra_epi32(sum[2], count), _mm_sra_epi32(sum[3], count));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(low, high));
+    }
+    return i;
+}
+
+// Separable blur, horizontal pass, 16 channel bytes per group. The values
+// of two taps are interleaved 16 bits at a time for madd.
+
+__attribute__((target("sse2")))
+int convolve_values_sse2(const short* const* in, const short* weights, int taps, unsigned char* out, int num_values)
+{
+    const int shift = DOWNSCALE_WEIGHT_BITS + DOWNSCALE_MID_BITS;
+    const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+    int i = 0;
+    for (; i + 16 <= num_values; i += 16)
+    {
+        __m128i sum[4] = {round, round, round, round};
+        for (int k = 0; k < taps; k += 2)
+        {
+            bool pair = k + 1 < taps;
+            __m128i weight = _mm_set1_epi32((unsigned short)weights[k]
+                                            | (pair ? (unsigned int)(unsigned short)weights[k + 1] << 16 : 0));
+            for (int j = 0; j < 2; j++)
+            {
+                __m128i a = _mm_loadu_si128((const __m128i*)(in[k] + i + 8 * j));
+                __m128i b = pair ? _mm_loadu_si128((const __m128i*)(in[k + 1] + i + 8 * j)) : _mm_setzero_si128();
+                sum[2 * j] = _mm_add_epi32(sum[2 * j], _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weight));
+                sum[2 * j + 1] = _mm_add_epi32(sum[2 * j + 1], _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weight));
+            }
+        }
+        __m128i low = _mm_packs_epi32(_mm_srai_epi32(sum[0], shift), _mm_srai_epi32(sum[1], shift));
+        __m128i high = _mm_packs_epi32(_mm_srai_epi32(sum[2], shift), _mm_srai_epi32(sum[3], shift));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(low, high));
+    }
+    return i;
+}
+
+// Sobel, 8 channel bytes per group. The gradients fit in 16 bits; pairing
+// them up and madd with themselves gives gx^2 + gy^2 in 32 bits, which is
+// below 2^24 and so converts to single precision exactly.
+
+__attribute__((target("sse2")))
+int sobel_sse2(const unsigned char* above, const unsigned char* row, const unsigned char* below, unsigned char* out,
+               int num_values)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 8 <= num_values; i += 8)
+    {
+        __m128i a0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(above + i)), zero);
+        __m128i a1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(above + i + 3)), zero);
+        __m128i a2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(above + i + 6)), zero);
+        __m128i r0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row + i)), zero);
+        __m128i r2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row + i + 6)), zero);
+        __m128i b0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(below + i)), zero);
+        __m128i b1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(below + i + 3)), zero);
+        __m128i b2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(below + i + 6)), zero);
+        __m128i left = _mm_add_epi16(_mm_add_epi16(a0, b0), _mm_slli_epi16(r0, 1));
+        __m128i right = _mm_add_epi16(_mm_add_epi16(a2, b2), _mm_slli_epi16(r2, 1));
+        __m128i top = _mm_add_epi16(_mm_add_epi16(a0, a2), _mm_slli_epi16(a1, 1));
+        __m128i bottom = _mm_add_epi16(_mm_add_epi16(b0, b2), _mm_slli_epi16(b1, 1));
+        __m128i gx = _mm_sub_epi16(right, left);
+        __m128i gy = _mm_sub_epi16(bottom, top);
+        __m128i low = _mm_unpacklo_epi16(gx, gy);
+        __m128i high = _mm_unpackhi_epi16(gx, gy);
+        low = _mm_cvtps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(_mm_madd_epi16(low, low))));
+        high = _mm_cvtps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(_mm_madd_epi16(high, high))));
+        _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(_mm_packs_epi32(low, high), zero));
+    }
+    return i;
+}
+
+// Box blur column sums, 16 channel bytes per group: the difference of the
+// two rows in 16 bits, sign extended to 32
+
+__attribute__((target("sse2")))
+int box_add_rows_sse2(int* sums, const unsigned char* add, const unsigned char* sub, int num_values)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= num_values; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(add + i));
+        __m128i s = _mm_loadu_si128((const __m128i*)(sub + i));
+        __m128i difference[2] = {_mm_sub_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(s, zero)),
+                                 _mm_sub_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(s, zero))};
+        for (int j = 0; j < 2; j++)
+        {
+            __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(difference[j], difference[j]), 16);
+            __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(difference[j], difference[j]), 16);
+            __m128i* p = (__m128i*)(sums + i + 8 * j);
+            _mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), low));
+            _mm_storeu_si128(p + 1, _mm_add_epi32(_mm_loadu_si128(p + 1), high));
+        }
+    }
+    return i;
+}
+
+// Box blur division, 16 channel bytes per group. pmuludq multiplies the
+// even lanes to 64 bits; the odd lanes are shifted down for a second one,
+// and the high halves of both are merged.
+
+__attribute__((target("sse2")))
+int box_divide_sse2(const int* sums, unsigned char* out, int num_values, const BoxDivisor& divisor)
+{
+    const __m128i half = _mm_set1_epi32(divisor.half);
+    const __m128i multiplier = _mm_set1_epi32(divisor.multiplier);
+    const __m128i odd_lanes = _mm_set_epi32(-1, 0, -1, 0);
+    const __m128i count = _mm_cvtsi32_si128(divisor.shift);
+    int i = 0;
+    for (; i + 16 <= num_values; i += 16)
+    {
+        __m128i means[4];
+        for (int j = 0; j < 4; j++)
+        {
+            __m128i x = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(sums + i + 4 * j)), half);
+            __m128i even = _mm_srli_epi64(_mm_mul_epu32(x, multiplier), 32);
+            __m128i odd = _mm_and_si128(_mm_mul_epu32(_mm_srli_epi64(x, 32), multiplier), odd_lanes);
+            means[j] = _mm_srl_epi32(_mm_or_si128(even, odd), count);
+        }
+        __m128i low = _mm_packs_epi32(means[0], means[1]);
+        __m128i high = _mm_packs_epi32(means[2], means[3]);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(low, high));
+    }
+    return i;
+}
+
+// AVX2, 32 pixels per group. unpack and pack both work within 128-bit
+// halves, so the byte order survives the round trip through 16 bits.
+
+struct Planes256
+{
+    __m256i blue, green, red;
+    __m256i is_blue, is_green, is_red;
+    __m256i sum_lo, sum_hi;
+};
+
+__attribute__((target("avx2")))
+inline Planes256 load_planes_avx2(const unsigned char* group, int j)
+{
+    const unsigned char* p = group + 32 * j;
+    Planes256 planes;
+    planes.is_blue = _mm256_load_si256((const __m256i*)(phase_masks.bytes[0] + 32 * j));
+    planes.is_green = _mm256_load_si256((const __m256i*)(phase_masks.bytes[1] + 32 * j));
+    planes.is_red = _mm256_load_si256((const __m256i*)(phase_masks.bytes[2] + 32 * j));
+    __m256i m2 = _mm256_loadu_si256((const __m256i*)(p - 2));
+    __m256i m1 = _mm256_loadu_si256((const __m256i*)(p - 1));
+    __m256i p0 = _mm256_loadu_si256((const __m256i*)p);
+    __m256i p1 = _mm256_loadu_si256((const __m256i*)(p + 1));
+    __m256i p2 = _mm256_loadu_si256((const __m256i*)(p + 2));
+    planes.blue = _mm256_blendv_epi8(_mm256_blendv_epi8(p0, m1, planes.is_green), m2, planes.is_red);
+    planes.green = _mm256_blendv_epi8(_mm256_blendv_epi8(p1, p0, planes.is_green), m1, planes.is_red);
+    planes.red = _mm256_blendv_epi8(_mm256_blendv_epi8(p2, p1, planes.is_green), p0, planes.is_red);
+
+    __m256i zero = _mm256_setzero_si256();
+    planes.sum_lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(planes.blue, zero),
+                                                      _mm256_unpacklo_epi8(planes.green, zero)),
+                                     _mm256_unpacklo_epi8(planes.red, zero));
+    planes.sum_hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(planes.blue, zero),
+                                                      _mm256_unpackhi_epi8(planes.green, zero)),
+                                     _mm256_unpackhi_epi8(planes.red, zero));
+    return planes;
+}
+
+__attribute__((target("avx2")))
+inline __m256i divide_by_3_avx2(__m256i sum)
+{
+    return _mm256_srli_epi16(_mm256_mulhi_epu16(sum, _mm256_set1_epi16((short)43691)), 1);
+}
+
+__attribute__((target("avx2")))
+int grayscale_avx2(const Pixel* in, Pixel* out, int num_columns)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    int col = 1;
+    for (; col + 33 <= num_columns; col += 32)
+    {
+        __m256i result[3];
+        for (int j = 0; j < 3; j++)
+        {
+            Planes256 planes = load_planes_avx2(src + 3 * col, j);
+            result[j] = _mm256_packus_epi16(divide_by_3_avx2(planes.sum_lo), divide_by_3_avx2(planes.sum_hi));
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            _mm256_storeu_si256((__m256i*)(dst + 3 * col + 32 * j), result[j]);
+        }
+    }
+    return col;
+}
+
+__attribute__((target("avx2")))
+int high_contrast_avx2(const Pixel* in, Pixel* out, int num_columns)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    const __m256i threshold = _mm256_set1_epi16(380);
+    int col = 1;
+    for (; col + 33 <= num_columns; col += 32)
+    {
+        __m256i result[3];
+        for (int j = 0; j < 3; j++)
+        {
+            Planes256 planes = load_planes_avx2(src + 3 * col, j);
+            result[j] = _mm256_packs_epi16(_mm256_cmpgt_epi16(planes.sum_lo, threshold),
+                                           _mm256_cmpgt_epi16(planes.sum_hi, threshold));
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            _mm256_storeu_si256((__m256i*)(dst + 3 * col + 32 * j), result[j]);
+        }
+    }
+    return col;
+}
+
+__attribute__((target("avx2")))
+int primary_colors_avx2(const Pixel* in, Pixel* out, int num_columns)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    const __m256i white_threshold = _mm256_set1_epi16(549);
+    const __m256i black_threshold = _mm256_set1_epi16(151);
+    int col = 1;
+    for (; col + 33 <= num_columns; col += 32)
+    {
+        __m256i result[3];
+        for (int j = 0; j < 3; j++)
+        {
+            Planes256 planes = load_planes_avx2(src + 3 * col, j);
+            __m256i white = _mm256_packs_epi16(_mm256_cmpgt_epi16(planes.sum_lo, white_threshold),
+                                               _mm256_cmpgt_epi16(planes.sum_hi, white_threshold));
+            __m256i black = _mm256_packs_epi16(_mm256_cmpgt_epi16(black_threshold, planes.sum_lo),
+                                               _mm256_cmpgt_epi16(black_threshold, planes.sum_hi));
+
+            __m256i max_color = _mm256_max_epu8(_mm256_max_epu8(planes.red, planes.green), planes.blue);
+            __m256i red_max = _mm256_cmpeq_epi8(planes.red, max_color);
+            __m256i green_max = _mm256_andnot_si256(red_max, _mm256_cmpeq_epi8(planes.green, max_color));
+
+            // Blue lanes are set unless red or green is the max
+            __m256i channel = _mm256_blendv_epi8(
+                _mm256_blendv_epi8(_mm256_andnot_si256(_mm256_or_si256(red_max, green_max), planes.is_blue),
+                                   green_max, planes.is_green),
+                red_max, planes.is_red);
+            result[j] = _mm256_or_si256(white, _mm256_andnot_si256(black, channel));
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            _mm256_storeu_si256((__m256i*)(dst + 3 * col + 32 * j), result[j]);
+        }
+    }
+    return col;
+}
+
+struct Tone256
+{
+    __m256i multiplier;
+    __m256i flip;
+    __m256i round_up;
+};
+
+__attribute__((target("avx2")))
+inline Tone256 load_tone_avx2(const ToneTable& table)
+{
+    Tone256 tone;
+    tone.multiplier = _mm256_set1_epi16((short)table.multiplier);
+    tone.flip = _mm256_set1_epi8(table.complement ? -1 : 0);
+    tone.round_up = _mm256_set1_epi16(table.round_up ? -1 : 0);
+    return tone;
+}
+
+__attribute__((target("avx2")))
+inline __m256i fixed_tone_avx2(__m256i x, const Tone256& tone)
+{
+    __m256i high = _mm256_mulhi_epu16(x, tone.multiplier);
+    __m256i exact = _mm256_cmpeq_epi16(_mm256_mullo_epi16(x, tone.multiplier), _mm256_setzero_si256());
+    return _mm256_sub_epi16(high, _mm256_andnot_si256(exact, tone.round_up));
+}
+
+__attribute__((target("avx2")))
+inline __m256i apply_tone_avx2(__m256i bytes, const Tone256& tone)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i x = _mm256_xor_si256(bytes, tone.flip);
+    __m256i low = fixed_tone_avx2(_mm256_unpacklo_epi8(x, zero), tone);
+    __m256i high = fixed_tone_avx2(_mm256_unpackhi_epi8(x, zero), tone);
+    return _mm256_xor_si256(_mm256_packus_epi16(low, high), tone.flip);
+}
+
+__attribute__((target("avx2")))
+int tone_avx2(const Pixel* in, Pixel* out, int num_columns, const ToneTable& table)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    Tone256 tone = load_tone_avx2(table);
+    int col = 0;
+    for (; col + 32 <= num_columns; col += 32)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            __m256i bytes = _mm256_loadu_si256((const __m256i*)(src + 3 * col + 32 * j));
+            _mm256_storeu_si256((__m256i*)(dst + 3 * col + 32 * j), apply_tone_avx2(bytes, tone));
+        }
+    }
+    return col;
+}
+
+__attribute__((target("avx2")))
+int clarendon_avx2(const Pixel* in, Pixel* out, int num_columns, const ToneTable& bright, const ToneTable& dark)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    Tone256 lighten = load_tone_avx2(bright);
+    Tone256 darken = load_tone_avx2(dark);
+    const __m256i bright_threshold = _mm256_set1_epi16(509);
+    const __m256i dark_threshold = _mm256_set1_epi16(270);
+    int col = 1;
+    for (; col + 33 <= num_columns; col += 32)
+    {
+        __m256i result[3];
+        for (int j = 0; j < 3; j++)
+        {
+            Planes256 planes = load_planes_avx2(src + 3 * col, j);
+            __m256i is_bright = _mm256_packs_epi16(_mm256_cmpgt_epi16(planes.sum_lo, bright_threshold),
+                                                   _mm256_cmpgt_epi16(planes.sum_hi, bright_threshold));
+            __m256i is_dark = _mm256_packs_epi16(_mm256_cmpgt_epi16(dark_threshold, planes.sum_lo),
+                                                 _mm256_cmpgt_epi16(dark_threshold, planes.sum_hi));
+            __m256i value = _mm256_loadu_si256((const __m256i*)(src + 3 * col + 32 * j));
+            __m256i toned = _mm256_blendv_epi8(apply_tone_avx2(value, darken), apply_tone_avx2(value, lighten),
+                                               is_bright);
+            result[j] = _mm256_blendv_epi8(value, toned, _mm256_or_si256(is_bright, is_dark));
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            _mm256_storeu_si256((__m256i*)(dst + 3 * col + 32 * j), result[j]);
+        }
+    }
+    return col;
+}
+
+// Vignette, 8 pixels (24 channels in three vectors of 32-bit lanes) per
+// group. The fixed-point factors of the group are loaded with one load,
+// forwards right of the centre column and backwards left of it, and
+// spread to the channels with a permute. A group where some channel is
+// too close to rounding the other way is redone with vignette_pixel(), and
+// so in Fast mode is one with a negative factor.
+__attribute__((target("avx2")))
+int vignette_avx2(const Pixel* in, Pixel* out, int row, int begin, int end, const VignetteMask& mask)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    const int* factor = mask.row(row);
+    int dr = abs(row - mask.center_row);
+    bool fast = scale_mode == ScaleMode::Fast;
+    bool left = begin < mask.center_column;
+
+    // Pixel of each channel lane, counted backwards left of the centre
+    __m256i spread[3] = {
+        _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2),
+        _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5),
+        _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7),
+    };
+    if (left)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            spread[k] = _mm256_sub_epi32(_mm256_set1_epi32(7), spread[k]);
+        }
+    }
+    const __m256i low_bits = _mm256_set1_epi32(0xFFFF);
+    const __m256i byte = _mm256_set1_epi32(0xFF);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    int col = begin;
+    for (; col + 8 <= end; col += 8)
+    {
+        __m256i fixed = _mm256_loadu_si256((const __m256i*)(factor + (left ? mask.center_column - col - 7
+                                                                          : col - mask.center_column)));
+        __m256i magnitude = _mm256_abs_epi32(fixed);
+        __m256i sign = _mm256_srai_epi32(fixed, 31);
+        __m256i near_step = _mm256_setzero_si256();
+        __m256i result[3];
+        for (int k = 0; k < 3; k++)
+        {
+            __m256i value = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + 3 * col + 8 * k)));
+            __m256i product = _mm256_mullo_epi32(value, _mm256_permutevar8x32_epi32(magnitude, spread[k]));
+            near_step = _mm256_or_si256(near_step, _mm256_add_epi32(_mm256_and_si256(product, low_bits), value));
+            __m256i lane_sign = _mm256_permutevar8x32_epi32(sign, spread[k]);
+            __m256i scaled = _mm256_sub_epi32(_mm256_xor_si256(_mm256_srli_epi32(product, 16), lane_sign), lane_sign);
+            result[k] = _mm256_and_si256(scaled, byte);
+        }
+        // Fast mode still redoes negative factors (see vignette_pixel_fast())
+        if (fast ? _mm256_movemask_epi8(sign) : _mm256_movemask_epi8(_mm256_cmpgt_epi32(near_step, low_bits)))
+        {
+            for (int i = col; i < col + 8; i++)
+            {
+                int dc = abs(i - mask.center_column);
+                vignette_pixel(in[i], out[i], factor[dc], dr, dc, mask);
+            }
+            continue;
+        }
+        // Each 128-bit half holds the first or last 4 lanes of every vector
+        __m256i words = _mm256_packus_epi32(result[0], result[1]);
+        __m256i bytes = _mm256_packus_epi16(words, _mm256_packus_epi32(result[2], result[2]));
+        bytes = _mm256_permutevar8x32_epi32(bytes, order);
+        _mm_storeu_si128((__m128i*)(dst + 3 * col), _mm256_castsi256_si128(bytes));
+        _mm_storel_epi64((__m128i*)(dst + 3 * col + 16), _mm256_extracti128_si256(bytes, 1));
+    }
+    return col;
+}
+
+// Downscale, vertical pass, 32 channel bytes per group, as in the SSE2
+// version with the widening done by one vpmovzxbw per 16 bytes
+
+__attribute__((target("avx2")))
+int downscale_vertical_avx2(const unsigned char* const* rows, const short* weights, int taps, short* out,
+                            int num_values)
+{
+    const int shift = DOWNSCALE_WEIGHT_BITS - DOWNSCALE_MID_BITS;
+    const __m256i round = _mm256_set1_epi32(1 << (shift - 1));
+    int i = 0;
+    for (; i + 32 <= num_values; i += 32)
+    {
+        __m256i sum[4] = {round, round, round, round};
+        for (int k = 0; k < taps; k += 2)
+        {
+            bool pair = k + 1 < taps;
+            __m256i weight = _mm256_set1_epi32((unsigned short)weights[k] | (pair ? weights[k + 1] << 16 : 0));
+            for (int j = 0; j < 2; j++)
+            {
+                __m128i a = _mm_loadu_si128((const __m128i*)(rows[k] + i + 16 * j));
+                __m128i b = pair ? _mm_loadu_si128((const __m128i*)(rows[k + 1] + i + 16 * j)) : _mm_setzero_si128();
+                __m256i low = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(a, b));
+                __m256i high = _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(a, b));
+                sum[2 * j] = _mm256_add_epi32(sum[2 * j], _mm256_madd_epi16(low, weight));
+                sum[2 * j + 1] = _mm256_add_epi32(sum[2 * j + 1], _mm256_madd_epi16(high, weight));
+            }
+        }
+        for (int j = 0; j < 2; j++)
+        {
+            // packs works within 128-bit halves; the permute puts the
+            // four groups of four back in order
+            __m256i values = _mm256_packs_epi32(_mm256_srai_epi32(sum[2 * j], shift),
+                                                _mm256_srai_epi32(sum[2 * j + 1], shift));
+            values = _mm256_permute4x64_epi64(values, 0xD8);
+            _mm256_storeu_si256((__m256i*)(out + i + 16 * j), values);
+        }
+    }
+    return i;
+}
+
+// Convolution, 32 channel bytes per group, as in the SSE2 version. Both
+// packs work within 128-bit halves, which leaves the groups of four bytes
+// in the order 0 2 4 6 1 3 5 7; a permute sorts them.
+
+__attribute__((target("avx2")))
+int convolve_bytes_avx2(const unsigned char* const* rows, const short* weights, int taps, int shift,
+                        unsigned char* out, int num_values)
+{
+    const __m256i round = _mm256_set1_epi32(shift > 0 ? 1 << (shift - 1) : 0);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+    for (; i + 32 <= num_values; i += 32)
+    {
+        __m256i sum[4] = {round, round, round, round};
+        for (int k = 0; k < taps; k += 2)
+        {
+            bool pair = k + 1 < taps;
+            __m256i weight = _mm256_set1_epi32((unsigned short)weights[k]
+                                               | (pair ? (unsigned int)(unsigned short)weights[k + 1] << 16 : 0));
+            for (int j = 0; j < 2; j++)
+            {
+                __m128i a = _mm_loadu_si128((const __m128i*)(rows[k] + i + 16 * j));
+                __m128i b = pair ? _mm_loadu_si128((const __m128i*)(rows[k + 1] + i + 16 * j)) : _mm_setzero_si128();
+                __m256i low = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(a, b));
+                __m256i high = _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(a, b));
+                sum[2 * j] = _mm256_add_epi32(sum[2 * j], _mm256_madd_epi16(low, weight));
+                sum[2 * j + 1] = _mm256_add_epi32(sum[2 * j + 1], _mm256_madd_epi16(high, weight));
+            }
+        }
+        __m256i low = _mm256_packs_epi32(_mm256_sra_epi32(sum[0], count), _mm256_sra_epi32(sum[1], count));
+        __m256i high = _mm256_packs_epi32(_mm256_sra_epi32(sum[2], count), _mm256_sra_epi32(sum[3], count));
+        __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(low, high), order);
+        _mm256_storeu_si256((__m256i*)(out + i), bytes);
+    }
+    return i;
+}
+
+// Separable blur, horizontal pass, 32 channel bytes per group. The 16-bit
+// unpack and the 32-bit pack undo each other within each half, so only
+// the final pack to bytes needs a permute.
+
+__attribute__((target("avx2")))
+int convolve_values_avx2(const short* const* in, const short* weights, int taps, unsigned char* out, int num_values)
+{
+    const int shift = DOWNSCALE_WEIGHT_BITS + DOWNSCALE_MID_BITS;
+    const __m256i round = _mm256_set1_epi32(1 << (shift - 1));
+    int i = 0;
+    for (; i + 32 <= num_values; i += 32)
+    {
+        __m256i sum[4] = {round, round, round, round};
+        for (int k = 0; k < taps; k += 2)
+        {
+            bool pair = k + 1 < taps;
+            __m256i weight = _mm256_set1_epi32((unsigned short)weights[k]
+                                               | (pair ? (unsigned int)(unsigned short)weights[k + 1] << 16 : 0));
+            for (int j = 0; j < 2; j++)
+            {
+                __m256i a = _mm256_loadu_si256((const __m256i*)(in[k] + i + 16 * j));
+                __m256i b = pair ? _mm256_loadu_si256((const __m256i*)(in[k + 1] + i + 16 * j))
+                                 : _mm256_setzero_si256();
+                sum[2 * j] = _mm256_add_epi32(sum[2 * j], _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), weight));
+                sum[2 * j + 1] = _mm256_add_epi32(sum[2 * j + 1],
+                                                  _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), weight));
+            }
+        }
+        __m256i low = _mm256_packs_epi32(_mm256_srai_epi32(sum[0], shift), _mm256_srai_epi32(sum[1], shift));
+        __m256i high = _mm256_packs_epi32(_mm256_srai_epi32(sum[2], shift), _mm256_srai_epi32(sum[3], shift));
+        __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8);
+        _mm256_storeu_si256((__m256i*)(out + i), bytes);
+    }
+    return i;
+}
+
+// Sobel, 16 channel bytes per group, as in the SSE2 version
+
+__attribute__((target("avx2")))
+int sobel_avx2(const unsigned char* above, const unsigned char* row, const unsigned char* below, unsigned char* out,
+               int num_values)
+{
+    int i = 0;
+    for (; i + 16 <= num_values; i += 16)
+    {
+        __m256i a0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(above + i)));
+        __m256i a1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(above + i + 3)));
+        __m256i a2 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(above + i + 6)));
+        __m256i r0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + i)));
+        __m256i r2 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + i + 6)));
+        __m256i b0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(below + i)));
+        __m256i b1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(below + i + 3)));
+        __m256i b2 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(below + i + 6)));
+        __m256i left = _mm256_add_epi16(_mm256_add_epi16(a0, b0), _mm256_slli_epi16(r0, 1));
+        __m256i right = _mm256_add_epi16(_mm256_add_epi16(a2, b2), _mm256_slli_epi16(r2, 1));
+        __m256i top = _mm256_add_epi16(_mm256_add_epi16(a0, a2), _mm256_slli_epi16(a1, 1));
+        __m256i bottom = _mm256_add_epi16(_mm256_add_epi16(b0, b2), _mm256_slli_epi16(b1, 1));
+        __m256i gx = _mm256_sub_epi16(right, left);
+        __m256i gy = _mm256_sub_epi16(bottom, top);
+        __m256i low = _mm256_unpacklo_epi16(gx, gy);
+        __m256i high = _mm256_unpackhi_epi16(gx, gy);
+        low = _mm256_cvtps_epi32(_mm256_sqrt_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(low, low))));
+        high = _mm256_cvtps_epi32(_mm256_sqrt_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(high, high))));
+        __m256i words = _mm256_packs_epi32(low, high);
+        __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0xD8);
+        _mm_storeu_si128((__m128i*)(out + i), _mm256_castsi256_si128(bytes));
+    }
+    return i;
+}
+
+// Box blur column sums, 32 channel bytes per group, widened straight to
+// 32 bits with vpmovzxbd
+
+__attribute__((target("avx2")))
+int box_add_rows_avx2(int* sums, const unsigned char* add, const unsigned char* sub, int num_values)
+{
+    int i = 0;
+    for (; i + 32 <= num_values; i += 32)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(add + i + 8 * j)));
+            __m256i s = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(sub + i + 8 * j)));
+            __m256i* p = (__m256i*)(sums + i + 8 * j);
+            _mm256_storeu_si256(p, _mm256_add_epi32(_mm256_loadu_si256(p), _mm256_sub_epi32(a, s)));
+        }
+    }
+    return i;
+}
+
+// Box blur division, 32 channel bytes per group, as in the SSE2 version
+// with the byte order fixed as in convolve_bytes_avx2
+
+__attribute__((target("avx2")))
+int box_divide_avx2(const int* sums, unsigned char* out, int num_values, const BoxDivisor& divisor)
+{
+    const __m256i half = _mm256_set1_epi32(divisor.half);
+    const __m256i multiplier = _mm256_set1_epi32(divisor.multiplier);
+    const __m256i odd_lanes = _mm256_set_epi32(-1, 0, -1, 0, -1, 0, -1, 0);
+    const __m128i count = _mm_cvtsi32_si128(divisor.shift);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+    for (; i + 32 <= num_values; i += 32)
+    {
+        __m256i means[4];
+        for (int j = 0; j < 4; j++)
+        {
+            __m256i x = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(sums + i + 8 * j)), half);
+            __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(x, multiplier), 32);
+            __m256i odd = _mm256_and_si256(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), multiplier), odd_lanes);
+            means[j] = _mm256_srl_epi32(_mm256_or_si256(even, odd), count);
+        }
+        __m256i low = _mm256_packs_epi32(means[0], means[1]);
+        __m256i high = _mm256_packs_epi32(means[2], means[3]);
+        __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(low, high), order);
+        _mm256_storeu_si256((__m256i*)(out + i), bytes);
+    }
+    return i;
+}
+
+// AVX-512 (F and BW), 64 pixels per group. Phases and byte compares use
+// mask registers; 16-bit compares are widened back with movm before the
+// pack, which keeps the lane order the same as the unpack.
+
+struct Planes512
+{
+    __m512i blue, green, red;
+    __mmask64 is_blue, is_green, is_red;
+    __m512i sum_lo, sum_hi;
+};
+
+__attribute__((target("avx512f,avx512bw")))
+inline Planes512 load_planes_avx512(const unsigned char* group, int j)
+{
+    const unsigned char* p = group + 64 * j;
+    Planes512 planes;
+    planes.is_blue = phase_masks.bits[j][0];
+    planes.is_green = phase_masks.bits[j][1];
+    planes.is_red = phase_masks.bits[j][2];
+    __m512i m2 = _mm512_loadu_si512((const void*)(p - 2));
+    __m512i m1 = _mm512_loadu_si512((const void*)(p - 1));
+    __m512i p0 = _mm512_loadu_si512((const void*)p);
+    __m512i p1 = _mm512_loadu_si512((const void*)(p + 1));
+    __m512i p2 = _mm512_loadu_si512((const void*)(p + 2));
+    planes.blue = _mm512_mask_blend_epi8(planes.is_red, _mm512_mask_blend_epi8(planes.is_green, p0, m1), m2);
+    planes.green = _mm512_mask_blend_epi8(planes.is_red, _mm512_mask_blend_epi8(planes.is_green, p1, p0), m1);
+    planes.red = _mm512_mask_blend_epi8(planes.is_red, _mm512_mask_blend_epi8(planes.is_green, p2, p1), p0);
+
+    __m512i zero = _mm512_setzero_si512();
+    planes.sum_lo = _mm512_add_epi16(_mm512_add_epi16(_mm512_unpacklo_epi8(planes.blue, zero),
+                                                      _mm512_unpacklo_epi8(planes.green, zero)),
+                                     _mm512_unpacklo_epi8(planes.red, zero));
+    planes.sum_hi = _mm512_add_epi16(_mm512_add_epi16(_mm512_unpackhi_epi8(planes.blue, zero),
+                                                      _mm512_unpackhi_epi8(planes.green, zero)),
+                                     _mm512_unpackhi_epi8(planes.red, zero));
+    return planes;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline __m512i divide_by_3_avx512(__m512i sum)
+{
+    return _mm512_srli_epi16(_mm512_mulhi_epu16(sum, _mm512_set1_epi16((short)43691)), 1);
+}
+
+// Turns two 16-bit lane masks in unpack order back into a byte mask vector
+__attribute__((target("avx512f,avx512bw")))
+inline __m512i pack_masks_avx512(__mmask32 lo, __mmask32 hi)
+{
+    return _mm512_packs_epi16(_mm512_movm_epi16(lo), _mm512_movm_epi16(hi));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+int grayscale_avx512(const Pixel* in, Pixel* out, int num_columns)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    int col = 1;
+    for (; col + 65 <= num_columns; col += 64)
+    {
+        __m512i result[3];
+        for (int j = 0; j < 3; j++)
+        {
+            Planes512 planes = load_planes_avx512(src + 3 * col, j);
+            result[j] = _mm512_packus_epi16(divide_by_3_avx512(planes.sum_lo), divide_by_3_avx512(planes.sum_hi));
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            _mm512_storeu_si512((void*)(dst + 3 * col + 64 * j), result[j]);
+        }
+    }
+    return col;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+int high_contrast_avx512(const Pixel* in, Pixel* out, int num_columns)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    const __m512i threshold = _mm512_set1_epi16(380);
+    int col = 1;
+    for (; col + 65 <= num_columns; col += 64)
+    {
+        __m512i result[3];
+        for (int j = 0; j < 3; j++)
+        {
+            Planes512 planes = load_planes_avx512(src + 3 * col, j);
+            result[j] = pack_masks_avx512(_mm512_cmpgt_epi16_mask(planes.sum_lo, threshold),
+                                          _mm512_cmpgt_epi16_mask(planes.sum_hi, threshold));
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            _mm512_storeu_si512((void*)(dst + 3 * col + 64 * j), result[j]);
+        }
+    }
+    return col;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+int primary_colors_avx512(const Pixel* in, Pixel* out, int num_columns)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    const __m512i white_threshold = _mm512_set1_epi16(549);
+    const __m512i black_threshold = _mm512_set1_epi16(151);
+    int col = 1;
+    for (; col + 65 <= num_columns; col += 64)
+    {
+        __m512i result[3];
+        for (int j = 0; j < 3; j++)
+        {
+            Planes512 planes = load_planes_avx512(src + 3 * col, j);
+            __m512i white = pack_masks_avx512(_mm512_cmpgt_epi16_mask(planes.sum_lo, white_threshold),
+                                              _mm512_cmpgt_epi16_mask(planes.sum_hi, white_threshold));
+            __m512i not_black = pack_masks_avx512(_mm512_cmpge_epi16_mask(planes.sum_lo, black_threshold),
+                                                  _mm512_cmpge_epi16_mask(planes.sum_hi, black_threshold));
+
+            __m512i max_color = _mm512_max_epu8(_mm512_max_epu8(planes.red, planes.green), planes.blue);
+            __mmask64 red_max = _mm512_cmpeq_epi8_mask(planes.red, max_color);
+            __mmask64 green_max = ~red_max & _mm512_cmpeq_epi8_mask(planes.green, max_color);
+            __mmask64 blue_max = ~(red_max | green_max);
+
+            __mmask64 channel = (planes.is_blue & blue_max) | (planes.is_green & green_max) | (planes.is_red & red_max);
+            result[j] = _mm512_or_si512(white, _mm512_and_si512(not_black, _mm512_movm_epi8(channel)));
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            _mm512_storeu_si512((void*)(dst + 3 * col + 64 * j), result[j]);
+        }
+    }
+    return col;
+}
+
+#endif
+
+/**
+ * Finds the best instruction set this CPU supports
+ * @return the SIMD level
+ */
+SimdLevel detect_simd_level()
+{
+#if defined(IMAGE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SimdLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        return SimdLevel::SSSE3;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return SimdLevel::SSE2;
+    }
+#endif
+    return SimdLevel::Scalar;
+}
+
+// The kernels in use, one per filter
+struct SimdKernels
+{
+    SimdLevel level;
+    SimdRowKernel grayscale;
+    SimdRowKernel high_contrast;
+    SimdRowKernel primary_colors;
+    SimdReplicateKernel replicate;
+    SimdToneKernel tone;
+    SimdClarendonKernel clarendon;
+    SimdVignetteKernel vignette;
+    SimdDownscaleVerticalKernel downscale_vertical;
+    SimdDownscaleHorizontalKernel downscale_horizontal;
+    SimdConvolveBytesKernel convolve_bytes;
+    SimdConvolveValuesKernel convolve_values;
+    SimdSobelKernel sobel;
+    SimdBoxAddKernel box_add_rows;
+    SimdBoxDivideKernel box_divide;
+};
+
+SimdKernels make_simd_kernels(SimdLevel level)
+{
+    switch (level)
+    {
+#if defined(IMAGE_X86)
+        case SimdLevel::AVX512:
+            return {level, grayscale_avx512, high_contrast_avx512, primary_colors_avx512, replicate_ssse3,
+                    tone_avx2, clarendon_avx2, vignette_avx2, downscale_vertical_avx2, downscale_horizontal_ssse3,
+                    convolve_bytes_avx2, convolve_values_avx2, sobel_avx2, box_add_rows_avx2, box_divide_avx2};
+        case SimdLevel::AVX2:
+            return {level, grayscale_avx2, high_contrast_avx2, primary_colors_avx2, replicate_ssse3,
+                    tone_avx2, clarendon_avx2, vignette_avx2, downscale_vertical_avx2, downscale_horizontal_ssse3,
+                    convolve_bytes_avx2, convolve_values_avx2, sobel_avx2, box_add_rows_avx2, box_divide_avx2};
+        case SimdLevel::SSSE3:
+            return {level, grayscale_sse2, high_contrast_sse2, primary_colors_sse2, replicate_ssse3,
+                    tone_sse2, clarendon_sse2, scalar_vignette_kernel, downscale_vertical_sse2,
+                    downscale_horizontal_ssse3, convolve_bytes_sse2, convolve_values_sse2, sobel_sse2,
+                    box_add_rows_sse2, box_divide_sse2};
+        case SimdLevel::SSE2:
+            return {level, grayscale_sse2, high_contrast_sse2, primary_colors_sse2, scalar_replicate_kernel,
+                    tone_sse2, clarendon_sse2, scalar_vignette_kernel, downscale_vertical_sse2,
+                    scalar_downscale_horizontal_kernel, convolve_bytes_sse2, convolve_values_sse2, sobel_sse2,
+                    box_add_rows_sse2, box_divide_sse2};
+#endif
+        default:
+            return {SimdLevel::Scalar, scalar_kernel, scalar_kernel, scalar_kernel, scalar_replicate_kernel,
+                    scalar_tone_kernel, scalar_clarendon_kernel, scalar_vignette_kernel,
+                    scalar_downscale_vertical_kernel, scalar_downscale_horizontal_kernel,
+                    scalar_convolve_bytes_kernel, scalar_convolve_values_kernel, scalar_sobel_kernel,
+                    scalar_box_add_kernel, scalar_box_divide_kernel};
+    }
+}
+
+SimdKernels simd_kernels = make_simd_kernels(detect_simd_level());
+
+/**
+ * Selects the kernels to use. Levels above what the CPU supports are
+ * lowered to the best supported one, so this is safe to call with any
+ * value (e.g. SimdLevel::Scalar to compare against the plain code).
+ * Not thread safe; call it before any filters run.
+ * @param level the wanted instruction set
+ * @return the level actually selected
+ */
+SimdLevel set_simd_level(SimdLevel level)
+{
+    SimdLevel best = detect_simd_level();
+    if ((int)level > (int)best)
+    {
+        level = best;
+    }
+    simd_kernels = make_simd_kernels(level);
+    return simd_kernels.level;
+}
+
+// The level of the kernels in use
+SimdLevel active_simd_level()
+{
+    return simd_kernels.level;
+}
+
+// Name of an instruction set level, for reports
+const char* simd_level_name(SimdLevel level)
+{
+    switch (level)
+    {
+        case SimdLevel::SSE2:
+            return "sse2";
+        case SimdLevel::SSSE3:
+            return "ssse3";
+        case SimdLevel::AVX2:
+            return "avx2";
+        case SimdLevel::AVX512:
+            return "avx512";
+        default:
+            return "scalar";
+    }
+}
+
+void grayscale_row(const Pixel* in, Pixel* out, int num_columns)
+{
+    int done = simd_kernels.grayscale(in, out, num_columns);
+    grayscale_pixels(in, out, 0, min(1, num_columns));
+    grayscale_pixels(in, out, done, num_columns);
+}
+
+void high_contrast_row(const Pixel* in, Pixel* out, int num_columns)
+{
+    int done = simd_kernels.high_contrast(in, out, num_columns);
+    high_contrast_pixels(in, out, 0, min(1, num_columns));
+    high_contrast_pixels(in, out, done, num_columns);
+}
+
+void primary_colors_row(const Pixel* in, Pixel* out, int num_columns)
+{
+    int done = simd_kernels.primary_colors(in, out, num_columns);
+    primary_colors_pixels(in, out, 0, min(1, num_columns));
+    primary_colors_pixels(in, out, done, num_columns);
+}
+
+void tone_row(const Pixel* in, Pixel* out, int num_columns, const ToneTable& table)
+{
+    int done = table.fixed ? simd_kernels.tone(in, out, num_columns, table) : 0;
+    tone_pixels(in, out, done, num_columns, table);
+}
+
+void clarendon_row(const Pixel* in, Pixel* out, int num_columns, const ToneTable& bright, const ToneTable& dark)
+{
+    int done = bright.fixed && dark.fixed ? simd_kernels.clarendon(in, out, num_columns, bright, dark) : 1;
+    clarendon_pixels(in, out, 0, min(1, num_columns), bright, dark);
+    clarendon_pixels(in, out, done, num_columns, bright, dark);
+}
+
+/**
+ * Vignettes a stored row of an image that has an orientation. The falloff
+ * is worked out from where each pixel is displayed.
+ * @param in          the input pixels of the row
+ * @param out         where the filtered pixels go (may be the same as in)
+ * @param row         index of the stored row
+ * @param num_columns stored width
+ * @param num_rows    stored height
+ * @param orientation how the stored pixels are displayed
+ * @param mask        the mask for the displayed size
+ * @return nothing
+ */
+void vignette_row(const Pixel* in, Pixel* out, int row, int num_columns, int num_rows,
+                  const Orientation& orientation, const VignetteMask& mask)
+{
+    if (orientation.identity())
+    {
+        // The factors run backwards left of the centre column and
+        // forwards from it
+        int sides[] = {0, max(0, min(mask.center_column, num_columns)), num_columns};
+        for (int side = 0; side < 2; side++)
+        {
+            int done = sides[side];
+            if (mask.fixed)
+            {
+                done = simd_kernels.vignette(in, out, row, sides[side], sides[side + 1], mask);
+            }
+            vignette_pixels(in, out, row, done, sides[side + 1], mask);
+        }
+        return;
+    }
+    int a = orientation.mirror_rows ? num_rows - 1 - row : row;
+    bool fast = scale_mode == ScaleMode::Fast && mask.fixed;
+    for (int col = 0; col < num_columns; col++)
+    {
+        int b = orientation.mirror_columns ? num_columns - 1 - col : col;
+        int display_row = orientation.transpose ? b : a;
+        int dr = abs(display_row - mask.center_row);
+        int dc = abs((orientation.transpose ? a : b) - mask.center_column);
+        int scaling_factor = mask.row(display_row)[dc];
+        if (fast)
+        {
+            vignette_pixel_fast(in[col], out[col], scaling_factor, dr, dc, mask);
+        }
+        else
+        {
+            vignette_pixel(in[col], out[col], scaling_factor, dr, dc, mask);
+        }
+    }
+}
+
+/**
+ * Repeats every pixel of a row xscale times
+ * @param in          the source row
+ * @param out         the output row, num_columns * xscale pixels
+ * @param num_columns pixels in the source row
+ * @param plan        shuffle plan for the scale
+ * @return nothing
+ */
+void replicate_row(const Pixel* in, Pixel* out, int num_columns, const ReplicatePlan& plan)
+{
+    int x = num_columns * plan.xscale;
+    int col = plan.xscale == 1 ? 0 : simd_kernels.replicate(in, out, num_columns, plan);
+    for (; col < x; col++)
+    {
+        out[col] = in[col/plan.xscale];
+    }
+}
+
+Image process_1(const Image& image, const VignetteParams& params)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    shared_ptr<const VignetteMask> mask = vignette_masks.get(image.display_height(), image.display_width(), params);
+    Image new_image(num_columns, num_rows);
+    new_image.orientation = image.orientation;
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            vignette_row(image[row], new_image[row], row, num_columns, num_rows, image.orientation, *mask);
+        }
+    });
+    return new_image;
+}
+
+Image process_2(const Image& image, double scaling_factor)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    ToneTable bright = make_lighten_table(scaling_factor);
+    ToneTable dark = make_darken_table(scaling_factor);
+    Image new_image(num_columns, num_rows);
+    new_image.orientation = image.orientation;
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            clarendon_row(image[row], new_image[row], num_columns, bright, dark);
+        }
+    });
+    return new_image;
+}
+
+// In-place versions of the per-pixel filters. Each pixel only depends on
+// the pixel at the same position, so the rows are filtered where they
+// are. These are picked when the caller passes an image it no longer
+// needs (a temporary or std::move), and peak memory stays at one image.
+
+Image process_2(Image&& image, double scaling_factor)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    ToneTable bright = make_lighten_table(scaling_factor);
+    ToneTable dark = make_darken_table(scaling_factor);
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            clarendon_row(image[row], image[row], num_columns, bright, dark);
+        }
+    });
+    return move(image);
+}
+
+Image process_3(const Image& image)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    Image new_image(num_columns, num_rows);
+    new_image.orientation = image.orientation;
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            grayscale_row(image[row], new_image[row], num_columns);
+        }
+    });
+    return new_image;
+}
+
+Image process_3(Image&& image)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            grayscale_row(image[row], image[row], num_columns);
+        }
+    });
+    return move(image);
+}
+
+
+/**
+ * Puts the pixels of an image in displayed order, so that its orientation
+ * is the identity. Filters that cannot work through an orientation use
+ * this first.
+ * @param image the image
+ * @return the same picture with its pixels rearranged
+ */
+Image upright(const Image& image)
+{
+    if (image.orientation.identity())
+    {
+        return image;
+    }
+    Image new_image(image.display_width(), image.display_height());
+    parallel_rows(new_image.height, [&](int begin, int end)
+    {
+        gather_rows(image, begin, end, (unsigned char*)new_image[begin], new_image.stride);
+    });
+    return new_image;
+}
+
+// The rotations only change the orientation; no pixels move until the
+// image is written (or upright is called). They take the image by value
+// so that a caller that is done with it can move it in without a copy.
+
+Image process_4(Image image)
+{
+    image.orientation = image.orientation.rotated_clockwise();
+    return image;
+}
+
+Image rotate_180(Image image)
+{
+    image.orientation = image.orientation.rotated_clockwise().rotated_clockwise();
+    return image;
+}
+
+// Like the original rotate_270, this swaps the rows and columns (a mirror
+// across the diagonal from the top left corner)
+Image rotate_270(Image image)
+{
+    image.orientation = image.orientation.transposed();
+    return image;
+}
+
+Image process_5(Image image, int number)
+{
+    int angle = number * 90;
+    if (angle%90 != 0)
+    {
+        cout << "Angle needs to be divisible by 90" << endl;
+    }
+    else if (angle%360 == 0)
+    {
+        return image;
+    }
+    else if (angle%360 == 90)
+    {
+        return process_4(move(image));
+    }
+    else if (angle%360 == 180)
+    {
+        return rotate_180(move(image));
+    }
+    else
+    {
+        return rotate_270(move(image)); 
+    }
+        
+    return image;
+}
+
+/**
+ * Mirrors an image, also by changing only its orientation
+ * @param image    the image
+ * @param vertical true to swap top and bottom, false to swap left and right
+ * @return the mirrored image
+ */
+Image mirror_image(Image image, bool vertical)
+{
+    image.orientation = image.orientation.mirrored(vertical);
+    return image;
+}
+
+Image process_6(const Image& image, int xscale, int yscale)
+{
+    // Repeating pixels gives the same result before or after mirroring,
+    // so the stored pixels are enlarged as they are (across the stored
+    // rows instead of along them if the image is transposed)
+    if (image.orientation.transpose)
+    {
+        swap(xscale, yscale);
+    }
+    int num_rows = image.height;
+    int num_columns = image.width;
+    int y = num_rows* yscale;
+    int x = num_columns* xscale;
+    Image new_image(x, y);
+    new_image.orientation = image.orientation;
+    ReplicatePlan plan = make_replicate_plan(xscale);
+    // Each source row is expanded once; its other yscale - 1 copies are
+    // plain row copies
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            Pixel* first = new_image[row*yscale];
+            replicate_row(image[row], first, num_columns, plan);
+            for (int i = 1; i < yscale; i++)
+            {
+                memcpy(new_image[row*yscale + i], first, new_image.stride);
+            }
+        }
+    });
+    return new_image;
+}
+
+// Bilinear weights are in 1/256ths
+const int RESIZE_WEIGHT_BITS = 8;
+const int RESIZE_ONE = 1 << RESIZE_WEIGHT_BITS;
+
+// For each output position, the two source positions to blend and the
+// weight of the second one
+struct ResizeTaps
+{
+    vector<int> first;
+    vector<int> second;
+    vector<int> weight;
+};
+
+/**
+ * Works out the bilinear taps along one axis. Pixel centres are aligned,
+ * so output position i samples the source at (i + 0.5) * in / out - 0.5,
+ * clamped to the edge pixels.
+ * @param in_size  source pixels along the axis
+ * @param out_size output pixels along the axis
+ * @return the taps, out_size of each
+ */
+ResizeTaps make_resize_taps(int in_size, int out_size)
+{
+    ResizeTaps taps;
+    taps.first.resize(out_size);
+    taps.second.resize(out_size);
+    taps.weight.resize(out_size);
+    for (int i = 0; i < out_size; i++)
+    {
+        double pos = (i + 0.5) * in_size / out_size - 0.5;
+        pos = max(0.0, min(pos, in_size - 1.0));
+        int first = (int)pos;
+        taps.first[i] = first;
+        taps.second[i] = min(first + 1, in_size - 1);
+        taps.weight[i] = (int)lround((pos - first) * RESIZE_ONE);
+    }
+    return taps;
+}
+
+/**
+ * Blends one source row horizontally into 16-bit channels, one step of
+ * the separable bilinear enlarge
+ * @param in    the source row
+ * @param out   3 values per output column, scaled by RESIZE_ONE
+ * @param taps  the horizontal taps
+ * @return nothing
+ */
+void bilinear_columns(const Pixel* in, unsigned short* out, const ResizeTaps& taps)
+{
+    const unsigned char* src = (const unsigned char*)in;
+    int x = taps.first.size();
+    for (int col = 0; col < x; col++)
+    {
+        const unsigned char* a = src + 3 * taps.first[col];
+        const unsigned char* b = src + 3 * taps.second[col];
+        int w = taps.weight[col];
+        for (int c = 0; c < 3; c++)
+        {
+            out[3 * col + c] = a[c] * (RESIZE_ONE - w) + b[c] * w;
+        }
+    }
+}
+
+/**
+ * Enlarges an image by any scale factors of 1 or more, including
+ * fractional ones. The new size is the old size times the scale, rounded
+ * to the nearest pixel. Nearest mode with whole number scales gives the
+ * same result as process_6 above (and uses it).
+ * @param image  the image to enlarge
+ * @param xscale horizontal scale, at least 1
+ * @param yscale vertical scale, at least 1
+ * @param mode   nearest neighbour or bilinear
+ * @return the enlarged image
+ */
+Image process_6(const Image& image, double xscale, double yscale, ResizeMode mode)
+{
+    if (mode == ResizeMode::Nearest && xscale == (int)xscale && yscale == (int)yscale)
+    {
+        return process_6(image, (int)xscale, (int)yscale);
+    }
+    if (!image.orientation.identity())
+    {
+        return process_6(upright(image), xscale, yscale, mode);
+    }
+    int num_rows = image.height;
+    int num_columns = image.width;
+    int y = max(1, (int)lround(num_rows * yscale));
+    int x = max(1, (int)lround(num_columns * xscale));
+    Image new_image(x, y);
+
+    if (mode == ResizeMode::Nearest)
+    {
+        vector<int> source_column(x);
+        for (int col = 0; col < x; col++)
+        {
+            source_column[col] = (long long)col * num_columns / x;
+        }
+        parallel_rows(y, [&](int begin, int end)
+        {
+            int last_source = -1;
+            for (int row = begin; row < end; row++)
+            {
+                int source = (long long)row * num_rows / y;
+                if (source == last_source)
+                {
+                    memcpy(new_image[row], new_image[row - 1], new_image.stride);
+                    continue;
+                }
+                const Pixel* in = image[source];
+                Pixel* out = new_image[row];
+                for (int col = 0; col < x; col++)
+                {
+                    out[col] = in[source_column[col]];
+                }
+                last_source = source;
+            }
+        });
+        return new_image;
+    }
+
+    ResizeTaps columns = make_resize_taps(num_columns, x);
+    ResizeTaps rows = make_resize_taps(num_rows, y);
+    parallel_rows(y, [&](int begin, int end)
+    {
+        // The two horizontally blended source rows in use, kept between
+        // output rows since neighbouring rows usually share them
+        vector<unsigned short> blended[2] = {vector<unsigned short>(3 * x), vector<unsigned short>(3 * x)};
+        int blended_row[2] = {-1, -1};
+        for (int row = begin; row < end; row++)
+        {
+            int wanted[2] = {rows.first[row], rows.second[row]};
+            if (blended_row[0] != wanted[0] && blended_row[1] == wanted[0])
+            {
+                swap(blended[0], blended[1]);
+                swap(blended_row[0], blended_row[1]);
+            }
+            for (int i = 0; i < 2; i++)
+            {
+                if (blended_row[i] != wanted[i])
+                {
+                    bilinear_columns(image[wanted[i]], blended[i].data(), columns);
+                    blended_row[i] = wanted[i];
+                }
+            }
+            const unsigned short* a = blended[0].data();
+            const unsigned short* b = blended[1].data();
+            unsigned char* out = (unsigned char*)new_image[row];
+            int w = rows.weight[row];
+            int round = 1 << (2 * RESIZE_WEIGHT_BITS - 1);
+            for (int i = 0; i < 3 * x; i++)
+            {
+                out[i] = (a[i] * (RESIZE_ONE - w) + b[i] * w + round) >> (2 * RESIZE_WEIGHT_BITS);
+            }
+        }
+    });
+    return new_image;
+}
+
+Image process_7(const Image& image)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    Image new_image(num_columns, num_rows);
+    new_image.orientation = image.orientation;
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            high_contrast_row(image[row], new_image[row], num_columns);
+        }
+    });
+    return new_image;
+}
+
+Image process_7(Image&& image)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            high_contrast_row(image[row], image[row], num_columns);
+        }
+    });
+    return move(image);
+}
+
+Image process_8(const Image& image, double scaling_factor)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    ToneTable table = make_lighten_table(scaling_factor);
+    Image new_image(num_columns, num_rows);
+    new_image.orientation = image.orientation;
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            tone_row(image[row], new_image[row], num_columns, table);
+        }
+    });
+    return new_image;
+}
+
+Image process_8(Image&& image, double scaling_factor)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    ToneTable table = make_lighten_table(scaling_factor);
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            tone_row(image[row], image[row], num_columns, table);
+        }
+    });
+    return move(image);
+}
+
+Image process_9(const Image& image, double scaling_factor)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    ToneTable table = make_darken_table(scaling_factor);
+    Image new_image(num_columns, num_rows);
+    new_image.orientation = image.orientation;
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            tone_row(image[row], new_image[row], num_columns, table);
+        }
+    });
+    return new_image;
+}
+
+Image process_9(Image&& image, double scaling_factor)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    ToneTable table = make_darken_table(scaling_factor);
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            tone_row(image[row], image[row], num_columns, table);
+        }
+    });
+    return move(image);
+}
+
+Image process_10(const Image& image)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    Image new_image(num_columns, num_rows);
+    new_image.orientation = image.orientation;
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            primary_colors_row(image[row], new_image[row], num_columns);
+        }
+    });
+    return new_image;
+}
+
+Image process_10(Image&& image)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    parallel_rows(num_rows, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            primary_colors_row(image[row], image[row], num_columns);
+        }
+    });
+    return move(image);
+}
+
+//***************************************************************************************************//
+//                                            Downscaling                                            //
+//***************************************************************************************************//
+
+/**
+ * Puts the weights of every output position in Q14, each set scaled to
+ * add up to exactly DOWNSCALE_ONE, and pads them to the same number of
+ * taps. Helper function for make_downscale_taps() and make_reduce_taps()
+ * @param first   the source position of each output's first weight
+ * @param weights the weights of each output, in any unit
+ * @return the taps
+ */
+DownscaleTaps finish_taps(const vector<int>& first, const vector<vector<double>>& weights)
+{
+    int out_size = first.size();
+    vector<vector<int>> fixed(out_size);
+    DownscaleTaps taps;
+    taps.start = first;
+    for (int i = 0; i < out_size; i++)
+    {
+        double total = 0;
+        for (double weight : weights[i])
+        {
+            total += weight;
+        }
+        int sum = 0;
+        size_t largest = 0;
+        for (size_t k = 0; k < weights[i].size(); k++)
+        {
+            fixed[i].push_back((int)lround(weights[i][k] / total * DOWNSCALE_ONE));
+            sum += fixed[i][k];
+            largest = fixed[i][k] > fixed[i][largest] ? k : largest;
+        }
+        fixed[i][largest] += DOWNSCALE_ONE - sum;
+
+        // Drop taps that rounded to nothing at either end
+        while (fixed[i].back() == 0)
+        {
+            fixed[i].pop_back();
+        }
+        while (fixed[i].front() == 0)
+        {
+            fixed[i].erase(fixed[i].begin());
+            taps.start[i]++;
+        }
+        taps.count = max(taps.count, (int)fixed[i].size());
+    }
+
+    taps.pair_count = (taps.count + 1) / 2;
+    taps.weight.assign((size_t)out_size * taps.count, 0);
+    taps.pairs.assign((size_t)out_size * taps.pair_count, 0);
+    for (int i = 0; i < out_size; i++)
+    {
+        for (size_t k = 0; k < fixed[i].size(); k++)
+        {
+            taps.weight[(size_t)i * taps.count + k] = fixed[i][k];
+            taps.pairs[(size_t)i * taps.pair_count + k / 2] |= fixed[i][k] << (16 * (k % 2));
+        }
+    }
+    return taps;
+}
+
+/**
+ * Works out the downscale taps along one axis. Output position i covers
+ * the source interval [i * scale, (i + 1) * scale) for scale = in / out.
+ * Box averages the pixels from floor(i * in / out) up to floor((i + 1) *
+ * in / out); Area weighs each pixel by how much of it the interval
+ * covers; Bilinear weighs pixels by their distance from the centre of the
+ * interval, falling to zero at a distance of scale.
+ * @param in_size  source pixels along the axis
+ * @param out_size output pixels along the axis, at most in_size
+ * @param filter   the filter
+ * @return the taps
+ */
+DownscaleTaps make_downscale_taps(int in_size, int out_size, DownscaleFilter filter)
+{
+    double scale = (double)in_size / out_size;
+    vector<int> first(out_size);
+    vector<vector<double>> weights(out_size);
+    for (int i = 0; i < out_size; i++)
+    {
+        if (filter == DownscaleFilter::Box)
+        {
+            first[i] = (long long)i * in_size / out_size;
+            int end = max(first[i] + 1, (int)((long long)(i + 1) * in_size / out_size));
+            weights[i].assign(end - first[i], 1.0);
+        }
+        else if (filter == DownscaleFilter::Area)
+        {
+            double begin = (double)i * in_size / out_size;
+            double end = (double)(i + 1) * in_size / out_size;
+            first[i] = (int)begin;
+            for (int j = first[i]; j < end && j < in_size; j++)
+            {
+                weights[i].push_back(min(end, j + 1.0) - max(begin, (double)j));
+            }
+        }
+        else
+        {
+            double center = (i + 0.5) * scale - 0.5;
+            first[i] = max(0, (int)ceil(center - scale));
+            int last = min(in_size - 1, (int)floor(center + scale));
+            for (int j = first[i]; j <= last; j++)
+            {
+                weights[i].push_back(max(0.0, 1 - abs(j - center) / scale));
+            }
+        }
+    }
+    return finish_taps(first, weights);
+}
+
+/**
+ * Works out the taps for reduce_image() along one axis: output position i
+ * averages source positions i * factor to (i + 1) * factor - 1, or up to
+ * the end of the source
+ * @param in_size source pixels along the axis
+ * @param factor  the reduction, a power of two
+ * @return the taps
+ */
+DownscaleTaps make_reduce_taps(int in_size, int factor)
+{
+    int out_size = (in_size + factor - 1) / factor;
+    vector<int> first(out_size);
+    vector<vector<double>> weights(out_size);
+    for (int i = 0; i < out_size; i++)
+    {
+        first[i] = i * factor;
+        weights[i].assign(min(factor, in_size - first[i]), 1.0);
+    }
+    return finish_taps(first, weights);
+}
+
+/**
+ * Computes output rows [begin, end) of a downscale: for each, the source
+ * rows are weighed together down the columns and the result along the
+ * row. Taps past the last source row have weight 0 and read the last row.
+ * @param rows        source row j is rows[j - first_row], for j up to last_row - 1
+ * @param first_row   the first source row in rows
+ * @param last_row    one past the last source row in rows
+ * @param num_columns source width
+ * @param row_taps    vertical taps
+ * @param column_taps horizontal taps
+ * @param out         the output image
+ * @param begin       first output row
+ * @param end         one past the last
+ * @return nothing
+ */
+void downscale_rows(const Pixel* const* rows, int first_row, int last_row, int num_columns,
+                    const DownscaleTaps& row_taps, const DownscaleTaps& column_taps, Image& out, int begin, int end)
+{
+    int num_values = 3 * num_columns;
+    // Room for the horizontal taps past the end of the row and for the
+    // kernel's loads, which are zeros
+    vector<short> values(num_values + 3 * column_taps.count + 8);
+    vector<const unsigned char*> sources(row_taps.count);
+    for (int row = begin; row < end; row++)
+    {
+        for (int k = 0; k < row_taps.count; k++)
+        {
+            int source = min(row_taps.start[row] + k, last_row - 1);
+            sources[k] = (const unsigned char*)rows[source - first_row];
+        }
+        const short* weights = row_taps.weight.data() + (size_t)row * row_taps.count;
+        int done = simd_kernels.downscale_vertical(sources.data(), weights, row_taps.count, values.data(), num_values);
+        downscale_vertical_values(sources.data(), weights, row_taps.count, values.data(), done, num_values);
+        done = simd_kernels.downscale_horizontal(values.data(), out[row], out.width, column_taps);
+        downscale_horizontal_pixels(values.data(), out[row], done, out.width, column_taps);
+    }
+}
+
+/**
+ * Downscales a whole image with the given taps, keeping its orientation
+ * @param image       the image
+ * @param row_taps    vertical taps
+ * @param column_taps horizontal taps
+ * @return the new image, as many rows and columns as there are taps
+ */
+Image downscale_image(const Image& image, const DownscaleTaps& row_taps, const DownscaleTaps& column_taps)
+{
+    Image new_image(column_taps.start.size(), row_taps.start.size());
+    new_image.orientation = image.orientation;
+    vector<const Pixel*> rows(image.height);
+    for (int row = 0; row < image.height; row++)
+    {
+        rows[row] = image[row];
+    }
+    parallel_rows(new_image.height, [&](int begin, int end)
+    {
+        downscale_rows(rows.data(), 0, image.height, image.width, row_taps, column_taps, new_image, begin, end);
+    });
+    return new_image;
+}
+
+/**
+ * Shrinks an image with separable passes. The vertical pass comes first,
+ * on whole contiguous source rows, which is most of the work and the part
+ * that vectorises best; the horizontal pass then only runs once per
+ * output row. Images with an orientation are put upright first, as the
+ * Box taps are not symmetric.
+ * @param image  the image to shrink
+ * @param width  new display width, at most the current one
+ * @param height new display height, at most the current one
+ * @param filter how source pixels are combined
+ * @return the shrunk image
+ */
+Image downscale(const Image& image, int width, int height, DownscaleFilter filter)
+{
+    if (!image.orientation.identity())
+    {
+        return downscale(upright(image), width, height, filter);
+    }
+    width = max(1, min(width, image.width));
+    height = max(1, min(height, image.height));
+    if (width == image.width && height == image.height)
+    {
+        return image;
+    }
+    return downscale_image(image, make_downscale_taps(image.height, height, filter),
+                           make_downscale_taps(image.width, width, filter));
+}
+
+Image reduce_image(const Image& image, int shift)
+{
+    int factor = 1 << max(0, min(shift, 7));
+    return downscale_image(image, make_reduce_taps(image.height, factor), make_reduce_taps(image.width, factor));
+}
+
+/**
+ * The largest reduce_image() shift, up to 7, that keeps the longer side of
+ * an image at least min_side pixels
+ * @param width    image width
+ * @param height   image height
+ * @param min_side the smallest longer side allowed
+ * @return the shift, 0 if the image cannot be halved
+ */
+int reduction_shift(int width, int height, int min_side)
+{
+    int longer = max(width, height);
+    int shift = 0;
+    while (shift < 7 && (longer + (2 << shift) - 1) >> (shift + 1) >= min_side)
+    {
+        shift++;
+    }
+    return shift;
+}
+
+/**
+ * Makes a thumbnail. The power-of-two reductions are cheap and, applied
+ * while the longer side stays at least twice max_side, leave the final
+ * downscale enough pixels to filter. The reductions depend only on the
+ * size, so when read_image_reduced() has already done them none is left
+ * here and the result is the same as from the full-size image.
+ * @param image    the image
+ * @param max_side the longer side of the thumbnail
+ * @param filter   the filter of the final downscale
+ * @return the thumbnail
+ */
+Image thumbnail(const Image& image, int max_side, DownscaleFilter filter)
+{
+    max_side = max(1, max_side);
+    Image reduced;
+    const Image* source = &image;
+    int shift = reduction_shift(source->width, source->height, 2 * max_side);
+    while (shift > 0)
+    {
+        reduced = reduce_image(*source, shift);
+        source = &reduced;
+        shift = reduction_shift(source->width, source->height, 2 * max_side);
+    }
+
+    int width = source->display_width();
+    int height = source->display_height();
+    if (max(width, height) <= max_side)
+    {
+        return *source;
+    }
+    int new_width = width >= height ? max_side : max(1, (int)lround((double)width * max_side / height));
+    int new_height = height >= width ? max_side : max(1, (int)lround((double)height * max_side / width));
+    return downscale(*source, new_width, new_height, filter);
+}
+
+/**
+ * Decodes the pixel array of a BMP file straight into an image reduced by
+ * 2^shift, a band of scanlines at a time, giving the same pixels as
+ * reduce_image() on the full-size image. BMP files store rows from
+ * bottom to top, so the bands go from the bottom of the image up.
+ * Helper function for read_image_reduced() and decode_bmp_reduced()
+ * @param info  the file's properties
+ * @param shift the reduction
+ * @param fetch returns the given number of scanlines starting at the
+ *              given file row, or null if the file ends early
+ * @return the image, or an empty Image if fetch failed
+ */
+Image decode_reduced(const BmpInfo& info, int shift, const function<const unsigned char*(int, int)>& fetch)
+{
+    int factor = 1 << shift;
+    DownscaleTaps row_taps = make_reduce_taps(info.height, factor);
+    DownscaleTaps column_taps = make_reduce_taps(info.width, factor);
+    Image image(column_taps.start.size(), row_taps.start.size());
+
+    // Output rows per band, about 4 MB of scanlines
+    int band_rows = max(1LL, (4LL << 20) / (info.file_stride * factor));
+    Image unpacked;     // A band of 32-bit scanlines converted to Pixels
+    vector<const Pixel*> rows;
+    for (int end = image.height; end > 0; end -= band_rows)
+    {
+        int begin = max(0, end - band_rows);
+        int first_row = begin * factor;
+        int last_row = min(end * factor, info.height);
+        int count = last_row - first_row;
+        const unsigned char* scanlines = fetch(info.height - last_row, count);
+        if (scanlines == nullptr)
+        {
+            return Image();
+        }
+
+        rows.resize(count);
+        if (info.bytes_per_pixel == 3)
+        {
+            // A 24-bit scanline is already a row of Pixels
+            for (int i = 0; i < count; i++)
+            {
+                rows[i] = (const Pixel*)(scanlines + info.file_stride * (count - 1 - i));
+            }
+        }
+        else
+        {
+            if (unpacked.height < count)
+            {
+                unpacked = Image(info.width, count);
+            }
+            parallel_rows(count, [&](int b, int e)
+            {
+                for (int i = b; i < e; i++)
+                {
+                    unpack_scanline(scanlines + info.file_stride * (count - 1 - i), unpacked[i], info.width, 4);
+                }
+            });
+            for (int i = 0; i < count; i++)
+            {
+                rows[i] = unpacked[i];
+            }
+        }
+
+        parallel_rows(end - begin, [&](int b, int e)
+        {
+            downscale_rows(rows.data(), first_row, last_row, info.width, row_taps, column_taps, image,
+                           begin + b, begin + e);
+        });
+    }
+    return image;
+}
+
+//***************************************************************************************************//
+//                                  Neighbourhood filters                                            //
+//***************************************************************************************************//
+
+// Bytes of padded source rows a neighbourhood filter keeps per thread.
+// Column tiles are narrowed until the rows of the kernel's window fit, so
+// they stay in cache from one output row to the next. Tiles are never
+// narrower than 64 pixels, so the rows of a very large kernel take more.
+const int CONVOLVE_TILE_BYTES = 256 * 1024;
+
+/**
+ * Maps a row or column index to the one a border mode reads
+ * @param i      the index, possibly outside [0, size)
+ * @param size   the number of rows or columns
+ * @param border the border mode
+ * @return an index in [0, size), or -1 for black
+ */
+int border_index(int i, int size, BorderMode border)
+{
+    if (i >= 0 && i < size)
+    {
+        return i;
+    }
+    switch (border)
+    {
+        case BorderMode::Clamp:
+            return i < 0 ? 0 : size - 1;
+        case BorderMode::Reflect:
+        {
+            if (size == 1)
+            {
+                return 0;
+            }
+            int period = 2 * (size - 1);
+            i %= period;
+            i = i < 0 ? i + period : i;
+            return i < size ? i : period - i;
+        }
+        case BorderMode::Wrap:
+            i %= size;
+            return i < 0 ? i + size : i;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Copies columns [begin, end) of an image row, filling in the pixels past
+ * the edges as the border mode says
+ * @param image  the image
+ * @param row    the row, possibly outside the image
+ * @param begin  first column, possibly negative
+ * @param end    one past the last, possibly past the width
+ * @param border the border mode
+ * @param out    receives 3 * (end - begin) bytes
+ * @return nothing
+ */
+void pad_row(const Image& image, int row, int begin, int end, BorderMode border, unsigned char* out)
+{
+    int source = border_index(row, image.height, border);
+    if (source < 0)
+    {
+        memset(out, 0, 3 * (end - begin));
+        return;
+    }
+    const Pixel* pixels = image[source];
+    auto put = [&](int col)
+    {
+        int from = border_index(col, image.width, border);
+        if (from < 0)
+        {
+            memset(out + 3 * (col - begin), 0, 3);
+        }
+        else
+        {
+            memcpy(out + 3 * (col - begin), pixels + from, 3);
+        }
+    };
+    int col = begin;
+    for (; col < end && col < 0; col++)
+    {
+        put(col);
+    }
+    int inside_end = min(end, image.width);
+    if (col < inside_end)
+    {
+        memcpy(out + 3 * (col - begin), pixels + col, 3 * (inside_end - col));
+        col = inside_end;
+    }
+    for (; col < end; col++)
+    {
+        put(col);
+    }
+}
+
+/**
+ * Runs a neighbourhood filter over output rows [begin, end), one column
+ * tile at a time. Each source row of a tile is padded with its border
+ * pixels once and kept in a ring of 2 * radius_y + 1 rows while the
+ * window slides down, so the filter itself never checks for edges.
+ * @param image    the source image
+ * @param radius_x pixels the filter reads left and right of its output
+ * @param radius_y rows it reads above and below
+ * @param border   the border mode
+ * @param begin    first output row
+ * @param end      one past the last
+ * @param body     called for each output row and tile with the padded
+ *                 rows of the window, top to bottom, each starting
+ *                 radius_x pixels left of the tile
+ * @return nothing
+ */
+void convolve_tiles(const Image& image, int radius_x, int radius_y, BorderMode border, int begin, int end,
+                    const function<void(const unsigned char* const*, int, int, int)>& body)
+{
+    int window_rows = 2 * radius_y + 1;
+    int tile = max(64, CONVOLVE_TILE_BYTES / (3 * window_rows) - 2 * radius_x);
+    tile = min(tile, image.width);
+    size_t padded_bytes = 3 * (size_t)(tile + 2 * radius_x);
+    vector<unsigned char> ring(window_rows * padded_bytes);
+    vector<const unsigned char*> window(window_rows);
+    // Source row y is kept in slot y mod window_rows
+    auto slot = [&](int y)
+    {
+        return ring.data() + ((y % window_rows + window_rows) % window_rows) * padded_bytes;
+    };
+
+    for (int tile_begin = 0; tile_begin < image.width; tile_begin += tile)
+    {
+        int tile_end = min(image.width, tile_begin + tile);
+        int first = tile_begin - radius_x;
+        int last = tile_end + radius_x;
+        for (int y = begin - radius_y; y < begin + radius_y; y++)
+        {
+            pad_row(image, y, first, last, border, slot(y));
+        }
+        for (int row = begin; row < end; row++)
+        {
+            pad_row(image, row + radius_y, first, last, border, slot(row + radius_y));
+            for (int k = 0; k < window_rows; k++)
+            {
+                window[k] = slot(row - radius_y + k);
+            }
+            body(window.data(), row, tile_begin, tile_end);
+        }
+    }
+}
+
+/**
+ * Rounds convolution weights to 16 bits with as many fractional bits as
+ * fit, at most 14, keeping the sum of a window in 32 bits. The largest
+ * weight takes up the rounding so that the sum is the rounded sum of the
+ * weights, and flat areas keep their level.
+ * @param weights the weights
+ * @param shift   receives the number of fractional bits
+ * @return the weights in fixed point
+ */
+vector<short> fixed_weights(const vector<double>& weights, int& shift)
+{
+    double largest = 0;
+    double magnitude = 0;
+    double total = 0;
+    for (double weight : weights)
+    {
+        largest = max(largest, abs(weight));
+        magnitude += abs(weight);
+        total += weight;
+    }
+    shift = 14;
+    while (shift > 0 && (largest * (1 << shift) > 32767 || magnitude * 255 * (1 << shift) >= 1 << 30))
+    {
+        shift--;
+    }
+
+    vector<int> fixed;
+    int sum = 0;
+    size_t biggest = 0;
+    for (size_t k = 0; k < weights.size(); k++)
+    {
+        fixed.push_back((int)lround(weights[k] * (1 << shift)));
+        sum += fixed[k];
+        biggest = abs(fixed[k]) > abs(fixed[biggest]) ? k : biggest;
+    }
+    if (!fixed.empty())
+    {
+        fixed[biggest] += (int)lround(total * (1 << shift)) - sum;
+    }
+    vector<short> result;
+    for (int weight : fixed)
+    {
+        result.push_back(max(-32767, min(32767, weight)));
+    }
+    return result;
+}
+
+/**
+ * Scales blur weights to add up to exactly DOWNSCALE_ONE, the Q14 of the
+ * downscale passes
+ * @param weights the weights, none negative and not all zero
+ * @return the weights in Q14
+ */
+vector<short> blur_weights(const vector<double>& weights)
+{
+    double total = 0;
+    for (double weight : weights)
+    {
+        total += weight;
+    }
+    vector<short> fixed;
+    int sum = 0;
+    size_t largest = 0;
+    for (size_t k = 0; k < weights.size(); k++)
+    {
+        fixed.push_back((short)lround(weights[k] / total * DOWNSCALE_ONE));
+        sum += fixed[k];
+        largest = fixed[k] > fixed[largest] ? k : largest;
+    }
+    fixed[largest] += DOWNSCALE_ONE - sum;
+    return fixed;
+}
+
+/**
+ * Convolves an image with a kernel in its stored order. Each output row
+ * is one convolve_bytes() call with a row pointer per non-zero weight.
+ * @param image  the image
+ * @param kernel the kernel
+ * @param border the border mode
+ * @return the new image, with the orientation of the input
+ */
+Image convolve_image(const Image& image, const ConvolutionKernel& kernel, BorderMode border)
+{
+    int shift;
+    vector<short> fixed = fixed_weights(kernel.weights, shift);
+    vector<int> tap_rows;
+    vector<int> tap_offsets;
+    vector<short> weights;
+    for (int y = 0; y < kernel.height; y++)
+    {
+        for (int x = 0; x < kernel.width; x++)
+        {
+            if (fixed[y * kernel.width + x] != 0)
+            {
+                tap_rows.push_back(y);
+                tap_offsets.push_back(3 * x);
+                weights.push_back(fixed[y * kernel.width + x]);
+            }
+        }
+    }
+
+    Image new_image(image.width, image.height);
+    new_image.orientation = image.orientation;
+    int taps = weights.size();
+    parallel_rows(image.height, [&](int begin, int end)
+    {
+        vector<const unsigned char*> rows(taps);
+        convolve_tiles(image, kernel.width / 2, kernel.height / 2, border, begin, end,
+                       [&](const unsigned char* const* window, int row, int tile_begin, int tile_end)
+        {
+            for (int k = 0; k < taps; k++)
+            {
+                rows[k] = window[tap_rows[k]] + tap_offsets[k];
+            }
+            unsigned char* out = (unsigned char*)(new_image[row] + tile_begin);
+            int num_values = 3 * (tile_end - tile_begin);
+            int done = simd_kernels.convolve_bytes(rows.data(), weights.data(), taps, shift, out, num_values);
+            convolve_bytes(rows.data(), weights.data(), taps, shift, out, done, num_values);
+        });
+    });
+    return new_image;
+}
+
+/**
+ * Blurs an image in its stored order with a separable kernel: the
+ * vertical pass of downscale() weighs whole image rows into 16-bit
+ * values, which are padded with their border columns, and
+ * convolve_values() weighs those along the row. Neither pass is tiled, so
+ * each costs its taps per pixel and no halo columns are weighed twice.
+ * @param image  the image
+ * @param column vertical weights in Q14
+ * @param row    horizontal weights in Q14
+ * @param border the border mode
+ * @return the new image, with the orientation of the input
+ */
+Image blur_image(const Image& image, const vector<short>& column, const vector<short>& row, BorderMode border)
+{
+    Image new_image(image.width, image.height);
+    new_image.orientation = image.orientation;
+    int radius_x = row.size() / 2;
+    int radius_y = column.size() / 2;
+    int num_values = 3 * image.width;
+    // Rows past the edges with a zero border read this one
+    vector<unsigned char> zero_row(num_values);
+    parallel_rows(image.height, [&](int begin, int end)
+    {
+        vector<short> values(3 * (image.width + 2 * radius_x));
+        short* inside = values.data() + 3 * radius_x;
+        vector<const unsigned char*> window(column.size());
+        vector<const short*> taps(row.size());
+        for (size_t k = 0; k < row.size(); k++)
+        {
+            taps[k] = values.data() + 3 * k;
+        }
+        for (int out_row = begin; out_row < end; out_row++)
+        {
+            for (size_t k = 0; k < column.size(); k++)
+            {
+                int source = border_index(out_row - radius_y + k, image.height, border);
+                window[k] = source < 0 ? zero_row.data() : (const unsigned char*)image[source];
+            }
+            int done = simd_kernels.downscale_vertical(window.data(), column.data(), column.size(), inside, num_values);
+            downscale_vertical_values(window.data(), column.data(), column.size(), inside, done, num_values);
+
+            // Weighing a column past the edge gives the values of the
+            // column it copies, or zero
+            auto pad = [&](int col)
+            {
+                int from = border_index(col, image.width, border);
+                for (int c = 0; c < 3; c++)
+                {
+                    inside[3 * col + c] = from < 0 ? 0 : inside[3 * from + c];
+                }
+            };
+            for (int col = -radius_x; col < 0; col++)
+            {
+                pad(col);
+            }
+            for (int col = image.width; col < image.width + radius_x; col++)
+            {
+                pad(col);
+            }
+
+            unsigned char* out = (unsigned char*)new_image[out_row];
+            done = simd_kernels.convolve_values(taps.data(), row.data(), row.size(), out, num_values);
+            convolve_values(taps.data(), row.data(), row.size(), out, done, num_values);
+        }
+    });
+    return new_image;
+}
+
+/**
+ * Convolves an image with a kernel. Kernels are not in general the same
+ * turned around, so images with an orientation are put upright first.
+ * @param image  the image
+ * @param kernel the kernel; if its size does not match its weights, the
+ *               image is returned as it is
+ * @param border the border mode
+ * @return the new image
+ */
+Image convolve(const Image& image, const ConvolutionKernel& kernel, BorderMode border)
+{
+    if (kernel.width < 1 || kernel.height < 1 || kernel.weights.size() != (size_t)kernel.width * kernel.height)
+    {
+        return image;
+    }
+    if (!image.orientation.identity())
+    {
+        return convolve(upright(image), kernel, border);
+    }
+    return convolve_image(image, kernel, border);
+}
+
+Image convolve_separable(const Image& image, const vector<double>& column, const vector<double>& row,
+                         BorderMode border)
+{
+    bool blur = !column.empty() && !row.empty();
+    double column_total = 0;
+    double row_total = 0;
+    for (double weight : column)
+    {
+        blur = blur && weight >= 0;
+        column_total += weight;
+    }
+    for (double weight : row)
+    {
+        blur = blur && weight >= 0;
+        row_total += weight;
+    }
+    if (!blur || column_total <= 0 || row_total <= 0)
+    {
+        ConvolutionKernel kernel;
+        kernel.width = row.size();
+        kernel.height = column.size();
+        for (double y : column)
+        {
+            for (double x : row)
+            {
+                kernel.weights.push_back(y * x);
+            }
+        }
+        return convolve(image, kernel, border);
+    }
+    if (!image.orientation.identity())
+    {
+        return convolve_separable(upright(image), column, row, border);
+    }
+    return blur_image(image, blur_weights(column), blur_weights(row), border);
+}
+
+/**
+ * Gaussian blur. The kernel is the same in both directions and
+ * symmetric, so the image keeps its orientation; the passes then run in
+ * the stored order, which can move a channel by 1 compared with the
+ * upright image.
+ * @param image  the image
+ * @param sigma  the standard deviation in pixels; 0 or less returns the
+ *               image as it is
+ * @param border the border mode
+ * @return the blurred image
+ */
+Image gaussian_blur(const Image& image, double sigma, BorderMode border)
+{
+    int radius = (int)ceil(3 * sigma);
+    if (sigma <= 0 || radius < 1)
+    {
+        return image;
+    }
+    vector<double> weights(2 * radius + 1);
+    for (int i = 0; i <= 2 * radius; i++)
+    {
+        weights[i] = exp(-(double)(i - radius) * (i - radius) / (2 * sigma * sigma));
+    }
+    vector<short> fixed = blur_weights(weights);
+    return blur_image(image, fixed, fixed, border);
+}
+
+/**
+ * Works out the multiply and shifts that divide by the size of a box blur
+ * window, see BoxDivisor
+ * @param count the number of pixels in the window, odd and below 2^23
+ * @return the divisor
+ */
+BoxDivisor make_box_divisor(int count)
+{
+    BoxDivisor divisor;
+    divisor.half = count / 2;
+    while ((2 << divisor.shift) <= count)
+    {
+        divisor.shift++;
+    }
+    divisor.multiplier = (unsigned int)(((1ULL << (32 + divisor.shift)) + count - 1) / count);
+    return divisor;
+}
+
+/**
+ * Box blur with running sums, so the work per pixel does not depend on
+ * the radius. Each thread keeps the sum of every channel over the rows of
+ * the window and slides it down one row at a time by adding the row that
+ * enters and taking away the one that leaves. Along the row, the column
+ * sums are padded with the border and a running sum over the window gives
+ * the total, which is divided once, so the result is the exact rounded
+ * mean.
+ * @param image  the image
+ * @param radius the window reaches this many pixels each way, up to 1000;
+ *               0 or less returns the image as it is
+ * @param border the border mode
+ * @return the blurred image
+ */
+Image box_blur(const Image& image, int radius, BorderMode border)
+{
+    radius = min(radius, 1000);
+    if (radius < 1)
+    {
+        return image;
+    }
+    int width = image.width;
+    int num_values = 3 * width;
+    int size = 2 * radius + 1;
+    BoxDivisor divisor = make_box_divisor(size * size);
+    vector<unsigned char> black(num_values, 0);
+    auto source_row = [&](int row)
+    {
+        int source = border_index(row, image.height, border);
+        return source < 0 ? black.data() : (const unsigned char*)image[source];
+    };
+    // The source of each padded column past the left edge, then of each
+    // past the right edge
+    vector<int> border_columns;
+    for (int col = -radius; col < width + radius; col = col == -1 ? width : col + 1)
+    {
+        border_columns.push_back(border_index(col, width, border));
+    }
+
+    Image new_image(width, image.height);
+    new_image.orientation = image.orientation;
+    parallel_rows(image.height, [&](int begin, int end)
+    {
+        vector<int> columns(num_values, 0);
+        vector<int> padded(3 * (width + 2 * radius));
+        vector<int> sums(num_values);
+        auto add_rows = [&](const unsigned char* add, const unsigned char* sub)
+        {
+            int done = simd_kernels.box_add_rows(columns.data(), add, sub, num_values);
+            box_add_rows(columns.data(), add, sub, done, num_values);
+        };
+        for (int row = begin - radius; row < begin + radius; row++)
+        {
+            add_rows(source_row(row), black.data());
+        }
+
+        for (int row = begin; row < end; row++)
+        {
+            add_rows(source_row(row + radius), row > begin ? source_row(row - radius - 1) : black.data());
+
+            // The column sums with their border, then a running sum
+            memcpy(padded.data() + 3 * radius, columns.data(), num_values * sizeof(int));
+            for (int k = 0; k < 2 * radius; k++)
+            {
+                int col = k < radius ? k : width + k;
+                int source = border_columns[k];
+                for (int c = 0; c < 3; c++)
+                {
+                    padded[3 * col + c] = source < 0 ? 0 : columns[3 * source + c];
+                }
+            }
+            // One variable per channel, so the three sums stay in registers
+            int blue = 0;
+            int green = 0;
+            int red = 0;
+            for (int i = 0; i < 3 * (size - 1); i += 3)
+            {
+                blue += padded[i];
+                green += padded[i + 1];
+                red += padded[i + 2];
+            }
+            const int* enter = padded.data() + 3 * (size - 1);
+            const int* leave = padded.data();
+            for (int i = 0; i < num_values; i += 3)
+            {
+                blue += enter[i];
+                green += enter[i + 1];
+                red += enter[i + 2];
+                sums[i] = blue;
+                sums[i + 1] = green;
+                sums[i + 2] = red;
+                blue -= leave[i];
+                green -= leave[i + 1];
+                red -= leave[i + 2];
+            }
+
+            unsigned char* out = (unsigned char*)new_image[row];
+            int done = simd_kernels.box_divide(sums.data(), out, num_values, divisor);
+            box_divide(sums.data(), out, done, num_values, divisor);
+        }
+    });
+    return new_image;
+}
+
+/**
+ * Sharpens with the 3x3 kernel that adds amount times the difference
+ * between the centre and each of its four neighbours. The kernel is the
+ * same turned around, so the image keeps its orientation.
+ * @param image  the image
+ * @param amount how strongly to sharpen
+ * @param border the border mode
+ * @return the sharpened image
+ */
+Image sharpen(const Image& image, double amount, BorderMode border)
+{
+    ConvolutionKernel kernel;
+    kernel.width = 3;
+    kernel.height = 3;
+    kernel.weights = {0, -amount, 0, -amount, 1 + 4 * amount, -amount, 0, -amount, 0};
+    return convolve_image(image, kernel, border);
+}
+
+/**
+ * Sobel edge magnitudes. Turning the image only swaps and negates the two
+ * gradients, so the magnitude is the same and the image keeps its
+ * orientation.
+ * @param image  the image
+ * @param border the border mode
+ * @return an image that is bright where the channels change quickly
+ */
+Image sobel_edges(const Image& image, BorderMode border)
+{
+    Image new_image(image.width, image.height);
+    new_image.orientation = image.orientation;
+    parallel_rows(image.height, [&](int begin, int end)
+    {
+        convolve_tiles(image, 1, 1, border, begin, end,
+                       [&](const unsigned char* const* window, int row, int tile_begin, int tile_end)
+        {
+            unsigned char* out = (unsigned char*)(new_image[row] + tile_begin);
+            int num_values = 3 * (tile_end - tile_begin);
+            int done = simd_kernels.sobel(window[0], window[1], window[2], out, num_values);
+            sobel_values(window[0], window[1], window[2], out, done, num_values);
+        });
+    });
+    return new_image;
+}
+
+//***************************************************************************************************//
+//                            Fused pipeline of per-pixel filters                                    //
+//***************************************************************************************************//
+
+// A pipeline step with its lookup tables and vignette mask built
+struct CompiledPointOp
+{
+    PointOpType type;
+    ToneTable lighten;  // Used by Clarendon and Lighten
+    ToneTable darken;   // Used by Clarendon and Darken
+    shared_ptr<const VignetteMask> mask;    // Used by Vignette
+    Orientation orientation;                // Used by Vignette
+    int num_rows = 0;                       // Used by Vignette: stored height
+};
+
+/**
+ * Builds the lookup tables or vignette mask a pipeline step needs
+ * @param op          the step
+ * @param num_rows    image height
+ * @param num_columns image width
+ * @param row_begin   first row the step will be applied to
+ * @param row_end     one past the last row (-1 for all rows)
+ * @param orientation orientation of the image; bands must be upright
+ * @return the step ready to be applied to rows
+ */
+CompiledPointOp compile_point_op(const PointOp& op, int num_rows, int num_columns,
+                                 int row_begin = 0, int row_end = -1,
+                                 const Orientation& orientation = Orientation())
+{
+    CompiledPointOp compiled;
+    compiled.type = op.type;
+    compiled.orientation = orientation;
+    compiled.num_rows = num_rows;
+    if (op.type == PointOpType::Vignette)
+    {
+        // Whole images share cached masks; a band gets a mask of its own
+        // rows so that streaming never holds a full-size mask
+        if (row_begin == 0 && (row_end < 0 || row_end == num_rows))
+        {
+            if (orientation.transpose)
+            {
+                compiled.mask = vignette_masks.get(num_columns, num_rows, op.vignette);
+            }
+            else
+            {
+                compiled.mask = vignette_masks.get(num_rows, num_columns, op.vignette);
+            }
+        }
+        else
+        {
+            compiled.mask = make_shared<const VignetteMask>(
+                make_vignette_mask(num_rows, num_columns, op.vignette, row_begin, row_end));
+        }
+    }
+    if (op.type == PointOpType::Clarendon || op.type == PointOpType::Lighten)
+    {
+        compiled.lighten = make_lighten_table(op.scaling_factor);
+    }
+    if (op.type == PointOpType::Clarendon || op.type == PointOpType::Darken)
+    {
+        compiled.darken = make_darken_table(op.scaling_factor);
+    }
+    return compiled;
+}
+
+/**
+ * Applies one pipeline step to a row
+ * @param op          the compiled step to apply
+ * @param in          the input pixels of the row
+ * @param out         where the filtered pixels go (may be the same as in)
+ * @param row         index of the row in the image
+ * @param num_columns image width
+ * @return nothing
+ */
+void apply_point_op(const CompiledPointOp& op, const Pixel* in, Pixel* out, int row, int num_columns)
+{
+    switch (op.type)
+    {
+        case PointOpType::Vignette:
+            vignette_row(in, out, row, num_columns, op.num_rows, op.orientation, *op.mask);
+            break;
+        case PointOpType::Clarendon:
+            clarendon_row(in, out, num_columns, op.lighten, op.darken);
+            break;
+        case PointOpType::Grayscale:
+            grayscale_row(in, out, num_columns);
+            break;
+        case PointOpType::HighContrast:
+            high_contrast_row(in, out, num_columns);
+            break;
+        case PointOpType::Lighten:
+            tone_row(in, out, num_columns, op.lighten);
+            break;
+        case PointOpType::Darken:
+            tone_row(in, out, num_columns, op.darken);
+            break;
+        case PointOpType::PrimaryColors:
+            primary_colors_row(in, out, num_columns);
+            break;
+    }
+}
+
+// Rows of pixels somewhere in memory: the rows of an Image, or the pixel
+// array of a mapped BMP file, which is stored bottom row first and so has
+// a negative stride
+struct ImageView
+{
+    unsigned char* top = nullptr;   // Start of the top row
+    int width = 0;
+    int height = 0;
+    ptrdiff_t stride = 0;           // Bytes from one row to the next one down
+
+    Pixel* operator[](int row) const
+    {
+        return reinterpret_cast<Pixel*>(top + row * stride);
+    }
+};
+
+// A view of the rows of an image. The view is not const, so only write
+// through views of images you may change.
+ImageView view_of(const Image& image)
+{
+    ImageView view;
+    view.top = const_cast<unsigned char*>(image.data.data());
+    view.width = image.width;
+    view.height = image.height;
+    view.stride = image.stride;
+    return view;
+}
+
+/**
+ * Runs compiled pipeline steps over every row of an image
+ * @param compiled  the steps, in order
+ * @param image     the input rows
+ * @param new_image receives the output rows (may be the same as image)
+ * @param first_row index of image's first row in the full image
+ * @return nothing
+ */
+void run_compiled_ops(const vector<CompiledPointOp>& compiled, ImageView image, ImageView new_image, int first_row)
+{
+    int num_columns = image.width;
+    parallel_rows(image.height, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            const Pixel* in = image[row];
+            for (const CompiledPointOp& op : compiled)
+            {
+                apply_point_op(op, in, new_image[row], first_row + row, num_columns);
+                in = new_image[row];
+            }
+        }
+    });
+}
+
+void run_compiled_ops(const vector<CompiledPointOp>& compiled, const Image& image, Image& new_image, int first_row)
+{
+    run_compiled_ops(compiled, view_of(image), view_of(new_image), first_row);
+}
+
+/**
+ * Runs a chain of per-pixel filters in a single pass over the image.
+ * Each row is read once, run through every step while it is still in
+ * cache, and written once to the single output image. The result is the
+ * same as calling the process_N functions one after the other.
+ * @param image the input image
+ * @param ops   the filters to apply, in order
+ * @return the filtered image
+ */
+Image run_pipeline(const Image& image, const vector<PointOp>& ops)
+{
+    if (ops.empty())
+    {
+        return image;
+    }
+
+    int num_rows = image.height;
+    int num_columns = image.width;
+    vector<CompiledPointOp> compiled;
+    for (const PointOp& op : ops)
+    {
+        compiled.push_back(compile_point_op(op, num_rows, num_columns, 0, -1, image.orientation));
+    }
+
+    Image new_image(num_columns, num_rows);
+    new_image.orientation = image.orientation;
+    run_compiled_ops(compiled, image, new_image, 0);
+    return new_image;
+}
+
+// In-place version of run_pipeline, for an input that is not needed
+// afterwards
+Image run_pipeline(Image&& image, const vector<PointOp>& ops)
+{
+    vector<CompiledPointOp> compiled;
+    for (const PointOp& op : ops)
+    {
+        compiled.push_back(compile_point_op(op, image.height, image.width, 0, -1, image.orientation));
+    }
+    run_compiled_ops(compiled, image, image, 0);
+    return move(image);
+}
+
+//***************************************************************************************************//
+//                                  Memory-mapped BMP files                                          //
+//***************************************************************************************************//
+
+// A 24-bit BMP file mapped into memory, so its pixel array can be used in
+// place through an ImageView without decoding it into an Image. An input
+// file is mapped read-only (its view must not be written to); an output
+// file is mapped shared, so pixels written to its view go straight to the
+// file and the input is never touched.
+class MappedBmp
+{
+public:
+    MappedBmp() {}
+
+    ~MappedBmp()
+    {
+        string error;
+        close(error);
+    }
+
+    MappedBmp(const MappedBmp&) = delete;
+    MappedBmp& operator=(const MappedBmp&) = delete;
+
+    /**
+     * Maps an existing 24-bit BMP file
+     * @param filename the file
+     * @param error    receives a message on failure
+     * @return true if the file is mapped
+     */
+    bool open_file(const string& filename, string& error)
+    {
+        fstream stream;
+        stream.open(filename, ios::in | ios::binary);
+        if (!read_bmp_info(stream, info) || info.bytes_per_pixel != 3)
+        {
+            error = info.too_large ? "cannot map " + filename + ": BMP files over 4 GiB are not supported"
+                                   : "cannot map " + filename + ": not a 24-bit BMP";
+            return false;
+        }
+        stream.close();
+        return map(filename, false, error);
+    }
+
+    /**
+     * Creates a 24-bit BMP file with its headers written and its pixels
+     * (and padding) zeroed, and maps it
+     * @param filename the file
+     * @param width    image width
+     * @param height   image height
+     * @param error    receives a message on failure
+     * @return true if the file is mapped; on failure no file is left behind
+     */
+    bool create_file(const string& filename, int width, int height, string& error)
+    {
+        info.width = width;
+        info.height = height;
+        info.bytes_per_pixel = 3;
+        info.start = 54;
+        info.file_stride = ((long long)width * 3 + 3) / 4 * 4;
+        if (!map(filename, true, error))
+        {
+            return false;
+        }
+        make_bmp_headers(base, width, height);
+        return true;
+    }
+
+    /**
+     * Unmaps the file. For an output file, the pixels are in the file
+     * once this returns true.
+     * @param error receives a message on failure
+     * @return false if the file could not be written
+     */
+    bool close(string& error)
+    {
+        bool ok = true;
+#if defined(IMAGE_MMAP)
+        if (base != nullptr && munmap(base, length) != 0)
+        {
+            error = "cannot unmap file";
+            ok = false;
+        }
+#endif
+        base = nullptr;
+        length = 0;
+        return ok;
+    }
+
+    int width() const
+    {
+        return info.width;
+    }
+
+    int height() const
+    {
+        return info.height;
+    }
+
+    // The pixels, top row first
+    ImageView view() const
+    {
+        ImageView view;
+        view.width = info.width;
+        view.height = info.height;
+        view.stride = -info.file_stride;
+        view.top = base + info.start + info.file_stride * (info.height - 1);
+        return view;
+    }
+
+private:
+    bool map(const string& filename, bool output, string& error)
+    {
+#if defined(IMAGE_MMAP)
+        int fd = output ? ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)
+                        : ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            error = "cannot open " + filename;
+            return false;
+        }
+        // Headers can lie; only map files that hold the whole pixel array
+        off_t bytes = info.start + info.file_stride * info.height;
+        struct stat status;
+        bool sized = output ? ftruncate(fd, bytes) == 0
+                            : fstat(fd, &status) == 0 && status.st_size >= bytes;
+        // Fault the whole file in with one call instead of a page at a time
+        int flags = output ? MAP_SHARED : MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+        flags |= MAP_POPULATE;
+#endif
+        void* address = MAP_FAILED;
+        if (sized)
+        {
+            address = mmap(nullptr, bytes, output ? PROT_READ | PROT_WRITE : PROT_READ, flags, fd, 0);
+        }
+        ::close(fd);
+        if (address == MAP_FAILED)
+        {
+            // An output was created or truncated above; do not leave it
+            // behind looking like a result
+            if (output)
+            {
+                ::unlink(filename.c_str());
+            }
+            error = "cannot map " + filename;
+            return false;
+        }
+        base = (unsigned char*)address;
+        length = bytes;
+        madvise(base, length, MADV_SEQUENTIAL);
+        return true;
+#else
+        error = "memory-mapped files are not supported on this system";
+        return false;
+#endif
+    }
+
+    BmpInfo info;
+    unsigned char* base = nullptr;
+    size_t length = 0;
+};
+
+//***************************************************************************************************//
+//                                    Operations and jobs                                            //
+//***************************************************************************************************//
+
+/**
+ * Parses an operation written as name or name=value, e.g. "grayscale",
+ * "darken=0.5", "rotate=3", "enlarge=2x3", "enlarge=1.5x1.5:bilinear" or
+ * "blur=2:wrap"
+ * @param text  the operation
+ * @param op    receives the operation
+ * @param error receives a message if the text is not valid
+ * @return true if the text was valid
+ */
+bool parse_operation(const string& text, Operation& op, string& error)
+{
+    size_t equals = text.find('=');
+    string name = text.substr(0, equals);
+    string value = equals == string::npos ? "" : text.substr(equals + 1);
+
+    auto parse_factor = [&](double& factor)
+    {
+        char* end = nullptr;
+        factor = strtod(value.c_str(), &end);
+        if (value.empty() || *end != '\0' || factor <= 0 || factor >= 1)
+        {
+            error = name + " needs a scale factor between 0 and 1, e.g. " + name + "=0.5";
+            return false;
+        }
+        return true;
+    };
+
+    op = Operation();
+    if (name == "vignette")
+    {
+        op.point.type = PointOpType::Vignette;
+    }
+    else if (name == "clarendon")
+    {
+        op.point.type = PointOpType::Clarendon;
+        return parse_factor(op.point.scaling_factor);
+    }
+    else if (name == "grayscale")
+    {
+        op.point.type = PointOpType::Grayscale;
+    }
+    else if (name == "contrast")
+    {
+        op.point.type = PointOpType::HighContrast;
+    }
+    else if (name == "lighten")
+    {
+        op.point.type = PointOpType::Lighten;
+        return parse_factor(op.point.scaling_factor);
+    }
+    else if (name == "darken")
+    {
+        op.point.type = PointOpType::Darken;
+        return parse_factor(op.point.scaling_factor);
+    }
+    else if (name == "primary")
+    {
+        op.point.type = PointOpType::PrimaryColors;
+    }
+    else if (name == "rotate")
+    {
+        op.kind = OperationKind::Rotate;
+        if (!value.empty())
+        {
+            op.rotations = atoi(value.c_str());
+        }
+        if (op.rotations < 1)
+        {
+            error = "rotate needs a positive number of clockwise quarter turns, e.g. rotate=3";
+            return false;
+        }
+    }
+    else if (name == "mirror" || name == "flip")
+    {
+        op.kind = OperationKind::Mirror;
+        op.vertical = name == "flip";
+    }
+    else if (name == "enlarge")
+    {
+        op.kind = OperationKind::Enlarge;
+        size_t colon = value.find(':');
+        if (colon != string::npos)
+        {
+            string mode = value.substr(colon + 1);
+            value = value.substr(0, colon);
+            if (mode == "bilinear")
+            {
+                op.resize = ResizeMode::Bilinear;
+            }
+            else if (mode != "nearest")
+            {
+                error = "enlarge mode must be nearest or bilinear, e.g. enlarge=1.5x2:bilinear";
+                return false;
+            }
+        }
+        char extra;
+        if (sscanf(value.c_str(), "%lfx%lf%c", &op.xscale, &op.yscale, &extra) != 2 || op.xscale < 1 || op.yscale < 1)
+        {
+            error = "enlarge needs x and y scales of at least 1, e.g. enlarge=2x3 or enlarge=1.5x1.5";
+            return false;
+        }
+    }
+    else if (name == "downscale" || name == "thumbnail")
+    {
+        op.kind = OperationKind::Downscale;
+        size_t colon = value.find(':');
+        if (colon != string::npos)
+        {
+            string filter = value.substr(colon + 1);
+            value = value.substr(0, colon);
+            if (filter == "box")
+            {
+                op.filter = DownscaleFilter::Box;
+            }
+            else if (filter == "bilinear")
+            {
+                op.filter = DownscaleFilter::Bilinear;
+            }
+            else if (filter != "area")
+            {
+                error = name + " filter must be box, bilinear or area, e.g. " + name + "="
+                        + (name == "thumbnail" ? "256" : "2x2") + ":bilinear";
+                return false;
+            }
+        }
+        char extra;
+        if (name == "thumbnail")
+        {
+            if (sscanf(value.c_str(), "%d%c", &op.max_side, &extra) != 1 || op.max_side < 1)
+            {
+                error = "thumbnail needs the size of the longer side in pixels, e.g. thumbnail=256";
+                return false;
+            }
+        }
+        else if (sscanf(value.c_str(), "%lfx%lf%c", &op.xscale, &op.yscale, &extra) != 2 || op.xscale < 1
+                 || op.yscale < 1)
+        {
+            error = "downscale needs x and y scales of at least 1, e.g. downscale=2x2 or downscale=3.5x3.5";
+            return false;
+        }
+    }
+    else if (name == "blur" || name == "boxblur" || name == "sharpen" || name == "edges")
+    {
+        op.kind = OperationKind::Convolve;
+        size_t colon = name == "edges" ? 0 : value.find(':');
+        if (colon != string::npos)
+        {
+            string border = value.substr(colon + (name == "edges" ? 0 : 1));
+            value = value.substr(0, colon);
+            if (border == "clamp")
+            {
+                op.border = BorderMode::Clamp;
+            }
+            else if (border == "wrap")
+            {
+                op.border = BorderMode::Wrap;
+            }
+            else if (border == "zero")
+            {
+                op.border = BorderMode::Zero;
+            }
+            else if (border != "reflect" && !border.empty())
+            {
+                error = name + " border must be clamp, reflect, wrap or zero, e.g. "
+                        + (name == "edges" ? "edges=clamp" : name + "=2:clamp");
+                return false;
+            }
+        }
+        char* end = nullptr;
+        op.amount = strtod(value.c_str(), &end);
+        if (name == "edges")
+        {
+            op.convolve = ConvolveFilter::Edges;
+        }
+        else if (name == "blur")
+        {
+            op.convolve = ConvolveFilter::Gaussian;
+            if (value.empty() || *end != '\0' || op.amount <= 0 || op.amount > 100)
+            {
+                error = "blur needs a standard deviation in pixels up to 100, e.g. blur=2";
+                return false;
+            }
+        }
+        else if (name == "boxblur")
+        {
+            op.convolve = ConvolveFilter::Box;
+            if (value.empty() || *end != '\0' || op.amount != (int)op.amount || op.amount < 1 || op.amount > 1000)
+            {
+                error = "boxblur needs a whole number radius from 1 to 1000, e.g. boxblur=8";
+                return false;
+            }
+        }
+        else
+        {
+            op.convolve = ConvolveFilter::Sharpen;
+            if (value.empty() || *end != '\0' || op.amount <= 0 || op.amount > 4)
+            {
+                error = "sharpen needs an amount above 0 and up to 4, e.g. sharpen=0.5";
+                return false;
+            }
+        }
+    }
+    else
+    {
+        error = "unknown operation '" + name + "'";
+        return false;
+    }
+
+    if (!value.empty() && op.kind == OperationKind::Point)
+    {
+        error = name + " does not take a value";
+        return false;
+    }
+    return true;
+}
+
+// Quotes a string for JSON
+string json_string(const string& text)
+{
+    string result = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            result += '\\';
+            result += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            result += escaped;
+        }
+        else
+        {
+            result += c;
+        }
+    }
+    return result + "\"";
+}
+
+/**
+ * Formats the statistics of a job as one line of JSON
+ * @param stats the job
+ * @return the line, without a newline
+ */
+string job_stats_json(const JobStats& stats)
+{
+    double total = 0;
+    for (const StageStats& stage : stats.stages)
+    {
+        total += stage.seconds;
+    }
+    ostringstream json;
+    json << fixed << setprecision(6);
+    json << "{\"input\": " << json_string(stats.input) << ", \"output\": " << json_string(stats.output)
+         << ", \"ok\": " << (stats.ok ? "true" : "false") << ", \"seconds\": " << total << ", \"stages\": [";
+    for (size_t i = 0; i < stats.stages.size(); i++)
+    {
+        const StageStats& stage = stats.stages[i];
+        json << (i == 0 ? "" : ", ") << "{\"stage\": " << json_string(stage.name)
+             << ", \"seconds\": " << stage.seconds
+             << ", \"bytes_read\": " << stage.bytes_read << ", \"bytes_written\": " << stage.bytes_written
+             << ", \"pixels\": " << stage.pixels << ", \"allocations\": " << stage.allocations
+             << ", \"allocated_bytes\": " << stage.allocated_bytes
+             << ", \"reused_buffers\": " << stage.reused_buffers << "}";
+    }
+    json << "]}";
+    return json.str();
+}
+
+/**
+ * Names the function an operation runs, e.g. process_3, for statistics
+ * @param op the operation
+ * @return the name
+ */
+string operation_name(const Operation& op)
+{
+    if (op.kind == OperationKind::Rotate)
+    {
+        return "process_5";
+    }
+    if (op.kind == OperationKind::Mirror)
+    {
+        return "mirror_image";
+    }
+    if (op.kind == OperationKind::Enlarge)
+    {
+        return "process_6";
+    }
+    if (op.kind == OperationKind::Downscale)
+    {
+        return op.max_side > 0 ? "thumbnail" : "downscale";
+    }
+    if (op.kind == OperationKind::Convolve)
+    {
+        switch (op.convolve)
+        {
+            case ConvolveFilter::Gaussian:
+                return "gaussian_blur";
+            case ConvolveFilter::Box:
+                return "box_blur";
+            case ConvolveFilter::Sharpen:
+                return "sharpen";
+            default:
+                return "sobel_edges";
+        }
+    }
+    switch (op.point.type)
+    {
+        case PointOpType::Vignette:
+            return "process_1";
+        case PointOpType::Clarendon:
+            return "process_2";
+        case PointOpType::Grayscale:
+            return "process_3";
+        case PointOpType::HighContrast:
+            return "process_7";
+        case PointOpType::Lighten:
+            return "process_8";
+        case PointOpType::Darken:
+            return "process_9";
+        default:
+            return "process_10";
+    }
+}
+
+/**
+ * Names a run of operations that execute as one stage, e.g.
+ * process_1+process_3 for a fused pipeline
+ * @param ops   the operations
+ * @param begin first operation of the run
+ * @param end   one past the last
+ * @return the name
+ */
+string stage_name(const vector<Operation>& ops, size_t begin, size_t end)
+{
+    string name;
+    for (size_t i = begin; i < end; i++)
+    {
+        name += (i == begin ? "" : "+") + operation_name(ops[i]);
+    }
+    return name;
+}
+
+/**
+ * Applies a list of operations to an image. Runs of consecutive per-pixel
+ * filters are fused into one pass with run_pipeline. Rotations and mirrors
+ * only change the orientation of the result; write_image rearranges the
+ * pixels. The per-pixel filters work in place on the image, which is
+ * moved in; enlarge, downscale and the neighbourhood filters write a
+ * second image.
+ * @param image the input image
+ * @param ops   the operations, in order
+ * @param stats if not null, receives a stage for each step
+ * @return the result
+ */
+Image apply_operations(Image&& image, const vector<Operation>& ops, JobStats* stats)
+{
+    Image result = move(image);
+    size_t i = 0;
+    while (i < ops.size())
+    {
+        size_t begin = i;
+        unique_ptr<StageTimer> timer;
+        if (stats != nullptr)
+        {
+            size_t end = i + 1;
+            while (ops[i].kind == OperationKind::Point && end < ops.size() && ops[end].kind == OperationKind::Point)
+            {
+                end++;
+            }
+            timer.reset(new StageTimer(stats, stage_name(ops, begin, end)));
+            timer->pixels = (long long)result.width * result.height;
+        }
+
+        if (ops[i].kind == OperationKind::Point)
+        {
+            vector<PointOp> chain;
+            while (i < ops.size() && ops[i].kind == OperationKind::Point)
+            {
+                chain.push_back(ops[i].point);
+                i++;
+            }
+            result = run_pipeline(move(result), chain);
+        }
+        else if (ops[i].kind == OperationKind::Rotate)
+        {
+            result = process_5(move(result), ops[i].rotations);
+            i++;
+        }
+        else if (ops[i].kind == OperationKind::Mirror)
+        {
+            result = mirror_image(move(result), ops[i].vertical);
+            i++;
+        }
+        else if (ops[i].kind == OperationKind::Enlarge)
+        {
+            result = process_6(result, ops[i].xscale, ops[i].yscale, ops[i].resize);
+            i++;
+        }
+        else if (ops[i].kind == OperationKind::Convolve)
+        {
+            const Operation& op = ops[i];
+            switch (op.convolve)
+            {
+                case ConvolveFilter::Gaussian:
+                    result = gaussian_blur(result, op.amount, op.border);
+                    break;
+                case ConvolveFilter::Box:
+                    result = box_blur(result, (int)op.amount, op.border);
+                    break;
+                case ConvolveFilter::Sharpen:
+                    result = sharpen(result, op.amount, op.border);
+                    break;
+                default:
+                    result = sobel_edges(result, op.border);
+                    break;
+            }
+            i++;
+        }
+        else
+        {
+            const Operation& op = ops[i];
+            if (op.max_side > 0)
+            {
+                result = thumbnail(result, op.max_side, op.filter);
+            }
+            else
+            {
+                int width = lround(result.display_width() / op.xscale);
+                int height = lround(result.display_height() / op.yscale);
+                result = downscale(result, width, height, op.filter);
+            }
+            i++;
+        }
+    }
+    return result;
+}
+
+int decode_min_side(const vector<Operation>& ops)
+{
+    if (!ops.empty() && ops[0].kind == OperationKind::Downscale && ops[0].max_side > 0)
+    {
+        return 2 * ops[0].max_side;
+    }
+    return 0;
+}
+
+Image apply_operations(const Image& image, const vector<Operation>& ops, JobStats* stats)
+{
+    return apply_operations(Image(image), ops, stats);
+}
+
+/**
+ * Reads a BMP file, applies operations to the whole image and writes the
+ * result
+ * @param input  BMP file to read
+ * @param output BMP file to write
+ * @param ops    the operations
+ * @param pixels receives the number of input pixels processed
+ * @param error  receives a message on failure
+ * @param stats  if not null, receives the time and work of each stage
+ * @return true if the output was written
+ */
+bool process_file(const string& input, const string& output, const vector<Operation>& ops,
+                  long long& pixels, string& error, JobStats* stats)
+{
+    Image image;
+    {
+        StageTimer timer(stats, "read_image");
+        DecodeStats decode;
+        int min_side = decode_min_side(ops);
+        image = min_side > 0 ? read_image_reduced(input, min_side, &decode) : read_image(input, &decode);
+        timer.bytes_read = decode.bytes;
+        timer.pixels = decode.pixels;
+        pixels = decode.pixels;
+    }
+    if (image.empty())
+    {
+        error = bmp_read_error(input);
+        return false;
+    }
+
+    Image new_image = apply_operations(move(image), ops, stats);
+
+    StageTimer timer(stats, "write_image");
+    timer.pixels = (long long)new_image.width * new_image.height;
+    if (!write_image(output, new_image))
+    {
+        error = bmp_file_size(new_image.display_width(), new_image.display_height()) > BMP_MAX_FILE_SIZE
+                    ? "cannot write " + output + ": the result would be over the 4 GiB a BMP can hold"
+                    : "cannot write " + output;
+        return false;
+    }
+    timer.bytes_written = 54 + (long long)((new_image.display_width() * 3 + 3) / 4 * 4) * new_image.display_height();
+    return true;
+}
+
+/**
+ * Decodes a BMP file held in memory, applies operations to it and encodes
+ * the result, without touching the file system
+ * @param data   the input file contents
+ * @param size   the number of bytes in data
+ * @param ops    the operations
+ * @param output receives the output file contents, in a buffer from
+ *               buffer_pool (a buffer it held before is given back)
+ * @param error  receives a message on failure
+ * @param stats  if not null, receives the time and work of each stage
+ * @return true if output holds the result
+ */
+bool process_buffer(const unsigned char* data, size_t size, const vector<Operation>& ops,
+                    vector<unsigned char>& output, string& error, JobStats* stats)
+{
+    Image image;
+    {
+        StageTimer timer(stats, "decode_bmp");
+        int min_side = decode_min_side(ops);
+        image = min_side > 0 ? decode_bmp_reduced(data, size, min_side) : decode_bmp(data, size);
+        timer.bytes_read = size;
+        timer.pixels = (long long)image.width * image.height;
+    }
+    if (image.empty())
+    {
+        error = "input is not a 24 or 32-bit BMP";
+        return false;
+    }
+
+    Image new_image = apply_operations(move(image), ops, stats);
+
+    StageTimer timer(stats, "encode_bmp");
+    timer.pixels = (long long)new_image.width * new_image.height;
+    buffer_pool.give(move(output));
+    output = encode_bmp(new_image);
+    timer.bytes_written = output.size();
+    if (output.empty())
+    {
+        error = "the result would be over the 4 GiB a BMP can hold";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Checks whether an output path names the input file itself, for the
+ * modes that write the output while the input is still being read. Those
+ * would truncate the input under themselves.
+ * @param input  the input file
+ * @param output the output file, which may not exist yet
+ * @return true if both are the same existing file
+ */
+bool same_file(const string& input, const string& output)
+{
+    error_code error;
+    return filesystem::equivalent(input, output, error);
+}
+
+/**
+ * Streams a BMP file through row-local operations (the per-pixel filters
+ * and enlarge) one band of scanlines at a time, so memory use depends on
+ * the band size and not on the image size. Bands are read in file order,
+ * which is bottom-up; every band maps to a contiguous band of output rows
+ * that comes next in the output file's bottom-up order, so the output is
+ * written in a single forward pass.
+ * @param input     BMP file to read
+ * @param output    BMP file to write
+ * @param ops       the operations; rotations and mirrors are not row-local and are refused
+ * @param band_rows scanlines per band, 0 to pick about 4 MB worth
+ * @param pixels    receives the number of input pixels processed
+ * @param error     receives a message on failure
+ * @param stats     if not null, receives the time and work of each stage,
+ *                  added up over the bands
+ * @return true if the output was written
+ */
+bool stream_image(const string& input, const string& output, const vector<Operation>& ops,
+                  int band_rows, long long& pixels, string& error, JobStats* stats)
+{
+    if (same_file(input, output))
+    {
+        error = "cannot write " + output + " over its own input with --stream, choose another output directory";
+        return false;
+    }
+    for (const Operation& op : ops)
+    {
+        if (op.kind == OperationKind::Rotate || op.kind == OperationKind::Mirror)
+        {
+            error = "rotate, mirror and flip cannot be streamed, they need the whole image";
+            return false;
+        }
+        if (op.kind == OperationKind::Downscale)
+        {
+            error = "downscale and thumbnail cannot be streamed, their output rows span bands of input rows";
+            return false;
+        }
+        if (op.kind == OperationKind::Convolve)
+        {
+            error = "blur, boxblur, sharpen and edges cannot be streamed, they read rows of the neighbouring bands";
+            return false;
+        }
+        if (op.kind == OperationKind::Enlarge && (op.resize != ResizeMode::Nearest
+            || op.xscale != (int)op.xscale || op.yscale != (int)op.yscale))
+        {
+            error = "only whole number nearest neighbour enlarge can be streamed";
+            return false;
+        }
+    }
+
+    fstream in_stream;
+    in_stream.open(input, ios::in | ios::binary);
+    BmpInfo info;
+    if (!read_bmp_info(in_stream, info))
+    {
+        error = bmp_read_error(input);
+        return false;
+    }
+
+    long long out_width = info.width;
+    long long out_height = info.height;
+    for (const Operation& op : ops)
+    {
+        if (op.kind == OperationKind::Enlarge)
+        {
+            out_width *= (int)op.xscale;
+            out_height *= (int)op.yscale;
+        }
+    }
+    if (out_width > INT_MAX || out_height > INT_MAX
+        || bmp_file_size((int)out_width, (int)out_height) > BMP_MAX_FILE_SIZE)
+    {
+        error = "cannot write " + output + ": the enlarged image would be over the 4 GiB a BMP can hold";
+        return false;
+    }
+
+    fstream out_stream;
+    out_stream.open(output, ios::out | ios::binary);
+    if (!out_stream.is_open())
+    {
+        error = "cannot write " + output;
+        return false;
+    }
+    write_bmp_headers(out_stream, out_width, out_height);
+
+    if (band_rows <= 0)
+    {
+        band_rows = max(1LL, (4LL << 20) / info.file_stride);
+    }
+    band_rows = min(band_rows, info.height);
+    vector<unsigned char> block((size_t)(info.file_stride * band_rows));
+
+    for (int file_row = 0; file_row < info.height; file_row += band_rows)
+    {
+        int rows = min(band_rows, info.height - file_row);
+        // The band holds image rows [first_row, first_row + rows), top row
+        // first, while the block holds them bottom row first
+        int first_row = info.height - file_row - rows;
+        Image band;
+        {
+            StageTimer timer(stats, "read_image");
+            in_stream.read((char*)block.data(), info.file_stride * rows);
+            if (in_stream.gcount() != info.file_stride * rows)
+            {
+                error = "unexpected end of " + input;
+                return false;
+            }
+            band = Image(info.width, rows);
+            for (int i = 0; i < rows; i++)
+            {
+                unpack_scanline(block.data() + info.file_stride * i, band[rows - 1 - i], info.width, info.bytes_per_pixel);
+            }
+            timer.bytes_read = info.file_stride * rows + (file_row == 0 ? info.start : 0);
+            timer.pixels = (long long)info.width * rows;
+        }
+
+        int num_rows = info.height;
+        int num_columns = info.width;
+        size_t i = 0;
+        while (i < ops.size())
+        {
+            size_t begin = i;
+            unique_ptr<StageTimer> timer;
+            if (stats != nullptr)
+            {
+                size_t end = i + 1;
+                while (ops[i].kind == OperationKind::Point && end < ops.size() && ops[end].kind == OperationKind::Point)
+                {
+                    end++;
+                }
+                timer.reset(new StageTimer(stats, stage_name(ops, begin, end)));
+                timer->pixels = (long long)band.width * band.height;
+            }
+
+            if (ops[i].kind == OperationKind::Point)
+            {
+                vector<CompiledPointOp> compiled;
+                while (i < ops.size() && ops[i].kind == OperationKind::Point)
+                {
+                    compiled.push_back(compile_point_op(ops[i].point, num_rows, num_columns,
+                                                        first_row, first_row + band.height));
+                    i++;
+                }
+                run_compiled_ops(compiled, band, band, first_row);
+            }
+            else
+            {
+                // Output row r of an enlarge comes from input row r/yscale, so
+                // the enlarged band is exactly the output rows of this band
+                int xscale = ops[i].xscale;
+                int yscale = ops[i].yscale;
+                band = process_6(band, xscale, yscale);
+                first_row *= yscale;
+                num_rows *= yscale;
+                num_columns *= xscale;
+                i++;
+            }
+        }
+
+        StageTimer timer(stats, "write_image");
+        write_scanlines(out_stream, band, 0, band.height);
+        timer.bytes_written = (long long)band.stride * band.height + (file_row == 0 ? 54 : 0);
+        timer.pixels = (long long)band.width * band.height;
+    }
+
+    pixels = (long long)info.width * info.height;
+    if (!out_stream.good())
+    {
+        error = "cannot write " + output;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Runs per-pixel filters from one BMP file to another through memory
+ * maps, without decoding into an Image or encoding out of one. The
+ * filters read the mapped input and write the mapped output directly,
+ * so each pixel is copied once. 32-bit input cannot be used in place and
+ * goes through process_file instead.
+ * @param input  BMP file to read
+ * @param output BMP file to write
+ * @param ops    the operations; only per-pixel filters are accepted
+ * @param pixels receives the number of input pixels processed
+ * @param error  receives a message on failure
+ * @param stats  if not null, receives the time and work of each stage
+ * @return true if the output was written
+ */
+bool mmap_image(const string& input, const string& output, const vector<Operation>& ops,
+                long long& pixels, string& error, JobStats* stats)
+{
+    if (same_file(input, output))
+    {
+        error = "cannot write " + output + " over its own input with --mmap, choose another output directory";
+        return false;
+    }
+    for (const Operation& op : ops)
+    {
+        if (op.kind != OperationKind::Point)
+        {
+            error = "only the per-pixel filters (vignette, clarendon, grayscale, contrast, lighten, darken and "
+                    "primary) can run on mapped files";
+            return false;
+        }
+    }
+
+    {
+        fstream stream;
+        stream.open(input, ios::in | ios::binary);
+        BmpInfo info;
+        if (read_bmp_info(stream, info) && info.bytes_per_pixel == 4)
+        {
+            return process_file(input, output, ops, pixels, error, stats);
+        }
+    }
+
+    MappedBmp source;
+    MappedBmp target;
+    {
+        StageTimer timer(stats, "map_files");
+        if (!source.open_file(input, error)
+            || !target.create_file(output, source.width(), source.height(), error))
+        {
+            return false;
+        }
+    }
+
+    {
+        StageTimer timer(stats, stage_name(ops, 0, ops.size()));
+        vector<CompiledPointOp> compiled;
+        for (const Operation& op : ops)
+        {
+            compiled.push_back(compile_point_op(op.point, source.height(), source.width()));
+        }
+        run_compiled_ops(compiled, source.view(), target.view(), 0);
+        timer.pixels = (long long)source.width() * source.height();
+        timer.bytes_read = 54 + (-source.view().stride) * source.height();
+    }
+
+    StageTimer timer(stats, "unmap_output");
+    timer.bytes_written = 54 + (-target.view().stride) * target.height();
+    if (!target.close(error))
+    {
+        remove(output.c_str());
+        error = "cannot write " + output;
+        return false;
+    }
+    pixels = (long long)source.width() * source.height();
+    return true;
+}
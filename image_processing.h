@@ -0,0 +1,742 @@
+// Image processing library: reads and writes 24-bit and 32-bit BMP images,
+// on disk or in memory, and runs the process_N filters and the operation
+// chains used by the command line program. main.cpp is one client of it;
+// anything else can include this header and link image_processing.cpp:
+//
+//     g++ -O2 -pthread -c image_processing.cpp
+//     g++ -O2 -pthread main.cpp image_processing.o -o image_processing
+//
+// simd_test.cpp checks the filters against the original formulas and the
+// SIMD levels against each other:
+//
+//     g++ -O2 -pthread simd_test.cpp image_processing.o -o simd_test
+//
+// Everything declared here is safe to call from several threads at once,
+// except set_filter_threads() and set_simd_level(), which are settings
+// meant to be changed before any filters run.
+#ifndef IMAGE_PROCESSING_H
+#define IMAGE_PROCESSING_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//***************************************************************************************************//
+//                                               Images                                              //
+//***************************************************************************************************//
+
+// Pixel structure
+// Channels are kept in blue, green, red order as 8-bit values so that a
+// row of Pixels has the same layout as a 24-bit BMP scanline
+struct Pixel
+{
+    // Blue, green, red color values
+    unsigned char blue;
+    unsigned char green;
+    unsigned char red;
+};
+
+// One of the 8 ways of turning and mirroring an image. Rotations only
+// change the orientation of an image; its pixels are put in the new order
+// once, when it is written. Displayed pixel (row, col) is stored pixel
+// (mirror_rows ? height-1-a : a, mirror_columns ? width-1-b : b), where
+// (a, b) is (col, row) if transpose is set and (row, col) otherwise.
+struct Orientation
+{
+    bool transpose = false;
+    bool mirror_rows = false;
+    bool mirror_columns = false;
+
+    bool identity() const
+    {
+        return !transpose && !mirror_rows && !mirror_columns;
+    }
+
+    // The orientation after turning the displayed image 90 degrees clockwise
+    Orientation rotated_clockwise() const
+    {
+        Orientation result = *this;
+        result.transpose = !transpose;
+        if (transpose)
+        {
+            result.mirror_columns = !mirror_columns;
+        }
+        else
+        {
+            result.mirror_rows = !mirror_rows;
+        }
+        return result;
+    }
+
+    // The orientation after swapping the displayed rows and columns
+    Orientation transposed() const
+    {
+        Orientation result = *this;
+        result.transpose = !transpose;
+        return result;
+    }
+
+    // The orientation after mirroring the displayed image left to right
+    // (or top to bottom if vertical is true)
+    Orientation mirrored(bool vertical) const
+    {
+        Orientation result = *this;
+        if (transpose != vertical)
+        {
+            result.mirror_rows = !mirror_rows;
+        }
+        else
+        {
+            result.mirror_columns = !mirror_columns;
+        }
+        return result;
+    }
+
+    bool operator==(const Orientation& other) const
+    {
+        return transpose == other.transpose && mirror_rows == other.mirror_rows
+            && mirror_columns == other.mirror_columns;
+    }
+};
+
+// Keeps the pixel buffers of images that are no longer needed, so that a
+// new image of about the same size reuses one instead of allocating (and
+// page faulting in) fresh memory. Every Image takes its buffer from here
+// and gives it back when it is destroyed. Safe to use from several threads.
+class BufferPool
+{
+public:
+    // Idle buffers are kept up to this many bytes in total
+    static const size_t MAX_IDLE_BYTES = (size_t)1 << 30;
+
+    // Buffers taken by one thread, for per-stage statistics
+    struct ThreadCounters
+    {
+        long long allocations = 0;      // New buffers
+        long long allocated_bytes = 0;
+        long long reused = 0;           // Buffers reused from the pool
+    };
+
+    // The counters of the calling thread
+    static ThreadCounters& thread_counters()
+    {
+        thread_local ThreadCounters counters;
+        return counters;
+    }
+
+    /**
+     * Returns a buffer of the given size. A reused buffer holds whatever
+     * its last image left in it; a new one is zeroed.
+     * @param bytes the size needed
+     * @return the buffer
+     */
+    std::vector<unsigned char> take(size_t bytes)
+    {
+        if (bytes == 0)
+        {
+            return std::vector<unsigned char>();
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            requests++;
+            // Reuse the smallest idle buffer that fits, unless it would
+            // waste more than a quarter of its memory
+            auto it = idle.lower_bound(bytes);
+            if (it != idle.end() && it->first <= bytes + bytes / 4)
+            {
+                std::vector<unsigned char> buffer = std::move(it->second);
+                idle_bytes -= it->first;
+                idle.erase(it);
+                hits++;
+                buffer.resize(bytes);
+                thread_counters().reused++;
+                return buffer;
+            }
+        }
+        std::vector<unsigned char> buffer(bytes);
+        thread_counters().allocations++;
+        thread_counters().allocated_bytes += bytes;
+        std::lock_guard<std::mutex> guard(lock);
+        held_bytes += buffer.capacity();
+        peak_bytes = std::max(peak_bytes, held_bytes);
+        return buffer;
+    }
+
+    /**
+     * Takes back a buffer from take(). It is kept for reuse unless the
+     * idle buffers already hold MAX_IDLE_BYTES.
+     * @param buffer the buffer, left empty
+     * @return nothing
+     */
+    void give(std::vector<unsigned char>&& buffer)
+    {
+        size_t bytes = buffer.capacity();
+        if (bytes == 0)
+        {
+            return;
+        }
+        std::vector<unsigned char> dropped;
+        std::lock_guard<std::mutex> guard(lock);
+        if (idle_bytes + bytes <= MAX_IDLE_BYTES)
+        {
+            idle.emplace(bytes, std::move(buffer));
+            idle_bytes += bytes;
+        }
+        else
+        {
+            held_bytes -= bytes;
+            dropped = std::move(buffer);
+        }
+    }
+
+    // Frees every idle buffer
+    void clear()
+    {
+        std::multimap<size_t, std::vector<unsigned char>> dropped;
+        std::lock_guard<std::mutex> guard(lock);
+        dropped.swap(idle);
+        held_bytes -= idle_bytes;
+        idle_bytes = 0;
+    }
+
+    // Fraction of take() calls that reused a buffer
+    double hit_rate() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return requests == 0 ? 0 : (double)hits / requests;
+    }
+
+    // Most bytes held at once, in images and idle together
+    size_t peak_bytes_held() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return peak_bytes;
+    }
+
+private:
+    mutable std::mutex lock;
+    std::multimap<size_t, std::vector<unsigned char>> idle;
+    size_t idle_bytes = 0;
+    size_t held_bytes = 0;
+    size_t peak_bytes = 0;
+    long long requests = 0;
+    long long hits = 0;
+};
+
+// The pool every Image takes its buffer from
+extern BufferPool buffer_pool;
+
+// Image structure
+// All rows live in one contiguous buffer, top row first. Each row is
+// stride bytes long: width packed Pixels followed by zero padding up to a
+// multiple of four bytes, exactly like a scanline in a 24-bit BMP file.
+// width, height and the rows are the stored pixels; the image as it is
+// displayed and written is the stored pixels seen through orientation.
+struct Image
+{
+    int width = 0;
+    int height = 0;
+    int stride = 0;
+    std::vector<unsigned char> data;
+    Orientation orientation;
+
+    Image() {}
+
+    // The pixels are not cleared (a reused buffer holds old pixels); only
+    // the padding is zeroed
+    Image(int width, int height)
+        : width(width), height(height), stride((width * 3 + 3) / 4 * 4),
+          data(buffer_pool.take((size_t)stride * height))
+    {
+        int pixel_bytes = width * 3;
+        if (stride != pixel_bytes)
+        {
+            for (int row = 0; row < height; row++)
+            {
+                std::memset(data.data() + (size_t)row * stride + pixel_bytes, 0, stride - pixel_bytes);
+            }
+        }
+    }
+
+    Image(const Image& other)
+        : width(other.width), height(other.height), stride(other.stride),
+          data(buffer_pool.take(other.data.size())), orientation(other.orientation)
+    {
+        if (!data.empty())
+        {
+            std::memcpy(data.data(), other.data.data(), data.size());
+        }
+    }
+
+    Image(Image&& other)
+        : width(other.width), height(other.height), stride(other.stride),
+          data(std::move(other.data)), orientation(other.orientation)
+    {
+        other.width = other.height = other.stride = 0;
+    }
+
+    Image& operator=(const Image& other)
+    {
+        if (this != &other)
+        {
+            *this = Image(other);
+        }
+        return *this;
+    }
+
+    Image& operator=(Image&& other)
+    {
+        if (this != &other)
+        {
+            buffer_pool.give(std::move(data));
+            width = other.width;
+            height = other.height;
+            stride = other.stride;
+            data = std::move(other.data);
+            orientation = other.orientation;
+            other.width = other.height = other.stride = 0;
+        }
+        return *this;
+    }
+
+    ~Image()
+    {
+        buffer_pool.give(std::move(data));
+    }
+
+    // True if the image has no pixels (e.g. read_image failed)
+    bool empty() const
+    {
+        return width == 0 || height == 0;
+    }
+
+    // Size of the image as displayed, after its orientation is applied
+    int display_width() const
+    {
+        return orientation.transpose ? height : width;
+    }
+
+    int display_height() const
+    {
+        return orientation.transpose ? width : height;
+    }
+
+    // Access a row as an array of Pixels, so image[row][col] still works
+    Pixel* operator[](int row)
+    {
+        return reinterpret_cast<Pixel*>(data.data() + (size_t)row * stride);
+    }
+
+    const Pixel* operator[](int row) const
+    {
+        return reinterpret_cast<const Pixel*>(data.data() + (size_t)row * stride);
+    }
+};
+
+//***************************************************************************************************//
+//                                   Reading and writing BMP images                                  //
+//***************************************************************************************************//
+
+// Decode statistics filled in by read_image()
+struct DecodeStats
+{
+    long long bytes = 0;    // Bytes read from the file
+    long long pixels = 0;   // Pixels in the file, before any reduction
+    double seconds = 0;     // Wall time spent decoding
+
+    double mb_per_second() const
+    {
+        return seconds > 0 ? bytes / seconds / 1e6 : 0;
+    }
+};
+
+// Reads a BMP file; returns an empty Image if it is not a valid BMP
+Image read_image(std::string filename, DecodeStats* stats = nullptr);
+
+// Describes why read_image() could not read a file, for error messages;
+// files too big for the 4 GiB a BMP header can describe are named as such
+std::string bmp_read_error(const std::string& filename);
+
+// Writes an image as a 24-bit BMP file; fails if the file would be over
+// 4 GiB
+bool write_image(std::string filename, const Image& image);
+
+// Decodes a BMP file held in memory; returns an empty Image if it is not
+// a valid BMP
+Image decode_bmp(const unsigned char* data, size_t size);
+
+// Encodes an image as a 24-bit BMP file in memory, in a buffer taken from
+// buffer_pool (which it may be given back to); returns an empty buffer if
+// the file would be over 4 GiB
+std::vector<unsigned char> encode_bmp(const Image& image);
+
+// Reads a BMP file shrunk by the largest power of two (at most 128) that
+// keeps its longer side at least min_side pixels, the way reduce_image()
+// shrinks it. Each band of scanlines is reduced as it is read, so the
+// full-size image is never held. Returns an empty Image if the file is
+// not a valid BMP.
+Image read_image_reduced(std::string filename, int min_side, DecodeStats* stats = nullptr);
+
+// decode_bmp() with the reduction of read_image_reduced()
+Image decode_bmp_reduced(const unsigned char* data, size_t size, int min_side);
+
+//***************************************************************************************************//
+//                                    Threads and instruction sets                                   //
+//***************************************************************************************************//
+
+// Sets the number of threads the filters use (at least 1)
+void set_filter_threads(int count);
+
+// The number of threads the filters use
+int filter_threads();
+
+// Runs body(begin, end) over bands of rows covering [0, num_rows) on the
+// filter threads
+void parallel_rows(int num_rows, const std::function<void(int, int)>& body);
+
+// The instruction sets the kernels are written for
+enum class SimdLevel
+{
+    Scalar,
+    SSE2,
+    SSSE3,
+    AVX2,
+    AVX512
+};
+
+// Selects the SIMD kernels, lowered to what the CPU supports; returns the
+// level selected
+SimdLevel set_simd_level(SimdLevel level);
+
+// The level of the SIMD kernels in use
+SimdLevel active_simd_level();
+
+// Name of a level, for reports
+const char* simd_level_name(SimdLevel level);
+
+//***************************************************************************************************//
+//                                              Filters                                              //
+//***************************************************************************************************//
+
+// Vignette settings. The defaults reproduce the original process_1: the
+// falloff is centred on (num_columns/2, num_rows/2) and reaches black at a
+// distance of num_rows pixels.
+struct VignetteParams
+{
+    int center_row = -1;        // Negative means num_rows/2
+    int center_column = -1;     // Negative means num_columns/2
+    double strength = 1.0;      // Larger values darken faster
+
+    bool operator==(const VignetteParams& other) const
+    {
+        return center_row == other.center_row && center_column == other.center_column
+            && strength == other.strength;
+    }
+};
+
+// How enlarge fills in the new pixels
+enum class ResizeMode
+{
+    Nearest,
+    Bilinear
+};
+
+// How downscale combines the source pixels under each output pixel
+enum class DownscaleFilter
+{
+    Box,        // Plain average of the source pixels whose index maps to it
+    Bilinear,   // Triangle filter as wide as the scale: nearer pixels count more
+    Area        // Average weighted by how much of each source pixel it covers
+};
+
+// How the scale-factor filters (process_1, 2, 8 and 9) compute. Both
+// modes scale channels with 16-bit fixed-point factors. Exact redoes in
+// double precision the few channels where fixed point could round
+// differently, so the bytes are the same as the original double formulas;
+// Fast does not, and a channel can then differ from Exact by 1.
+enum class ScaleMode
+{
+    Exact,
+    Fast
+};
+
+// Selects the scale mode (default Exact)
+void set_scale_mode(ScaleMode mode);
+
+ScaleMode active_scale_mode();
+
+// Name of a scale mode, for reports
+const char* scale_mode_name(ScaleMode mode);
+
+// The filters. The Image&& overloads work in place on an image that is
+// moved in; the const Image& ones leave their input alone.
+Image process_1(const Image& image, const VignetteParams& params = VignetteParams());
+Image process_2(const Image& image, double scaling_factor);
+Image process_2(Image&& image, double scaling_factor);
+Image process_3(const Image& image);
+Image process_3(Image&& image);
+Image process_4(Image image);
+Image process_5(Image image, int number);
+Image process_6(const Image& image, int xscale, int yscale);
+Image process_6(const Image& image, double xscale, double yscale, ResizeMode mode);
+Image process_7(const Image& image);
+Image process_7(Image&& image);
+Image process_8(const Image& image, double scaling_factor);
+Image process_8(Image&& image, double scaling_factor);
+Image process_9(const Image& image, double scaling_factor);
+Image process_9(Image&& image, double scaling_factor);
+Image process_10(const Image& image);
+Image process_10(Image&& image);
+Image rotate_180(Image image);
+Image rotate_270(Image image);
+Image mirror_image(Image image, bool vertical);
+
+// A copy of an image with its pixels stored in display order
+Image upright(const Image& image);
+
+// Shrinks an image to width x height (display size, at most the current
+// size) with separable passes of the given filter
+Image downscale(const Image& image, int width, int height, DownscaleFilter filter);
+
+// Shrinks an image by 2^shift in each direction (shift of 7 at most),
+// averaging each block of 2^shift x 2^shift pixels; blocks at the right
+// and bottom edges average the pixels they have. The size is rounded up.
+Image reduce_image(const Image& image, int shift);
+
+// Shrinks an image so its longer side is max_side pixels, keeping its
+// shape: first reduce_image() while the longer side stays at least twice
+// max_side, then downscale() with the filter. Smaller images are returned
+// as they are.
+Image thumbnail(const Image& image, int max_side, DownscaleFilter filter);
+
+// Where the neighbourhood filters read the pixels past the edges of an
+// image, for a row of pixels 0 1 2 3
+enum class BorderMode
+{
+    Clamp,      // The nearest edge pixel: 0 0 | 0 1 2 3 | 3 3
+    Reflect,    // Mirrored without repeating the edge: 2 1 | 0 1 2 3 | 2 1
+    Wrap,       // From the opposite edge: 2 3 | 0 1 2 3 | 0 1
+    Zero        // Black
+};
+
+// A convolution kernel of width x height weights, listed row by row. The
+// output pixel lines up with weight (width / 2, height / 2).
+struct ConvolutionKernel
+{
+    int width = 0;
+    int height = 0;
+    std::vector<double> weights;
+};
+
+// Convolves each channel with a kernel. The weights are rounded to fixed
+// point, keeping their sum, and the results are clamped to 0..255.
+Image convolve(const Image& image, const ConvolutionKernel& kernel, BorderMode border);
+
+// Convolves each channel with the separable kernel column[y] * row[x],
+// as a vertical pass and a horizontal one. Both lists are scaled to add up
+// to 1. Lists with negative weights are not a blur and go to convolve().
+Image convolve_separable(const Image& image, const std::vector<double>& column, const std::vector<double>& row,
+                         BorderMode border);
+
+// Gaussian blur with a standard deviation of sigma pixels, cut off at
+// 3 sigma. Keeps the orientation of the image.
+Image gaussian_blur(const Image& image, double sigma, BorderMode border);
+
+// The rounded mean of the (2 radius + 1)^2 pixels around each pixel, at a
+// cost per pixel that does not grow with the radius (at most 1000). Keeps
+// the orientation of the image.
+Image box_blur(const Image& image, int radius, BorderMode border);
+
+// Adds amount times the difference between each pixel and its four
+// neighbours. Keeps the orientation of the image.
+Image sharpen(const Image& image, double amount, BorderMode border);
+
+// The magnitude of the Sobel gradient of each channel, clamped to 255.
+// Keeps the orientation of the image.
+Image sobel_edges(const Image& image, BorderMode border);
+
+// The per-pixel filters that can be chained in a pipeline
+enum class PointOpType
+{
+    Vignette,       // process_1
+    Clarendon,      // process_2
+    Grayscale,      // process_3
+    HighContrast,   // process_7
+    Lighten,        // process_8
+    Darken,         // process_9
+    PrimaryColors   // process_10
+};
+
+// One step of a pipeline
+struct PointOp
+{
+    PointOpType type;
+    double scaling_factor = 0;  // Used by Clarendon, Lighten and Darken
+    VignetteParams vignette;    // Used by Vignette
+};
+
+// Runs a chain of per-pixel filters in one pass over the image
+Image run_pipeline(const Image& image, const std::vector<PointOp>& ops);
+Image run_pipeline(Image&& image, const std::vector<PointOp>& ops);
+
+//***************************************************************************************************//
+//                                        Operations and jobs                                        //
+//***************************************************************************************************//
+
+// Any of the process_N filters, as used by the command line
+enum class OperationKind
+{
+    Point,      // process_1, 2, 3, 7, 8, 9, 10 (see PointOp)
+    Rotate,     // process_5
+    Mirror,     // mirror_image
+    Enlarge,    // process_6
+    Downscale,  // downscale and thumbnail
+    Convolve    // gaussian_blur, box_blur, sharpen and sobel_edges
+};
+
+// The neighbourhood filter of a Convolve operation
+enum class ConvolveFilter
+{
+    Gaussian,
+    Box,
+    Sharpen,
+    Edges
+};
+
+struct Operation
+{
+    OperationKind kind = OperationKind::Point;
+    PointOp point;          // For Point
+    int rotations = 1;      // For Rotate: number of clockwise quarter turns
+    bool vertical = false;  // For Mirror: top to bottom instead of left to right
+    double xscale = 1;      // For Enlarge and Downscale (the size is divided by it)
+    double yscale = 1;      // For Enlarge and Downscale
+    ResizeMode resize = ResizeMode::Nearest;    // For Enlarge
+    DownscaleFilter filter = DownscaleFilter::Area; // For Downscale
+    int max_side = 0;       // For Downscale: if set, a thumbnail of this size instead of the scales
+    ConvolveFilter convolve = ConvolveFilter::Gaussian; // For Convolve
+    double amount = 0;      // For Convolve: the sigma, radius or sharpen amount
+    BorderMode border = BorderMode::Reflect;            // For Convolve
+};
+
+bool parse_operation(const std::string& text, Operation& op, std::string& error);
+
+// The min_side for read_image_reduced() or decode_bmp_reduced() that lets
+// the decoder do the first reduction of ops (a thumbnail first does
+// reduce_image()), or 0 if the input must be decoded at full size
+int decode_min_side(const std::vector<Operation>& ops);
+
+// What one stage of a job (read_image, a filter, write_image) did, for
+// --stats
+struct StageStats
+{
+    std::string name;
+    double seconds = 0;
+    long long bytes_read = 0;
+    long long bytes_written = 0;
+    long long pixels = 0;           // Input pixels of the stage
+    long long allocations = 0;      // New image buffers
+    long long allocated_bytes = 0;
+    long long reused_buffers = 0;   // Image buffers reused from the pool
+};
+
+// The stages of one job, in order. When a stage runs several times (once
+// per band when streaming) its numbers are added up.
+struct JobStats
+{
+    std::string input;
+    std::string output;
+    bool ok = false;
+    std::vector<StageStats> stages;
+
+    StageStats& stage(const std::string& name)
+    {
+        for (StageStats& stage : stages)
+        {
+            if (stage.name == name)
+            {
+                return stage;
+            }
+        }
+        stages.push_back(StageStats());
+        stages.back().name = name;
+        return stages.back();
+    }
+};
+
+// Times one stage of a job from construction to destruction and counts
+// the image buffers the calling thread takes meanwhile. Does nothing if
+// stats is null, so jobs without --stats only pay for a null check.
+class StageTimer
+{
+public:
+    StageTimer(JobStats* stats, const std::string& name)
+        : stats(stats)
+    {
+        if (stats != nullptr)
+        {
+            this->name = name;
+            before = BufferPool::thread_counters();
+            start_time = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~StageTimer()
+    {
+        if (stats == nullptr)
+        {
+            return;
+        }
+        const BufferPool::ThreadCounters& after = BufferPool::thread_counters();
+        StageStats& stage = stats->stage(name);
+        stage.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        stage.allocations += after.allocations - before.allocations;
+        stage.allocated_bytes += after.allocated_bytes - before.allocated_bytes;
+        stage.reused_buffers += after.reused - before.reused;
+        stage.bytes_read += bytes_read;
+        stage.bytes_written += bytes_written;
+        stage.pixels += pixels;
+    }
+
+    long long bytes_read = 0;
+    long long bytes_written = 0;
+    long long pixels = 0;
+
+private:
+    JobStats* stats;
+    std::string name;
+    BufferPool::ThreadCounters before;
+    std::chrono::steady_clock::time_point start_time;
+};
+
+// One JSON object with the stages of a job
+std::string job_stats_json(const JobStats& stats);
+
+// Applies operations to an image, in order
+Image apply_operations(Image&& image, const std::vector<Operation>& ops, JobStats* stats = nullptr);
+Image apply_operations(const Image& image, const std::vector<Operation>& ops, JobStats* stats = nullptr);
+
+// Decodes a BMP file held in memory, applies operations and encodes the
+// result; the in-memory counterpart of process_file()
+bool process_buffer(const unsigned char* data, size_t size, const std::vector<Operation>& ops,
+                    std::vector<unsigned char>& output, std::string& error, JobStats* stats = nullptr);
+
+// Reads a BMP file, applies operations and writes the result
+bool process_file(const std::string& input, const std::string& output, const std::vector<Operation>& ops,
+                  long long& pixels, std::string& error, JobStats* stats = nullptr);
+
+// Same as process_file() for row-local operations, one band of scanlines
+// at a time
+bool stream_image(const std::string& input, const std::string& output, const std::vector<Operation>& ops,
+                  int band_rows, long long& pixels, std::string& error, JobStats* stats = nullptr);
+
+// Same as process_file() for per-pixel filters, on memory-mapped files
+bool mmap_image(const std::string& input, const std::string& output, const std::vector<Operation>& ops,
+                long long& pixels, std::string& error, JobStats* stats = nullptr);
+
+#endif
@@ -2,557 +2,1536 @@
 #include <vector>
 #include <fstream>
 #include <cmath>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <filesystem>
+#include <iomanip>
+#include <sstream>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <csignal>
+#include <iterator>
+#include "image_processing.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#define IMAGE_SOCKETS 1
+#endif
 using namespace std;
 
 //***************************************************************************************************//
-//                               Below code in this section was provided from professor              //
+//                                            Batch mode                                             //
 //***************************************************************************************************//
 
-// Pixel structure
-struct Pixel
+struct BatchOptions
 {
-    // Red, green, blue color values
-    int red;
-    int green;
-    int blue;
+    vector<Operation> ops;
+    vector<string> inputs;
+    string output_dir;
+    int jobs = 2;
+    bool stream = false;    // Use stream_image instead of whole images
+    int band_rows = 0;      // Band size for streaming, 0 for automatic
+    bool stats = false;     // Print a JSON line of statistics for each file
+    bool mmap = false;      // Use mmap_image instead of whole images
+    bool pipeline = false;  // Use run_pipelined_batch
+    int queue_depth = 2;    // Images waiting between pipeline stages
 };
 
 /**
- * Gets an integer from a binary stream.
- * Helper function for read_image()
- * @param stream the stream
- * @param offset the offset at which to read the integer
- * @param bytes  the number of bytes to read
- * @return the integer starting at the given offset
- */ 
-int get_int(fstream& stream, int offset, int bytes)
-{
-    stream.seekg(offset);
-    int result = 0;
-    int base = 1;
-    for (int i = 0; i < bytes; i++)
-    {   
-        result = result + stream.get() * base;
-        base = base * 256;
-    }
-    return result;
-}
-
-/**
- * Reads the BMP image specified and returns the resulting image as a vector
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Processes every input file and writes the results to the output
+ * directory under the same file names. Up to jobs files are in flight at
+ * once, each on its own worker, so at most jobs input and output images
+ * are held in memory. The filters themselves still use the filter threads.
+ * @param options the batch settings
+ * @return 0 if every file was processed, 1 otherwise
  */
-vector<vector<Pixel>> read_image(string filename)
+int run_batch(const BatchOptions& options)
 {
-    // Open the binary file
-    fstream stream;
-    stream.open(filename, ios::in | ios::binary);
-
-    // Get the image properties
-    int file_size = get_int(stream, 2, 4);
-    int start = get_int(stream, 10, 4);
-    int width = get_int(stream, 18, 4);
-    int height = get_int(stream, 22, 4);
-    int bits_per_pixel = get_int(stream, 28, 2);
-
-    // Scan lines must occupy multiples of four bytes
-    int scanline_size = width * (bits_per_pixel / 8);
-    int padding = 0;
-    if (scanline_size % 4 != 0)
-    {
-        padding = 4 - scanline_size % 4;
-    }
-
-    // Return empty vector if this is not a valid image
-    if (file_size != start + (scanline_size + padding) * height)
+    error_code error;
+    filesystem::create_directories(options.output_dir, error);
+    if (error)
     {
-        return {};
+        cerr << "error: cannot create " << options.output_dir << ": " << error.message() << endl;
+        return 1;
     }
 
-    // Create a vector the size of the input image
-    vector<vector<Pixel>> image(height, vector<Pixel> (width));
+    auto start_time = chrono::steady_clock::now();
+    atomic<size_t> next_file{0};
+    atomic<long long> images_done{0};
+    atomic<long long> pixels_done{0};
+    atomic<int> failures{0};
+    mutex output_lock;
 
-    int pos = start;
-    // For each row, starting from the last row to the first
-    // Note: BMP files store pixels from bottom to top
-    for (int i = height - 1; i >= 0; i--)
+    auto worker = [&]
     {
-        // For each column
-        for (int j = 0; j < width; j++)
+        size_t index;
+        while ((index = next_file++) < options.inputs.size())
         {
-            // Go to the pixel position
-            stream.seekg(pos);
-
-            // Save the pixel values to the image vector
-            // Note: BMP files store pixels in blue, green, red order
-            image[i][j].blue = stream.get();
-            image[i][j].green = stream.get();
-            image[i][j].red = stream.get();
+            const string& input = options.inputs[index];
+            string output = (filesystem::path(options.output_dir) / filesystem::path(input).filename()).string();
+            string problem;
 
-            // We are ignoring the alpha channel if there is one
+            long long pixels = 0;
+            JobStats job;
+            JobStats* stats = options.stats ? &job : nullptr;
+            bool done = options.stream
+                ? stream_image(input, output, options.ops, options.band_rows, pixels, problem, stats)
+                : options.mmap
+                ? mmap_image(input, output, options.ops, pixels, problem, stats)
+                : process_file(input, output, options.ops, pixels, problem, stats);
+            if (done)
+            {
+                images_done++;
+                pixels_done += pixels;
+            }
 
-            // Advance the position to the next pixel
-            pos = pos + (bits_per_pixel / 8);
+            lock_guard<mutex> guard(output_lock);
+            if (problem.empty())
+            {
+                cout << input << " -> " << output << endl;
+            }
+            else
+            {
+                cerr << "error: " << problem << endl;
+                failures++;
+            }
+            if (stats != nullptr)
+            {
+                job.input = input;
+                job.output = output;
+                job.ok = done;
+                cout << job_stats_json(job) << endl;
+            }
         }
+    };
 
-        // Skip the padding at the end of each row
-        stream.seekg(padding, ios::cur);
-        pos = pos + padding;
+    int num_workers = max(1, min(options.jobs, (int)options.inputs.size()));
+    vector<thread> workers;
+    for (int i = 0; i < num_workers; i++)
+    {
+        workers.emplace_back(worker);
+    }
+    for (thread& w : workers)
+    {
+        w.join();
     }
 
-    // Close the stream and return the image vector
-    stream.close();
-    return image;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    double megapixels = pixels_done / 1e6;
+    cout << "Processed " << images_done << " images (" << megapixels << " MPix) in " << seconds << " s: "
+         << (seconds > 0 ? images_done / seconds : 0) << " images/s, "
+         << (seconds > 0 ? megapixels / seconds : 0) << " MPix/s" << endl;
+    cout << "Buffer pool: " << buffer_pool.hit_rate() * 100 << "% of image buffers reused, peak "
+         << buffer_pool.peak_bytes_held() / 1e6 << " MB held" << endl;
+    return failures == 0 ? 0 : 1;
 }
 
-/**
- * Sets a value to the char array starting at the offset using the size
- * specified by the bytes.
- * This is a helper function for write_image()
- * @param arr    Array to set values for
- * @param offset Starting index offset
- * @param bytes  Number of bytes to set
- * @param value  Value to set
- * @return nothing
- */
-void set_bytes(unsigned char arr[], int offset, int bytes, int value)
+// How full a queue between two pipeline stages was over a run
+struct QueueMetrics
 {
-    for (int i = 0; i < bytes; i++)
-    {
-        arr[offset+i] = (unsigned char)(value>>(i*8));
-    }
-}
+    size_t capacity = 0;
+    size_t max_depth = 0;
+    double average_depth = 0;   // Weighted by time
+    double full_fraction = 0;   // Share of the time it was at capacity
+    double full_seconds = 0;    // Thread time producers waited for room
+    double empty_seconds = 0;   // Thread time consumers waited for an item
+};
 
-/**
- * Write the input image to a BMP file name specified
- * @param filename The BMP file name to save the image to
- * @param image    The input image to save
- * @return True if successful and false otherwise
- */
-bool write_image(string filename, const vector<vector<Pixel>>& image)
+// A first-in first-out queue holding at most capacity items, for handing
+// work from one pipeline stage to the next. push() waits while the queue
+// is full, so a fast stage cannot run ahead of a slow one and pile up
+// images in memory. Records its depth over time for QueueMetrics.
+template <typename T>
+class BoundedQueue
 {
-    // Get the image width and height in pixels
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
+public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity(max((size_t)1, capacity)), start_time(chrono::steady_clock::now()), last_change(start_time) {}
 
-    // Calculate the width in bytes incorporating padding (4 byte alignment)
-    int width_bytes = width_pixels * 3;
-    int padding_bytes = 0;
-    padding_bytes = (4 - width_bytes % 4) % 4;
-    width_bytes = width_bytes + padding_bytes;
+    /**
+     * Adds an item at the back, waiting until there is room
+     * @param item the item
+     * @return nothing
+     */
+    void push(T item)
+    {
+        unique_lock<mutex> guard(lock);
+        if (items.size() >= capacity)
+        {
+            auto wait_start = chrono::steady_clock::now();
+            room.wait(guard, [this] { return items.size() < capacity; });
+            full_seconds += chrono::duration<double>(chrono::steady_clock::now() - wait_start).count();
+        }
+        record_depth();
+        items.push_back(move(item));
+        max_depth = max(max_depth, items.size());
+        available.notify_one();
+    }
 
-    // Pixel array size in bytes, including padding
-    int array_bytes = width_bytes * height_pixels;
+    /**
+     * Takes the item at the front, waiting until there is one
+     * @param item receives the item
+     * @return false once the queue is closed and empty
+     */
+    bool pop(T& item)
+    {
+        unique_lock<mutex> guard(lock);
+        if (items.empty() && !closed)
+        {
+            auto wait_start = chrono::steady_clock::now();
+            available.wait(guard, [this] { return closed || !items.empty(); });
+            empty_seconds += chrono::duration<double>(chrono::steady_clock::now() - wait_start).count();
+        }
+        if (items.empty())
+        {
+            return false;
+        }
+        record_depth();
+        item = move(items.front());
+        items.pop_front();
+        room.notify_one();
+        return true;
+    }
 
-    // Open a file stream for writing to a binary file
-    fstream stream;
-    stream.open(filename, ios::out | ios::binary);
+    // Tells the consumers that nothing more will be pushed
+    void close()
+    {
+        lock_guard<mutex> guard(lock);
+        closed = true;
+        available.notify_all();
+    }
 
-    // If there was a problem opening the file, return false
-    if (!stream.is_open())
+    QueueMetrics metrics()
     {
-        return false;
+        lock_guard<mutex> guard(lock);
+        record_depth();
+        double seconds = chrono::duration<double>(last_change - start_time).count();
+        QueueMetrics result;
+        result.capacity = capacity;
+        result.max_depth = max_depth;
+        result.average_depth = seconds > 0 ? depth_seconds / seconds : 0;
+        result.full_fraction = seconds > 0 ? at_capacity_seconds / seconds : 0;
+        result.full_seconds = full_seconds;
+        result.empty_seconds = empty_seconds;
+        return result;
     }
 
-    // Create the BMP and DIB Headers
-    const int BMP_HEADER_SIZE = 14;
-    const int DIB_HEADER_SIZE = 40;
-    unsigned char bmp_header[BMP_HEADER_SIZE] = {0};
-    unsigned char dib_header[DIB_HEADER_SIZE] = {0};
-
-    // BMP Header
-    set_bytes(bmp_header,  0, 1, 'B');              // ID field
-    set_bytes(bmp_header,  1, 1, 'M');              // ID field
-    set_bytes(bmp_header,  2, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes); // Size of BMP file
-    set_bytes(bmp_header,  6, 2, 0);                // Reserved
-    set_bytes(bmp_header,  8, 2, 0);                // Reserved
-    set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE); // Pixel array offset
-
-    // DIB Header
-    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
-    set_bytes(dib_header,  4, 4, width_pixels);     // Width of bitmap in pixels
-    set_bytes(dib_header,  8, 4, height_pixels);    // Height of bitmap in pixels
-    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
-    set_bytes(dib_header, 14, 2, 24);               // Number of bits per pixel
-    set_bytes(dib_header, 16, 4, 0);                // Compression method (0=BI_RGB)
-    set_bytes(dib_header, 20, 4, array_bytes);      // Size of raw bitmap data (including padding)                     
-    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
-    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
-    set_bytes(dib_header, 32, 4, 0);                // Number of colors in palette
-    set_bytes(dib_header, 36, 4, 0);                // Number of important colors
-
-    // Write the BMP and DIB Headers to the file
-    stream.write((char*)bmp_header, sizeof(bmp_header));
-    stream.write((char*)dib_header, sizeof(dib_header));
-
-    // Initialize pixel and padding
-    unsigned char pixel[3] = {0};
-    unsigned char padding[3] = {0};
-
-    // Pixel Array (Left to right, bottom to top, with padding)
-    for (int h = height_pixels - 1; h >= 0; h--)
-    {
-        for (int w = 0; w < width_pixels; w++)
-        {
-            // Write the pixel (Blue, Green, Red)
-            pixel[0] = image[h][w].blue;
-            pixel[1] = image[h][w].green;
-            pixel[2] = image[h][w].red;
-            stream.write((char*)pixel, 3);
-        }
-        // Write the padding bytes
-        stream.write((char *)padding, padding_bytes);
+private:
+    // Adds the time since the last change at the current depth; call with
+    // the lock held, before the depth changes
+    void record_depth()
+    {
+        auto now = chrono::steady_clock::now();
+        double seconds = chrono::duration<double>(now - last_change).count();
+        depth_seconds += items.size() * seconds;
+        if (items.size() >= capacity)
+        {
+            at_capacity_seconds += seconds;
+        }
+        last_change = now;
     }
 
-    // Close the stream and return true
-    stream.close();
-    return true;
-}
+    size_t capacity;
+    mutex lock;
+    condition_variable available;
+    condition_variable room;
+    deque<T> items;
+    bool closed = false;
 
-//***************************************************************************************************//
-//                                End of proffessor provided code                                    //
-//***************************************************************************************************//
+    chrono::steady_clock::time_point start_time;
+    chrono::steady_clock::time_point last_change;
+    size_t max_depth = 0;
+    double depth_seconds = 0;
+    double at_capacity_seconds = 0;
+    double full_seconds = 0;
+    double empty_seconds = 0;
+};
 
+// One file on its way through the pipeline
+struct PipelineJob
+{
+    size_t index = 0;       // Position in BatchOptions::inputs
+    Image image;
+    long long pixels = 0;
+    JobStats stats;
+};
 
-vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
+/**
+ * Processes every input file like run_batch(), as a pipeline of three
+ * stages joined by bounded queues: one thread reads and decodes files,
+ * options.jobs threads apply the operations and one thread encodes and
+ * writes the results. While one image is being filtered the next one is
+ * read and the previous one written, so the filters are not left waiting
+ * for the disk. At the end the busy and waiting time of each stage and
+ * the depth of each queue show which stage holds the others back.
+ * @param options the batch settings
+ * @return 0 if every file was processed, 1 otherwise
+ */
+int run_pipelined_batch(const BatchOptions& options)
 {
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    for (int row = 0; row < num_rows; row++)
+    error_code error;
+    filesystem::create_directories(options.output_dir, error);
+    if (error)
     {
-        for (int col = 0; col < num_columns; col++)
+        cerr << "error: cannot create " << options.output_dir << ": " << error.message() << endl;
+        return 1;
+    }
+
+    auto start_time = chrono::steady_clock::now();
+    BoundedQueue<unique_ptr<PipelineJob>> decoded(options.queue_depth);
+    BoundedQueue<unique_ptr<PipelineJob>> processed(options.queue_depth);
+    atomic<long long> images_done{0};
+    atomic<long long> pixels_done{0};
+    atomic<int> failures{0};
+    mutex output_lock;
+
+    // Time each thread spent working, excluding queue waits: the reader,
+    // then the processors, then the writer
+    int num_processors = max(1, min(options.jobs, (int)options.inputs.size()));
+    vector<double> busy(num_processors + 2, 0.0);
+    auto seconds_since = [](chrono::steady_clock::time_point since)
+    {
+        return chrono::duration<double>(chrono::steady_clock::now() - since).count();
+    };
+
+    // Prints the outcome of a job, as run_batch() does
+    auto finish = [&](PipelineJob& job, const string& output, const string& problem)
+    {
+        const string& input = options.inputs[job.index];
+        lock_guard<mutex> guard(output_lock);
+        if (problem.empty())
         {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green; 
-            int blue_color = image[row][col].blue;
-            
-            double distance = sqrt(pow(col-num_columns/2,2) + pow(row-num_rows/2,2));
-            double scaling_factor = (num_rows-distance)/num_rows;
-            new_image[row][col].red = red_color * scaling_factor;
-            new_image[row][col].green = green_color * scaling_factor;
-            new_image[row][col].blue = blue_color * scaling_factor;
+            cout << input << " -> " << output << endl;
+            images_done++;
+            pixels_done += job.pixels;
         }
-    }
-    return new_image;
-}
+        else
+        {
+            cerr << "error: " << problem << endl;
+            failures++;
+        }
+        if (options.stats)
+        {
+            job.stats.input = input;
+            job.stats.output = output;
+            job.stats.ok = problem.empty();
+            cout << job_stats_json(job.stats) << endl;
+        }
+    };
 
-vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
-{
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    for (int row = 0; row < num_rows; row++)
+    thread reader([&]
     {
-        for (int col = 0; col < num_columns; col++)
+        for (size_t index = 0; index < options.inputs.size(); index++)
         {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green; 
-            int blue_color = image[row][col].blue;
-            
-            
-            int average_value = (red_color + green_color + blue_color)/3;
-            
-            if (average_value >= 170)
+            auto work_start = chrono::steady_clock::now();
+            unique_ptr<PipelineJob> job(new PipelineJob());
+            job->index = index;
             {
-                new_image[row][col].red = 255 - (255 - red_color)*scaling_factor;
-                new_image[row][col].green = 255 - (255 - green_color)*scaling_factor;
-                new_image[row][col].blue = 255 - (255 - blue_color)*scaling_factor;
-                
+                StageTimer timer(options.stats ? &job->stats : nullptr, "read_image");
+                DecodeStats decode;
+                int min_side = decode_min_side(options.ops);
+                job->image = min_side > 0 ? read_image_reduced(options.inputs[index], min_side, &decode)
+                                          : read_image(options.inputs[index], &decode);
+                job->pixels = decode.pixels;
+                timer.bytes_read = decode.bytes;
+                timer.pixels = job->pixels;
             }
-            else if (average_value < 90)
+            busy[0] += seconds_since(work_start);
+            if (job->image.empty())
             {
-                new_image[row][col].red = red_color*scaling_factor;
-                new_image[row][col].green = green_color*scaling_factor;
-                new_image[row][col].blue = blue_color*scaling_factor;
+                finish(*job, "", bmp_read_error(options.inputs[index]));
+                continue;
             }
-            else
+            decoded.push(move(job));
+        }
+        decoded.close();
+    });
+
+    atomic<int> processors_left{num_processors};
+    vector<thread> processors;
+    for (int i = 0; i < num_processors; i++)
+    {
+        processors.emplace_back([&, i]
+        {
+            unique_ptr<PipelineJob> job;
+            while (decoded.pop(job))
+            {
+                auto work_start = chrono::steady_clock::now();
+                job->image = apply_operations(move(job->image), options.ops, options.stats ? &job->stats : nullptr);
+                busy[1 + i] += seconds_since(work_start);
+                processed.push(move(job));
+            }
+            if (--processors_left == 0)
             {
-                new_image[row][col].red = red_color;
-                new_image[row][col].green = green_color;
-                new_image[row][col].blue = blue_color;
+                processed.close();
             }
-             
+        });
+    }
+
+    thread writer([&]
+    {
+        unique_ptr<PipelineJob> job;
+        while (processed.pop(job))
+        {
+            auto work_start = chrono::steady_clock::now();
+            const string& input = options.inputs[job->index];
+            string output = (filesystem::path(options.output_dir) / filesystem::path(input).filename()).string();
+            bool written;
+            {
+                StageTimer timer(options.stats ? &job->stats : nullptr, "write_image");
+                timer.pixels = (long long)job->image.width * job->image.height;
+                written = write_image(output, job->image);
+                timer.bytes_written = 54 + (long long)((job->image.display_width() * 3 + 3) / 4 * 4)
+                                      * job->image.display_height();
+            }
+            // Free the image before printing, so its buffer is back in the
+            // pool for the reader
+            job->image = Image();
+            busy[num_processors + 1] += seconds_since(work_start);
+            finish(*job, output, written ? "" : "cannot write " + output);
         }
+    });
+
+    reader.join();
+    for (thread& processor : processors)
+    {
+        processor.join();
     }
-    return new_image;
-}
+    writer.join();
 
-vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
-{
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    for (int row = 0; row < num_rows; row++)
+    double seconds = seconds_since(start_time);
+    double megapixels = pixels_done / 1e6;
+    cout << "Processed " << images_done << " images (" << megapixels << " MPix) in " << seconds << " s: "
+         << (seconds > 0 ? images_done / seconds : 0) << " images/s, "
+         << (seconds > 0 ? megapixels / seconds : 0) << " MPix/s" << endl;
+    cout << "Buffer pool: " << buffer_pool.hit_rate() * 100 << "% of image buffers reused, peak "
+         << buffer_pool.peak_bytes_held() / 1e6 << " MB held" << endl;
+
+    // Each stage's thread time split into working, waiting for its input
+    // queue and waiting for room in its output queue
+    QueueMetrics in = decoded.metrics();
+    QueueMetrics out = processed.metrics();
+    struct StageLoad
+    {
+        const char* name;
+        int threads;
+        double busy;
+        double starved;
+        double blocked;
+    };
+    double processing = 0;
+    for (int i = 0; i < num_processors; i++)
+    {
+        processing += busy[1 + i];
+    }
+    StageLoad stages[] = {
+        {"decode", 1, busy[0], 0, in.full_seconds},
+        {"process", num_processors, processing, in.empty_seconds, out.full_seconds},
+        {"encode", 1, busy[num_processors + 1], out.empty_seconds, 0},
+    };
+
+    cout << fixed << setprecision(1);
+    cout << "Stages (% of thread time busy / waiting for input / waiting for room):" << endl;
+    const StageLoad* bottleneck = &stages[0];
+    for (const StageLoad& stage : stages)
     {
-        for (int col = 0; col < num_columns; col++)
+        double total = seconds * stage.threads;
+        auto percent = [&](double part) { return total > 0 ? 100 * part / total : 0; };
+        cout << "  " << left << setw(8) << stage.name << right << setw(2) << stage.threads
+             << (stage.threads == 1 ? " thread " : " threads") << setw(7) << percent(stage.busy) << "%"
+             << setw(7) << percent(stage.starved) << "%" << setw(7) << percent(stage.blocked) << "%" << endl;
+        if (stage.busy / stage.threads > bottleneck->busy / bottleneck->threads)
         {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green; 
-            int blue_color = image[row][col].blue;
-            
-            double gray_value = (red_color + green_color + blue_color)/3;
-            new_image[row][col].red = gray_value;
-            new_image[row][col].green = gray_value;
-            new_image[row][col].blue = gray_value;
+            bottleneck = &stage;
         }
     }
-    return new_image;
+    cout << "Queues:" << endl;
+    const char* queue_names[] = {"decode -> process", "process -> encode"};
+    const QueueMetrics* queues[] = {&in, &out};
+    for (int i = 0; i < 2; i++)
+    {
+        cout << "  " << left << setw(18) << queue_names[i] << right << " average depth " << setprecision(2)
+             << queues[i]->average_depth << " of " << queues[i]->capacity << ", max " << queues[i]->max_depth
+             << ", full " << setprecision(1) << 100 * queues[i]->full_fraction << "% of the time" << endl;
+    }
+    cout << "Bottleneck: " << bottleneck->name << endl;
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+    return failures == 0 ? 0 : 1;
 }
 
+//***************************************************************************************************//
+//                                Daemon mode and load generator                                     //
+//***************************************************************************************************//
+
+// A daemon connection carries any number of requests, one after the other.
+// Each message is two little-endian 32-bit numbers followed by the bytes
+// they describe:
+//   request:  ops length, BMP length, the ops (--op values separated by
+//             spaces), the BMP file
+//   response: status (0 for success, 1 for an error), length, the output
+//             BMP file or the error message
+const unsigned int MAX_OPS_BYTES = 64 << 10;
+const unsigned int MAX_BMP_BYTES = 1u << 30;
 
-vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
+// A worker drops a connection that sends or takes nothing for this long in
+// the middle of a request, so a stalled client cannot hold it
+const int STALL_SECONDS = 10;
+
+struct ServeOptions
 {
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-    vector<vector<Pixel>> new_image(num_columns, vector<Pixel> (num_rows));
-    
-    for (int row = 0; row < num_rows; row++)
+    string address;         // Unix socket path, or a port number for localhost TCP
+    int workers = 2;        // Requests processed at the same time
+    int queue = 0;          // Requests waiting for a worker, 0 for twice the workers
+    bool stats = false;     // Print a JSON line of statistics for each request
+};
+
+struct LoadgenOptions
+{
+    string address;
+    vector<string> ops;     // --op values, sent as they were given
+    vector<string> inputs;
+    string output_dir;      // Where to save one response per input, empty for none
+    int connections = 4;    // Requests in flight at once
+    int requests = 100;     // Requests sent in total
+};
+
+#if defined(IMAGE_SOCKETS)
+
+void put_u32(unsigned char* bytes, unsigned int value)
+{
+    for (int i = 0; i < 4; i++)
     {
-        for (int col = 0; col < num_columns; col++)
-        {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green; 
-            int blue_color = image[row][col].blue;
-            
-            new_image[col][(num_rows) - row - 1].red = red_color;
-            new_image[col][(num_rows) - row - 1].green = green_color;
-            new_image[col][(num_rows) - row - 1].blue = blue_color;
-            
-        }
+        bytes[i] = (value >> (8 * i)) & 0xFF;
     }
-    return new_image;
 }
 
-vector<vector<Pixel>> rotate_180(const vector<vector<Pixel>>& image)
+unsigned int get_u32(const unsigned char* bytes)
 {
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    for (int row = 0; row < num_rows; row++)
+    return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (unsigned int)bytes[3] << 24;
+}
+
+/**
+ * Reads exactly bytes bytes from a socket
+ * @param fd    the socket
+ * @param data  receives the bytes
+ * @param bytes the number of bytes
+ * @return false if the connection closed or failed first
+ */
+bool read_fully(int fd, void* data, size_t bytes)
+{
+    char* at = (char*)data;
+    while (bytes > 0)
     {
-        for (int col = 0; col < num_columns; col++)
+        ssize_t got = read(fd, at, bytes);
+        if (got < 0 && errno == EINTR)
         {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green; 
-            int blue_color = image[row][col].blue;
-            
-            new_image[num_rows - row - 1][(num_columns) - col - 1].red = red_color;
-            new_image[num_rows - row - 1][(num_columns) - col - 1].green = green_color;
-            new_image[num_rows - row - 1][(num_columns) - col - 1].blue = blue_color;
-            
+            continue;
         }
+        if (got <= 0)
+        {
+            return false;
+        }
+        at += got;
+        bytes -= got;
     }
-    return new_image;
+    return true;
 }
-    
-vector<vector<Pixel>> rotate_270(const vector<vector<Pixel>>& image)
+
+/**
+ * Writes exactly bytes bytes to a socket
+ * @param fd    the socket
+ * @param data  the bytes
+ * @param bytes the number of bytes
+ * @return false if the connection failed first
+ */
+bool write_fully(int fd, const void* data, size_t bytes)
 {
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-    vector<vector<Pixel>> new_image(num_columns, vector<Pixel> (num_rows));
-    
-    for (int row = 0; row < num_rows; row++)
+    const char* at = (const char*)data;
+    while (bytes > 0)
     {
-        for (int col = 0; col < num_columns; col++)
+        ssize_t put = write(fd, at, bytes);
+        if (put < 0 && errno == EINTR)
         {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green; 
-            int blue_color = image[row][col].blue;
-            
-            new_image[col][row].red = red_color;
-            new_image[col][row].green = green_color;
-            new_image[col][row].blue = blue_color;
-            
+            continue;
         }
+        if (put <= 0)
+        {
+            return false;
+        }
+        at += put;
+        bytes -= put;
     }
-    return new_image;
+    return true;
 }
 
-vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
+// True if the address is a port number (localhost TCP) rather than a path
+bool is_tcp_address(const string& address)
 {
-    int angle = number * 90;
-    if (angle%90 != 0)
+    return !address.empty() && address.find_first_not_of("0123456789") == string::npos;
+}
+
+/**
+ * Opens a socket for an address, without connecting or binding it
+ * @param address a Unix socket path or a localhost TCP port
+ * @param storage receives the socket address
+ * @param length  receives the size of the socket address
+ * @param error   receives a message on failure
+ * @return the socket, or -1 on failure
+ */
+int make_socket(const string& address, sockaddr_storage& storage, socklen_t& length, string& error)
+{
+    memset(&storage, 0, sizeof(storage));
+    if (is_tcp_address(address))
     {
-        cout << "Angle needs to be divisible by 90" << endl;
+        sockaddr_in& tcp = (sockaddr_in&)storage;
+        tcp.sin_family = AF_INET;
+        tcp.sin_port = htons(atoi(address.c_str()));
+        tcp.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        length = sizeof(tcp);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            error = "cannot create a TCP socket";
+        }
+        return fd;
+    }
+
+    sockaddr_un& local = (sockaddr_un&)storage;
+    if (address.size() >= sizeof(local.sun_path))
+    {
+        error = "socket path is too long: " + address;
+        return -1;
     }
-    else if (angle%360 == 0)
+    local.sun_family = AF_UNIX;
+    memcpy(local.sun_path, address.c_str(), address.size() + 1);
+    length = sizeof(local);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
     {
-        return image;
+        error = "cannot create a Unix socket";
     }
-    else if (angle%360 == 90)
+    return fd;
+}
+
+/**
+ * Connects to a daemon
+ * @param address a Unix socket path or a localhost TCP port
+ * @param error   receives a message on failure
+ * @return the connected socket, or -1 on failure
+ */
+int connect_to(const string& address, string& error)
+{
+    sockaddr_storage storage;
+    socklen_t length;
+    int fd = make_socket(address, storage, length, error);
+    if (fd < 0)
     {
-        return process_4(image);
+        return -1;
     }
-    else if (angle%360 == 180)
+    if (connect(fd, (sockaddr*)&storage, length) != 0)
     {
-        return rotate_180(image);
+        error = "cannot connect to " + address + ": " + strerror(errno);
+        close(fd);
+        return -1;
     }
-    else
+    if (is_tcp_address(address))
     {
-        return rotate_270(image); 
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
     }
-        
-    return image;
+    return fd;
 }
 
-vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int xscale, int yscale)
+// Set by SIGINT and SIGTERM to stop the daemon
+volatile sig_atomic_t stop_requested = 0;
+int stop_wake_fd = -1;
+
+void request_stop(int)
 {
-    int num_rows = (image.size());
-    int num_columns = (image[0].size());
-    int y = num_rows* yscale;
-    int x = num_columns* xscale;
-    vector<vector<Pixel>> new_image(y, vector<Pixel> (x));
-    for (int row = 0; row < y; row++)
+    stop_requested = 1;
+    if (stop_wake_fd >= 0 && write(stop_wake_fd, "", 1) < 0)
     {
-        for (int col = 0; col < x; col++)
-        {
-            int r = row/yscale;
-            int c = col/xscale;
-            int red_color = image[r][c].red;
-            int green_color = image[r][c].green; 
-            int blue_color = image[r][c].blue;
-            
-            new_image[row][col].red = red_color;
-            new_image[row][col].green = green_color;
-            new_image[row][col].blue = blue_color;
-            
-        }
+        // Nothing more can be done in a signal handler
     }
-    return new_image;
 }
 
-vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image)
+// Serves requests on a listening socket until SIGINT or SIGTERM. The
+// calling thread polls the listener and the idle connections; a
+// connection with a request waiting is queued for a fixed set of warm
+// worker threads, which keep their request buffers between requests (and
+// take their images and output files from buffer_pool). When the queue is
+// full the dispatcher stops accepting and stops reading, so new clients
+// wait in the listen backlog and existing ones in their socket buffers
+// until a worker catches up. Reads and writes on a connection time out
+// after STALL_SECONDS, and stopping shuts down the connections the
+// workers are serving, so no worker waits on a client forever.
+class RequestServer
 {
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    for (int row = 0; row < num_rows; row++)
+public:
+    explicit RequestServer(const ServeOptions& options)
+        : options(options), capacity(options.queue > 0 ? options.queue : 2 * max(1, options.workers)) {}
+
+    /**
+     * Listens on the address and serves requests until stopped
+     * @return 0 after a clean stop, 1 if the daemon could not start
+     */
+    int run()
     {
-        for (int col = 0; col < num_columns; col++)
+        string error;
+        sockaddr_storage storage;
+        socklen_t length;
+        listen_fd = make_socket(options.address, storage, length, error);
+        if (listen_fd >= 0 && is_tcp_address(options.address))
         {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green; 
-            int blue_color = image[row][col].blue;
-            
-            double gray_value = (red_color + green_color + blue_color)/3;
-            
-            if (gray_value >= 255/2)
+            int on = 1;
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        }
+        else if (listen_fd >= 0)
+        {
+            // Replace the socket of a daemon that did not clean up, but
+            // never any other kind of file
+            struct stat status;
+            if (stat(options.address.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
             {
-                new_image[row][col].red = 255;
-                new_image[row][col].green = 255;
-                new_image[row][col].blue = 255;
+                unlink(options.address.c_str());
             }
-            else
+        }
+        if (listen_fd < 0 || bind(listen_fd, (sockaddr*)&storage, length) != 0 || listen(listen_fd, 128) != 0)
+        {
+            cerr << "error: cannot listen on " << options.address << ": "
+                 << (error.empty() ? strerror(errno) : error) << endl;
+            if (listen_fd >= 0)
             {
-                new_image[row][col].red = 0;
-                new_image[row][col].green = 0;
-                new_image[row][col].blue = 0;
+                close(listen_fd);
             }
-            
+            return 1;
+        }
+        if (pipe(wake_pipe) != 0)
+        {
+            cerr << "error: cannot create a pipe" << endl;
+            return 1;
+        }
+        fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+        stop_wake_fd = wake_pipe[1];
+        signal(SIGINT, request_stop);
+        signal(SIGTERM, request_stop);
+        signal(SIGPIPE, SIG_IGN);
+
+        auto start_time = chrono::steady_clock::now();
+        vector<thread> workers;
+        for (int i = 0; i < max(1, options.workers); i++)
+        {
+            workers.emplace_back([this] { work(); });
+        }
+        cout << "Listening on " << options.address << " with " << workers.size() << " workers, "
+             << capacity << " queued requests at most" << endl;
+
+        dispatch();
+
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+            // Wake the workers blocked on a client
+            for (int fd : in_flight)
+            {
+                shutdown(fd, SHUT_RDWR);
+            }
+        }
+        request_ready.notify_all();
+        for (thread& worker : workers)
+        {
+            worker.join();
+        }
+        for (int fd : ready)
+        {
+            close(fd);
+        }
+        for (int fd : returned)
+        {
+            close(fd);
         }
+        close(listen_fd);
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+        stop_wake_fd = -1;
+        if (!is_tcp_address(options.address))
+        {
+            unlink(options.address.c_str());
+        }
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+        cout << "Served " << requests_done << " requests (" << requests_failed << " failed) on "
+             << connections << " connections in " << seconds << " s" << endl;
+        cout << "Buffer pool: " << buffer_pool.hit_rate() * 100 << "% of buffers reused, peak "
+             << buffer_pool.peak_bytes_held() / 1e6 << " MB held" << endl;
+        return 0;
     }
-    return new_image;
-}
 
-vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor)
-{
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    for (int row = 0; row < num_rows; row++)
+private:
+    // Wakes the dispatcher out of poll()
+    void wake()
     {
-        for (int col = 0; col < num_columns; col++)
+        if (write(wake_pipe[1], "", 1) < 0)
         {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green; 
-            int blue_color = image[row][col].blue;
-            
-            
-            new_image[row][col].red = 255- (255 - red_color)*scaling_factor;
-            new_image[row][col].green = 255- (255 - green_color)*scaling_factor;
-            new_image[row][col].blue = 255- (255 - blue_color)*scaling_factor;
+            // The pipe is full, so the dispatcher is waking up anyway
         }
     }
-    return new_image;
-}
 
-vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor)
-{
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    for (int row = 0; row < num_rows; row++)
+    void dispatch()
     {
-        for (int col = 0; col < num_columns; col++)
+        vector<int> idle;
+        vector<pollfd> polled;
+        while (!stop_requested)
         {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green; 
-            int blue_color = image[row][col].blue;
-            
-            
-            new_image[row][col].red = red_color*scaling_factor;
-            new_image[row][col].green = green_color*scaling_factor;
-            new_image[row][col].blue = blue_color*scaling_factor;
+            size_t room;
+            {
+                lock_guard<mutex> guard(lock);
+                idle.insert(idle.end(), returned.begin(), returned.end());
+                returned.clear();
+                room = capacity > ready.size() ? capacity - ready.size() : 0;
+            }
+
+            // With the queue full only the wake pipe is watched
+            polled.assign(1, pollfd{wake_pipe[0], POLLIN, 0});
+            if (room > 0)
+            {
+                polled.push_back(pollfd{listen_fd, POLLIN, 0});
+                for (int fd : idle)
+                {
+                    polled.push_back(pollfd{fd, POLLIN, 0});
+                }
+            }
+            if (poll(polled.data(), polled.size(), -1) < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                cerr << "error: poll failed: " << strerror(errno) << endl;
+                return;
+            }
+
+            char drain[256];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+            {
+            }
+            if (room == 0)
+            {
+                continue;
+            }
+
+            // Queue the connections that have a request (or were closed;
+            // the worker finds that out), oldest first
+            vector<int> now_ready;
+            idle.clear();
+            for (size_t i = 2; i < polled.size(); i++)
+            {
+                if (polled[i].revents != 0 && now_ready.size() < room)
+                {
+                    now_ready.push_back(polled[i].fd);
+                }
+                else
+                {
+                    idle.push_back(polled[i].fd);
+                }
+            }
+            if (polled[1].revents & POLLIN)
+            {
+                int fd = accept(listen_fd, nullptr, nullptr);
+                if (fd >= 0)
+                {
+                    if (is_tcp_address(options.address))
+                    {
+                        int on = 1;
+                        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                    }
+                    timeval stall{STALL_SECONDS, 0};
+                    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof(stall));
+                    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof(stall));
+                    idle.push_back(fd);
+                    connections++;
+                }
+            }
+            if (!now_ready.empty())
+            {
+                {
+                    lock_guard<mutex> guard(lock);
+                    ready.insert(ready.end(), now_ready.begin(), now_ready.end());
+                }
+                request_ready.notify_all();
+            }
+        }
+        for (int fd : idle)
+        {
+            close(fd);
+        }
+    }
+
+    void work()
+    {
+        vector<unsigned char> request;
+        vector<unsigned char> response;
+        while (true)
+        {
+            int fd;
+            {
+                unique_lock<mutex> guard(lock);
+                request_ready.wait(guard, [this] { return stopping || !ready.empty(); });
+                if (stopping)
+                {
+                    return;
+                }
+                fd = ready.front();
+                ready.pop_front();
+                in_flight.insert(fd);
+            }
+            // There is room in the queue again
+            wake();
+
+            bool keep = serve(fd, request, response);
+            {
+                // Once the connection is off in_flight stopping no longer
+                // shuts it down, so it can be closed
+                lock_guard<mutex> guard(lock);
+                in_flight.erase(fd);
+                if (keep)
+                {
+                    returned.push_back(fd);
+                }
+            }
+            if (!keep)
+            {
+                close(fd);
+            }
+            wake();
+        }
+    }
+
+    /**
+     * Reads one request from a connection, processes it and sends the
+     * response
+     * @param fd       the connection
+     * @param request  buffer for the input file, kept by the worker
+     * @param response buffer for the output file, kept by the worker
+     * @return false if the connection is closed or out of step and must
+     *         be dropped
+     */
+    bool serve(int fd, vector<unsigned char>& request, vector<unsigned char>& response)
+    {
+        unsigned char header[8];
+        if (!read_fully(fd, header, sizeof(header)))
+        {
+            return false;
+        }
+        unsigned int ops_bytes = get_u32(header);
+        unsigned int bmp_bytes = get_u32(header + 4);
+        if (ops_bytes > MAX_OPS_BYTES || bmp_bytes > MAX_BMP_BYTES)
+        {
+            requests_failed++;
+            respond(fd, 1, "request too large");
+            return false;
+        }
+        string ops_text(ops_bytes, ' ');
+        request.resize(bmp_bytes);
+        if (!read_fully(fd, &ops_text[0], ops_bytes) || !read_fully(fd, request.data(), bmp_bytes))
+        {
+            return false;
         }
+
+        string error;
+        vector<Operation> ops;
+        stringstream words(ops_text);
+        string word;
+        while (error.empty() && words >> word)
+        {
+            ops.emplace_back();
+            parse_operation(word, ops.back(), error);
+        }
+
+        JobStats job;
+        JobStats* stats = options.stats ? &job : nullptr;
+        bool done = error.empty() && process_buffer(request.data(), request.size(), ops, response, error, stats);
+        long long number = ++requests_done;
+        if (!done)
+        {
+            requests_failed++;
+        }
+        if (stats != nullptr)
+        {
+            job.input = "request " + to_string(number);
+            job.ok = done;
+            lock_guard<mutex> guard(output_lock);
+            cout << job_stats_json(job) << endl;
+        }
+        return done ? respond(fd, 0, response.data(), response.size()) : respond(fd, 1, error);
+    }
+
+    bool respond(int fd, unsigned int status, const unsigned char* data, size_t bytes)
+    {
+        unsigned char header[8];
+        put_u32(header, status);
+        put_u32(header + 4, bytes);
+        return write_fully(fd, header, sizeof(header)) && write_fully(fd, data, bytes);
+    }
+
+    bool respond(int fd, unsigned int status, const string& message)
+    {
+        return respond(fd, status, (const unsigned char*)message.data(), message.size());
     }
-    return new_image;
+
+    const ServeOptions& options;
+    size_t capacity;
+    int listen_fd = -1;
+    int wake_pipe[2] = {-1, -1};
+
+    mutex lock;
+    condition_variable request_ready;
+    deque<int> ready;           // Connections with a request, for the workers
+    vector<int> returned;       // Connections the workers are done with, for the dispatcher
+    set<int> in_flight;         // Connections the workers are serving
+    bool stopping = false;
+
+    mutex output_lock;
+    atomic<long long> requests_done{0};
+    atomic<long long> requests_failed{0};
+    long long connections = 0;
+};
+
+int run_server(const ServeOptions& options)
+{
+    RequestServer server(options);
+    return server.run();
 }
 
-vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
+/**
+ * Sends requests to a daemon from several connections at once and reports
+ * the throughput and the latency percentiles. Every connection keeps one
+ * request in flight; the inputs are sent round robin.
+ * @param options the load settings
+ * @return 0 if every request succeeded, 1 otherwise
+ */
+int run_loadgen(const LoadgenOptions& options)
 {
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    for (int row = 0; row < num_rows; row++)
+    signal(SIGPIPE, SIG_IGN);
+
+    string ops_text;
+    for (const string& op : options.ops)
+    {
+        ops_text += (ops_text.empty() ? "" : " ") + op;
+    }
+
+    // Build every request once; the timed loop only sends them
+    vector<vector<unsigned char>> messages;
+    vector<long long> pixels;
+    for (const string& input : options.inputs)
     {
-        for (int col = 0; col < num_columns; col++)
+        ifstream stream(input, ios::binary);
+        vector<unsigned char> file((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+        Image image = decode_bmp(file.data(), file.size());
+        if (image.empty())
         {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green; 
-            int blue_color = image[row][col].blue;
-            
-            int max_a = max(red_color, green_color);
-            int max_color = max(max_a, blue_color);
-                
-            if (red_color + green_color + blue_color >= 550)
+            cerr << "error: cannot read " << input << " as a 24 or 32-bit BMP" << endl;
+            return 1;
+        }
+        pixels.push_back((long long)image.width * image.height);
+
+        vector<unsigned char> message(8);
+        put_u32(message.data(), ops_text.size());
+        put_u32(message.data() + 4, file.size());
+        message.insert(message.end(), ops_text.begin(), ops_text.end());
+        message.insert(message.end(), file.begin(), file.end());
+        messages.push_back(move(message));
+    }
+    if (!options.output_dir.empty())
+    {
+        error_code error;
+        filesystem::create_directories(options.output_dir, error);
+    }
+
+    atomic<int> next_request{0};
+    atomic<long long> pixels_done{0};
+    atomic<int> failures{0};
+    mutex output_lock;
+    vector<vector<double>> latencies(max(1, options.connections));
+
+    auto client = [&](int index)
+    {
+        string error;
+        int fd = connect_to(options.address, error);
+        if (fd < 0)
+        {
+            lock_guard<mutex> guard(output_lock);
+            cerr << "error: " << error << endl;
+            failures++;
+            return;
+        }
+        vector<unsigned char> response;
+        int request;
+        while ((request = next_request++) < options.requests)
+        {
+            size_t input = request % messages.size();
+            auto start_time = chrono::steady_clock::now();
+            unsigned char header[8];
+            bool ok = write_fully(fd, messages[input].data(), messages[input].size())
+                      && read_fully(fd, header, sizeof(header));
+            if (ok)
             {
-                new_image[row][col].red = 255;
-                new_image[row][col].green = 255;
-                new_image[row][col].blue = 255;
+                response.resize(get_u32(header + 4));
+                ok = read_fully(fd, response.data(), response.size());
             }
-            
-            else if (red_color + green_color + blue_color <= 150)
+            latencies[index].push_back(chrono::duration<double>(chrono::steady_clock::now() - start_time).count());
+
+            if (!ok || get_u32(header) != 0)
             {
-                new_image[row][col].red = 0;
-                new_image[row][col].green = 0;
-                new_image[row][col].blue = 0;
+                lock_guard<mutex> guard(output_lock);
+                cerr << "error: request " << request << " failed: "
+                     << (ok ? string(response.begin(), response.end()) : "connection lost") << endl;
+                failures++;
+                if (!ok)
+                {
+                    break;
+                }
+                continue;
             }
-            
-            else if (max_color == red_color)
-            {
-                new_image[row][col].red = 255;
-                new_image[row][col].green = 0;
-                new_image[row][col].blue = 0;
-            }  
-            
-            else if (max_color == green_color)
+            pixels_done += pixels[input];
+            if (!options.output_dir.empty() && (size_t)request < messages.size())
             {
-                new_image[row][col].red = 0;
-                new_image[row][col].green = 255;
-                new_image[row][col].blue = 0;
-            }  
-            
-            else
+                string output = (filesystem::path(options.output_dir) / filesystem::path(options.inputs[input]).filename()).string();
+                ofstream stream(output, ios::binary);
+                stream.write((const char*)response.data(), response.size());
+            }
+        }
+        close(fd);
+    };
+
+    auto start_time = chrono::steady_clock::now();
+    vector<thread> clients;
+    for (int i = 0; i < (int)latencies.size(); i++)
+    {
+        clients.emplace_back(client, i);
+    }
+    for (thread& c : clients)
+    {
+        c.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+
+    vector<double> all;
+    for (const vector<double>& some : latencies)
+    {
+        all.insert(all.end(), some.begin(), some.end());
+    }
+    sort(all.begin(), all.end());
+    auto percentile = [&](double p)
+    {
+        size_t rank = (size_t)ceil(p * all.size());
+        return all.empty() ? 0 : all[min(all.size(), max((size_t)1, rank)) - 1] * 1e3;
+    };
+
+    cout << fixed << setprecision(2);
+    cout << "Sent " << all.size() << " requests over " << latencies.size() << " connections in "
+         << seconds << " s: " << (seconds > 0 ? all.size() / seconds : 0) << " requests/s, "
+         << (seconds > 0 ? pixels_done / 1e6 / seconds : 0) << " MPix/s" << endl;
+    cout << "Latency: p50 " << percentile(0.50) << " ms, p90 " << percentile(0.90) << " ms, p99 "
+         << percentile(0.99) << " ms, max " << percentile(1.0) << " ms" << endl;
+    return failures == 0 ? 0 : 1;
+}
+
+#else
+
+int run_server(const ServeOptions&)
+{
+    cerr << "error: daemon mode is not supported on this system" << endl;
+    return 1;
+}
+
+int run_loadgen(const LoadgenOptions&)
+{
+    cerr << "error: the load generator is not supported on this system" << endl;
+    return 1;
+}
+
+#endif
+
+//***************************************************************************************************//
+//                                         Benchmarks                                                //
+//***************************************************************************************************//
+
+struct BenchmarkOptions
+{
+    vector<double> megapixels = {0.3, 12, 48, 200};
+    string json_file;       // Where to write JSON results: empty for none, "-" for standard output
+};
+
+// Timing of one function on one image size
+struct BenchmarkResult
+{
+    string name;
+    int width = 0;
+    int height = 0;
+    int runs = 0;
+    double seconds = 0;     // Best of the runs
+
+    double ns_per_pixel() const
+    {
+        return seconds * 1e9 / ((double)width * height);
+    }
+
+    double megapixels_per_second() const
+    {
+        return seconds > 0 ? (double)width * height / seconds / 1e6 : 0;
+    }
+};
+
+/**
+ * Makes a synthetic image: gradients with noise on top, so the filters
+ * see bright, dark, gray and saturated pixels in every row
+ * @param width  image width
+ * @param height image height
+ * @return the image
+ */
+Image make_benchmark_image(int width, int height)
+{
+    Image image(width, height);
+    parallel_rows(height, [&](int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            unsigned int state = row * 2654435761u + 1;
+            Pixel* out = image[row];
+            for (int col = 0; col < width; col++)
             {
-                new_image[row][col].red = 0;
-                new_image[row][col].green = 0;
-                new_image[row][col].blue = 255;
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                int noise = state % 64;
+                out[col].blue = (col * 256 / width + noise) % 256;
+                out[col].green = (row * 256 / height + noise) % 256;
+                out[col].red = ((col + row) * 128 / (width + height) + (state >> 8) % 128) % 256;
             }
         }
+    });
+    return image;
+}
+
+/**
+ * Times a function. It is run at least once and repeated until about a
+ * quarter of a second has passed, at most 5 times.
+ * @param body the code to time
+ * @param runs receives the number of runs
+ * @return the best time in seconds
+ */
+double time_best(const function<void()>& body, int& runs)
+{
+    double best = 0;
+    double total = 0;
+    runs = 0;
+    while (runs == 0 || (runs < 5 && total < 0.25))
+    {
+        auto start_time = chrono::steady_clock::now();
+        body();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+        best = runs == 0 ? seconds : min(best, seconds);
+        total += seconds;
+        runs++;
+    }
+    return best;
+}
+
+/**
+ * Times the decoder, the encoder and every filter on synthetic images of
+ * each requested size. Widths are odd so every row of the BMP files has
+ * padding. Rotations only change the orientation, so for them the time
+ * includes putting the pixels in the new order (what write_image does).
+ * Results are printed as a table and, if asked for, as JSON.
+ * @param options the sizes and JSON destination
+ * @return 0 on success
+ */
+int run_benchmarks(const BenchmarkOptions& options)
+{
+    vector<BenchmarkResult> results;
+    cout << "Benchmarks with " << filter_threads() << " threads, " << simd_level_name(active_simd_level())
+         << " kernels, " << scale_mode_name(active_scale_mode()) << " scaling" << endl;
+
+    for (double megapixels : options.megapixels)
+    {
+        // A 4:3 image with an odd width
+        int width = max(1, (int)sqrt(megapixels * 1e6 * 4 / 3)) | 1;
+        int height = max(1, (int)lround(megapixels * 1e6 / width));
+        Image image = make_benchmark_image(width, height);
+        string filename = (filesystem::temp_directory_path()
+                           / ("image_benchmark_" + to_string(width) + "x" + to_string(height) + ".bmp")).string();
+
+        cout << endl << width << " x " << height << " (" << fixed << setprecision(1)
+             << (double)width * height / 1e6 << " MPix, " << image.stride - width * 3
+             << " bytes of padding per row)" << endl;
+
+        // Times one function on this image and prints its line
+        auto measure = [&](const string& name, const function<void()>& body)
+        {
+            BenchmarkResult result;
+            result.name = name;
+            result.width = width;
+            result.height = height;
+            result.seconds = time_best(body, result.runs);
+            results.push_back(result);
+            cout << "  " << left << setw(16) << name << right << fixed
+                 << setprecision(2) << setw(10) << result.seconds * 1e3 << " ms"
+                 << setprecision(2) << setw(10) << result.ns_per_pixel() << " ns/pixel"
+                 << setprecision(1) << setw(10) << result.megapixels_per_second() << " MPix/s" << endl;
+        };
+
+        // The rotations take the image by value; it is moved in and back
+        // out so that no copy is timed
+        auto measure_rotation = [&](const string& name, const function<Image(Image)>& rotate)
+        {
+            measure(name, [&]
+            {
+                Image rotated = rotate(move(image));
+                Image new_image = upright(rotated);
+                image = move(rotated);
+                image.orientation = Orientation();
+            });
+        };
+
+        measure("write_image", [&] { write_image(filename, image); });
+        measure("read_image", [&] { read_image(filename); });
+        measure("read_reduced", [&] { read_image_reduced(filename, 512); });
+        filesystem::remove(filename);
+        measure("process_1", [&] { process_1(image); });
+        measure("process_2", [&] { process_2(image, 0.5); });
+        measure("process_3", [&] { process_3(image); });
+        measure_rotation("process_4", [](Image turned) { return process_4(move(turned)); });
+        measure_rotation("process_5", [](Image turned) { return process_5(move(turned), 3); });
+        measure("process_6", [&] { process_6(image, 2, 2); });
+        measure("enlarge_nearest", [&] { process_6(image, 2.5, 2.5, ResizeMode::Nearest); });
+        measure("enlarge_bilinear", [&] { process_6(image, 2.5, 2.5, ResizeMode::Bilinear); });
+        measure("process_7", [&] { process_7(image); });
+        measure("process_8", [&] { process_8(image, 0.5); });
+        measure("process_9", [&] { process_9(image, 0.5); });
+        measure("process_10", [&] { process_10(image); });
+        measure_rotation("rotate_180", [](Image turned) { return rotate_180(move(turned)); });
+        measure_rotation("rotate_270", [](Image turned) { return rotate_270(move(turned)); });
+        int shrunk_width = max(1, width * 2 / 5);
+        int shrunk_height = max(1, height * 2 / 5);
+        measure("shrink_box", [&] { downscale(image, shrunk_width, shrunk_height, DownscaleFilter::Box); });
+        measure("shrink_bilinear", [&] { downscale(image, shrunk_width, shrunk_height, DownscaleFilter::Bilinear); });
+        measure("shrink_area", [&] { downscale(image, shrunk_width, shrunk_height, DownscaleFilter::Area); });
+        measure("reduce_image", [&] { reduce_image(image, 1); });
+        measure("thumbnail", [&] { thumbnail(image, 256, DownscaleFilter::Area); });
+        measure("gaussian_s1", [&] { gaussian_blur(image, 1, BorderMode::Reflect); });
+        measure("gaussian_s4", [&] { gaussian_blur(image, 4, BorderMode::Reflect); });
+        // The box blur should take about as long whatever the radius
+        for (int radius : {1, 4, 16, 64, 256})
+        {
+            measure("box_r" + to_string(radius), [&] { box_blur(image, radius, BorderMode::Reflect); });
+        }
+        measure("sharpen", [&] { sharpen(image, 0.5, BorderMode::Reflect); });
+        measure("sobel_edges", [&] { sobel_edges(image, BorderMode::Reflect); });
+
+        // Give the memory back before the next, larger size
+        image = Image();
+        buffer_pool.clear();
+    }
+
+    if (options.json_file.empty())
+    {
+        return 0;
+    }
+    ostringstream json;
+    json << "{\"threads\": " << filter_threads() << ", \"simd\": \"" << simd_level_name(active_simd_level())
+         << "\", \"scale\": \"" << scale_mode_name(active_scale_mode()) << "\", \"results\": [";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult& result = results[i];
+        json << (i == 0 ? "" : ",") << "\n  {\"name\": \"" << result.name << "\", \"width\": " << result.width
+             << ", \"height\": " << result.height << ", \"runs\": " << result.runs
+             << fixed << setprecision(9) << ", \"seconds\": " << result.seconds
+             << setprecision(3) << ", \"ns_per_pixel\": " << result.ns_per_pixel()
+             << setprecision(1) << ", \"mpix_per_second\": " << result.megapixels_per_second() << "}";
+    }
+    json << "\n]}\n";
+
+    if (options.json_file == "-")
+    {
+        cout << json.str();
+        return 0;
+    }
+    ofstream stream(options.json_file);
+    stream << json.str();
+    if (!stream.good())
+    {
+        cerr << "error: cannot write " << options.json_file << endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Prints the command line help
+ * @param program the name the program was run as
+ * @return nothing
+ */
+void print_usage(const char* program)
+{
+    cout << "Usage: " << program << " [--threads N] [--fast-scale]" << endl;
+    cout << "       " << program << " [--threads N] [--fast-scale] [--jobs N] [--stream [--band-rows N] | --mmap |" << endl;
+    cout << "           --pipeline [--queue N]] [--stats]" << endl;
+    cout << "           --op OP [--op OP ...] -o DIR FILE.bmp ..." << endl;
+    cout << "       " << program << " [--threads N] [--fast-scale] --benchmark [--bench-sizes LIST] [--json FILE]" << endl;
+    cout << "       " << program << " [--threads N] [--fast-scale] [--jobs N] [--queue N] [--stats] --serve ADDRESS" << endl;
+    cout << "       " << program << " --loadgen ADDRESS [--connections N] [--requests N] [-o DIR]" << endl;
+    cout << "           [--op OP ...] FILE.bmp ..." << endl;
+    cout << endl;
+    cout << "Without operations the interactive menu is started. With operations, every" << endl;
+    cout << "FILE is processed and written to DIR under the same name." << endl;
+    cout << endl;
+    cout << "  --threads N   threads used inside each filter (default: all cores)" << endl;
+    cout << "  --jobs N      files processed at the same time (default: 2)" << endl;
+    cout << "  --op OP       operation to apply; repeat to chain, applied in order:" << endl;
+    cout << "                  vignette, clarendon=F, grayscale, rotate[=N], enlarge=XxY[:MODE]," << endl;
+    cout << "                  contrast, lighten=F, darken=F, primary, mirror, flip," << endl;
+    cout << "                  downscale=XxY[:FILTER], thumbnail=S[:FILTER], blur=S[:BORDER]," << endl;
+    cout << "                  boxblur=R[:BORDER], sharpen=A[:BORDER], edges[=BORDER]" << endl;
+    cout << "                F is a factor between 0 and 1, N counts clockwise quarter turns," << endl;
+    cout << "                X and Y are scales of at least 1 (decimals allowed) and MODE is" << endl;
+    cout << "                nearest (default) or bilinear; mirror swaps left and right, flip" << endl;
+    cout << "                swaps top and bottom; downscale divides the size by X and Y and" << endl;
+    cout << "                thumbnail makes the longer side S pixels, with FILTER box," << endl;
+    cout << "                bilinear or area (default). A thumbnail as the first operation is" << endl;
+    cout << "                partly done while the file is read. blur is a Gaussian blur of" << endl;
+    cout << "                S pixels (standard deviation, up to 100), boxblur averages a" << endl;
+    cout << "                square of radius R (1 to 1000) as fast for any R, sharpen adds A" << endl;
+    cout << "                (up to 4) times the detail, and edges finds edges (Sobel); BORDER" << endl;
+    cout << "                is clamp, reflect (default), wrap or zero" << endl;
+    cout << "  --fast-scale  skip the exact rounding check in vignette, clarendon, lighten and" << endl;
+    cout << "                darken; a channel can then be 1 away from the default result" << endl;
+    cout << "  -o DIR        output directory" << endl;
+    cout << "  --stream      process each file in bands of scanlines so memory does not grow" << endl;
+    cout << "                with the image size (all operations except rotate, mirror, flip," << endl;
+    cout << "                downscale, thumbnail, blur, boxblur, sharpen and edges, and" << endl;
+    cout << "                enlarge only by whole numbers in nearest mode)" << endl;
+    cout << "  --band-rows N scanlines per band when streaming (default: about 4 MB)" << endl;
+    cout << "  --mmap        filter straight from the mapped input file to the mapped output" << endl;
+    cout << "                file (per-pixel filters only)" << endl;
+    cout << "  --pipeline    read, filter and write different files at the same time: one" << endl;
+    cout << "                thread reads, --jobs threads filter and one thread writes, and" << endl;
+    cout << "                the time each stage waits is reported to show the bottleneck" << endl;
+    cout << "  --stats       after each file, print one line of JSON with the time, bytes read" << endl;
+    cout << "                and written, pixels and image buffer allocations of each stage" << endl;
+    cout << "  --benchmark   time the decoder, the encoder and every filter on synthetic images" << endl;
+    cout << "  --bench-sizes LIST  comma separated image sizes in MPix (default: 0.3,12,48,200)" << endl;
+    cout << "  --json FILE   also write the benchmark results as JSON (- for standard output)" << endl;
+    cout << "  --serve ADDRESS  run as a daemon that takes BMP files with a list of operations" << endl;
+    cout << "                and returns the results; ADDRESS is a Unix socket path or a port" << endl;
+    cout << "                number on localhost. --jobs sets the worker threads. Stop it with" << endl;
+    cout << "                Ctrl-C or SIGTERM" << endl;
+    cout << "  --queue N     with --pipeline, images waiting between two stages (default: 2);" << endl;
+    cout << "                with --serve, requests waiting for a worker before the daemon" << endl;
+    cout << "                stops reading new ones (default: twice the workers)" << endl;
+    cout << "  --loadgen ADDRESS  send the FILEs with the --op operations to a daemon, round" << endl;
+    cout << "                robin, and report requests/s and p50/p90/p99 latency; with -o the" << endl;
+    cout << "                first result for each FILE is saved in DIR" << endl;
+    cout << "  --connections N  requests the load generator keeps in flight (default: 4)" << endl;
+    cout << "  --requests N  requests the load generator sends in total (default: 100)" << endl;
+}
+
+// The decoded input image of the interactive session. It is reused by
+// every menu selection until the file changes on disk or a new file is
+// chosen, so applying several filters decodes the BMP once.
+struct DecodedImageCache
+{
+    string path;
+    uintmax_t file_size = 0;
+    filesystem::file_time_type modified;
+    Image image;
+    bool valid = false;
+    long long hits = 0;
+    long long misses = 0;
+
+    // Forget the cached image (e.g. when another file is selected)
+    void clear()
+    {
+        valid = false;
+        image = Image();
+    }
+};
+
+/**
+ * Returns the input image for a menu selection, decoding it only if it is
+ * not cached or the file's size or modification time changed. Reports the
+ * decode speed and the cache hit/miss counts.
+ * @param cache    the session's cache
+ * @param filename BMP image filename
+ * @return the image, or an empty Image if it could not be read
+ */
+const Image& load_image(DecodedImageCache& cache, string filename)
+{
+    error_code error;
+    uintmax_t file_size = filesystem::file_size(filename, error);
+    filesystem::file_time_type modified = filesystem::last_write_time(filename, error);
+
+    if (cache.valid && !error && cache.path == filename && cache.file_size == file_size
+        && cache.modified == modified)
+    {
+        cache.hits++;
+    }
+    else
+    {
+        cache.misses++;
+        DecodeStats stats;
+        cache.image = read_image(filename, &stats);
+        cache.path = filename;
+        cache.file_size = file_size;
+        cache.modified = modified;
+        cache.valid = !error && !cache.image.empty();
+        if (!cache.image.empty())
+        {
+            cout << "Decoded " << stats.bytes / 1e6 << " MB in " << stats.seconds * 1000 << " ms ("
+                 << stats.mb_per_second() << " MB/s)" << endl;
+        }
+    }
+    cout << "Image cache: " << cache.hits << " hits, " << cache.misses << " misses" << endl;
+    cout << endl;
+    return cache.image;
+}
+
+/**
+ * Asks for a scale factor strictly between 0 and 1, repeating the question
+ * until the value is in range
+ * @param prompt the question to ask
+ * @param value  receives the scale factor
+ * @return false if the input was not a number
+ */
+bool read_scale_factor(string prompt, double& value)
+{
+    cout << prompt;
+    cin >> value;
+    while (!cin.fail() && (value <= 0 || value >= 1))
+    {
+        cout << endl;
+        cout << "Error, please enter a decimal value between 0 and 1: ";
+        cin >> value;
     }
-    return new_image;
+    return !cin.fail();
 }
 
 string menu()
@@ -570,6 +1549,9 @@ string menu()
     cout << "I) Lighten" << endl;
     cout << "J) Darken" << endl;
     cout << "K) Black, white, red, green and blue only" << endl;
+    cout << "L) Chain several filters in one pass" << endl;
+    cout << "M) Shrink to a thumbnail" << endl;
+    cout << "N) Blur, sharpen or find edges" << endl;
     
     cout << endl;
     cout << "Enter Menu Selection (Q to quit): ";
@@ -579,8 +1561,171 @@ string menu()
 }
 
 
-int main()
+int main(int argc, char* argv[])
 {
+    BatchOptions options;
+    BenchmarkOptions benchmark;
+    bool run_benchmark = false;
+    ServeOptions serve;
+    LoadgenOptions loadgen;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        string error;
+        if ((arg == "--threads" || arg == "--jobs" || arg == "--op" || arg == "-o" || arg == "--band-rows"
+             || arg == "--bench-sizes" || arg == "--json" || arg == "--serve" || arg == "--queue"
+             || arg == "--loadgen" || arg == "--connections" || arg == "--requests")
+            && i + 1 == argc)
+        {
+            cerr << "error: " << arg << " needs a value" << endl;
+            return 1;
+        }
+        
+        if (arg == "--threads")
+        {
+            set_filter_threads(atoi(argv[++i]));
+        }
+        else if (arg == "--jobs")
+        {
+            options.jobs = atoi(argv[++i]);
+        }
+        else if (arg == "--op")
+        {
+            Operation op;
+            if (!parse_operation(argv[++i], op, error))
+            {
+                cerr << "error: " << error << endl;
+                return 1;
+            }
+            options.ops.push_back(op);
+            loadgen.ops.push_back(argv[i]);
+        }
+        else if (arg == "-o")
+        {
+            options.output_dir = argv[++i];
+        }
+        else if (arg == "--fast-scale")
+        {
+            set_scale_mode(ScaleMode::Fast);
+        }
+        else if (arg == "--stream")
+        {
+            options.stream = true;
+        }
+        else if (arg == "--stats")
+        {
+            options.stats = true;
+        }
+        else if (arg == "--mmap")
+        {
+            options.mmap = true;
+        }
+        else if (arg == "--pipeline")
+        {
+            options.pipeline = true;
+        }
+        else if (arg == "--band-rows")
+        {
+            options.band_rows = atoi(argv[++i]);
+        }
+        else if (arg == "--benchmark")
+        {
+            run_benchmark = true;
+        }
+        else if (arg == "--bench-sizes")
+        {
+            benchmark.megapixels.clear();
+            stringstream list(argv[++i]);
+            string item;
+            while (getline(list, item, ','))
+            {
+                double megapixels = atof(item.c_str());
+                if (megapixels <= 0)
+                {
+                    cerr << "error: --bench-sizes needs positive sizes in MPix, e.g. 0.3,12" << endl;
+                    return 1;
+                }
+                benchmark.megapixels.push_back(megapixels);
+            }
+        }
+        else if (arg == "--json")
+        {
+            benchmark.json_file = argv[++i];
+        }
+        else if (arg == "--serve")
+        {
+            serve.address = argv[++i];
+        }
+        else if (arg == "--queue")
+        {
+            serve.queue = options.queue_depth = atoi(argv[++i]);
+        }
+        else if (arg == "--loadgen")
+        {
+            loadgen.address = argv[++i];
+        }
+        else if (arg == "--connections")
+        {
+            loadgen.connections = atoi(argv[++i]);
+        }
+        else if (arg == "--requests")
+        {
+            loadgen.requests = atoi(argv[++i]);
+        }
+        else if (arg == "-h" || arg == "--help")
+        {
+            print_usage(argv[0]);
+            return 0;
+        }
+        else if (arg.size() > 1 && arg[0] == '-')
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            options.inputs.push_back(arg);
+        }
+    }
+    
+    if (run_benchmark)
+    {
+        return run_benchmarks(benchmark);
+    }
+
+    if (!serve.address.empty())
+    {
+        serve.workers = options.jobs;
+        serve.stats = options.stats;
+        return run_server(serve);
+    }
+
+    if (!loadgen.address.empty())
+    {
+        if (options.inputs.empty())
+        {
+            cerr << "error: the load generator needs at least one input file" << endl;
+            return 1;
+        }
+        loadgen.inputs = options.inputs;
+        loadgen.output_dir = options.output_dir;
+        return run_loadgen(loadgen);
+    }
+
+    if (!options.ops.empty() || !options.inputs.empty())
+    {
+        if (options.ops.empty() || options.inputs.empty() || options.output_dir.empty())
+        {
+            cerr << "error: batch mode needs at least one --op, an output directory (-o) and input files" << endl;
+            return 1;
+        }
+        if ((int)options.stream + (int)options.mmap + (int)options.pipeline > 1)
+        {
+            cerr << "error: use only one of --stream, --mmap and --pipeline" << endl;
+            return 1;
+        }
+        return options.pipeline ? run_pipelined_batch(options) : run_batch(options);
+    }
 
     cout << endl;
     cout << "CSPB 1300 Image Processing Application" << endl;
@@ -602,6 +1747,7 @@ int main()
     cout << endl;
     cout << "Filename is " << filename << endl;
     string input_filename = filename;
+    DecodedImageCache image_cache;
             cout << endl;
     
     string value = menu();
@@ -628,6 +1774,7 @@ int main()
             cout << "Success! Your new filename is: " << filename << endl;
             cout << endl;
             input_filename = filename;
+            image_cache.clear();
             value = menu();
         }
         
@@ -635,8 +1782,8 @@ int main()
         {
             cout << input_filename << endl;
             cout << endl;
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_1(image);
+            const Image& image = load_image(image_cache, input_filename);
+            Image new_image = process_1(image);
             
             cout << "Success! The process worked and the image was created. Add in save name below." << endl;
             
@@ -667,7 +1814,7 @@ int main()
         {
             cout << input_filename << endl;
             cout << endl;
-            vector<vector<Pixel>> image = read_image(input_filename);
+            const Image& image = load_image(image_cache, input_filename);
             
             
             
@@ -698,7 +1845,7 @@ int main()
                 }
             }
             
-            vector<vector<Pixel>> new_image = process_2(image, clarendon_scale);
+            Image new_image = process_2(image, clarendon_scale);
             cout << endl;
             cout << "Success! The process worked and the image was created. Add in save name below." << endl;
             
@@ -730,8 +1877,8 @@ int main()
         {
             cout << input_filename << endl;
             cout << endl;
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_3(image);
+            const Image& image = load_image(image_cache, input_filename);
+            Image new_image = process_3(image);
             
             cout << "Success! The process worked and the image was created. Add in save name below." << endl;
             
@@ -762,8 +1909,8 @@ int main()
         {
             cout << input_filename << endl;
             cout << endl;
-            vector<vector<Pixel>> image = read_image(input_filename);  
-            vector<vector<Pixel>> new_image = process_4(image);
+            const Image& image = load_image(image_cache, input_filename);  
+            Image new_image = process_4(image);
             
             cout << "Success! The process worked and the image was created. Add in save name below." << endl;
             
@@ -794,7 +1941,7 @@ int main()
         {
             cout << input_filename << endl;
             cout << endl;
-            vector<vector<Pixel>> image = read_image(input_filename);
+            const Image& image = load_image(image_cache, input_filename);
             
             cout << "Enter the number of clockwise rotations between 1 and 100: ";
             int rotations;
@@ -822,7 +1969,7 @@ int main()
             }
             cout << endl;
             
-            vector<vector<Pixel>> new_image = process_5(image, rotations);
+            Image new_image = process_5(image, rotations);
             
             cout << "Success! The process worked and the image was created. Add in save name below." << endl;
             
@@ -853,9 +2000,9 @@ int main()
         {
             cout << input_filename << endl;
             cout << endl;
-            vector<vector<Pixel>> image = read_image(input_filename);
-            cout << "Enter a xscale value between 2 and 5: ";
-            int x;
+            const Image& image = load_image(image_cache, input_filename);
+            cout << "Enter a xscale value between 1 and 20 (decimals allowed): ";
+            double x;
             cin >> x;
             if(cin.fail())
             {
@@ -864,10 +2011,10 @@ int main()
                 cout << endl;
                 return 1;
             }
-            while (x > 5 || x < 2)
+            while (x > 20 || x < 1)
             {
                 cout << endl;
-                cout << "Error, please enter a whole number between 2 and 5 ";
+                cout << "Error, please enter a number between 1 and 20 ";
                 x;
                 cin >> x;
                 if(cin.fail())
@@ -879,8 +2026,8 @@ int main()
                 }
             }
             
-            cout << "Enter a yscale value between 2 and 5: ";
-            int y;
+            cout << "Enter a yscale value between 1 and 20 (decimals allowed): ";
+            double y;
             cin >> y;
             if(cin.fail())
             {
@@ -889,10 +2036,10 @@ int main()
                 cout << endl;
                 return 1;
             }
-            while (y > 5 || y < 2)
+            while (y > 20 || y < 1)
             {
                 cout << endl;
-                cout << "Error, please enter a whole number between 2 and 5 ";
+                cout << "Error, please enter a number between 1 and 20 ";
                 y;
                 cin >> y;
                 if(cin.fail())
@@ -904,9 +2051,19 @@ int main()
                 }
             }
             
+            cout << "Enter N for nearest neighbour (blocky) or B for bilinear (smooth): ";
+            string mode;
+            cin >> mode;
+            while (mode != "N" && mode != "B")
+            {
+                cout << endl;
+                cout << "Error, please enter N or B: ";
+                cin >> mode;
+            }
+            
             cout << endl;
             
-            vector<vector<Pixel>> new_image = process_6(image, x, y);
+            Image new_image = process_6(image, x, y, mode == "B" ? ResizeMode::Bilinear : ResizeMode::Nearest);
             
             cout << "Success! The process worked and the image was created. Add in save name below." << endl;
             
@@ -937,8 +2094,8 @@ int main()
         {
             cout << input_filename << endl;
             cout << endl;
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_7(image);
+            const Image& image = load_image(image_cache, input_filename);
+            Image new_image = process_7(image);
             
             cout << "Success! The process worked and the image was created. Add in save name below." << endl;
             
@@ -969,7 +2126,7 @@ int main()
         {
             cout << input_filename << endl;
             cout << endl;
-            vector<vector<Pixel>> image = read_image(input_filename);
+            const Image& image = load_image(image_cache, input_filename);
             
             cout << "Enter a decimal value for lightening scaling value between 0 and 1: ";
             double lighten_factor;
@@ -997,7 +2154,7 @@ int main()
             }
             cout << endl;
             
-            vector<vector<Pixel>> new_image = process_8(image, lighten_factor);
+            Image new_image = process_8(image, lighten_factor);
             
             cout << "Success! The process worked and the image was created. Add in save name below." << endl;
             
@@ -1028,7 +2185,7 @@ int main()
         {
             cout << input_filename << endl;
             cout << endl;
-            vector<vector<Pixel>> image = read_image(input_filename);
+            const Image& image = load_image(image_cache, input_filename);
             
             cout << "Enter a decimal value for darkening scaling value between 0 and 1: ";
             double darken_factor;
@@ -1056,7 +2213,7 @@ int main()
             }
             cout << endl;
             
-            vector<vector<Pixel>> new_image = process_9(image, darken_factor);
+            Image new_image = process_9(image, darken_factor);
             
             cout << "Success! The process worked and the image was created. Add in save name below." << endl;
             
@@ -1087,8 +2244,100 @@ int main()
         {
             cout << input_filename << endl;
             cout << endl;
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_10(image);
+            const Image& image = load_image(image_cache, input_filename);
+            Image new_image = process_10(image);
+            
+            cout << "Success! The process worked and the image was created. Add in save name below." << endl;
+            
+            cout << endl;
+            
+            cout << "Enter your new BMP save filename: ";
+            string new_filename;
+            cin >> new_filename;
+            int n2 = new_filename.length();
+            while (new_filename.substr(n2-4,4) != ".bmp" || new_filename == input_filename)
+            {
+                cout << endl;
+                cout << "Error, please enter a name that ends in .bmp: ";
+                new_filename;
+                cin >> new_filename;
+                n2 = new_filename.length();
+            }
+            
+            cout << endl;
+            bool success = write_image(new_filename, new_image);
+            cout << endl; 
+            cout << "Success! A new file called " << new_filename << " has been created!" << endl;
+            cout << endl;
+            value = menu();
+        }
+        
+        else if(value == "L")
+        {
+            cout << input_filename << endl;
+            cout << endl;
+            const Image& image = load_image(image_cache, input_filename);
+            
+            cout << "Enter the filters to chain, in order, using the letters B, C, D, H, I, J and K (e.g. DJH): ";
+            string letters;
+            cin >> letters;
+            while (letters.find_first_not_of("BCDHIJK") != string::npos)
+            {
+                cout << endl;
+                cout << "Error, please use only the letters B, C, D, H, I, J and K: ";
+                cin >> letters;
+            }
+            cout << endl;
+            
+            vector<PointOp> ops;
+            for (char letter : letters)
+            {
+                PointOp op;
+                bool valid = true;
+                if (letter == 'B')
+                {
+                    op.type = PointOpType::Vignette;
+                }
+                else if (letter == 'C')
+                {
+                    op.type = PointOpType::Clarendon;
+                    valid = read_scale_factor("Enter a clarendon scale factor between 0 and 1: ", op.scaling_factor);
+                }
+                else if (letter == 'D')
+                {
+                    op.type = PointOpType::Grayscale;
+                }
+                else if (letter == 'H')
+                {
+                    op.type = PointOpType::HighContrast;
+                }
+                else if (letter == 'I')
+                {
+                    op.type = PointOpType::Lighten;
+                    valid = read_scale_factor("Enter a decimal value for lightening scaling value between 0 and 1: ", op.scaling_factor);
+                }
+                else if (letter == 'J')
+                {
+                    op.type = PointOpType::Darken;
+                    valid = read_scale_factor("Enter a decimal value for darkening scaling value between 0 and 1: ", op.scaling_factor);
+                }
+                else
+                {
+                    op.type = PointOpType::PrimaryColors;
+                }
+                
+                if (!valid)
+                {
+                    cout << endl;
+                    cout << "Error, invalid input type. Start over and try again." << endl;
+                    cout << endl;
+                    return 1;
+                }
+                ops.push_back(op);
+            }
+            cout << endl;
+            
+            Image new_image = run_pipeline(image, ops);
             
             cout << "Success! The process worked and the image was created. Add in save name below." << endl;
             
@@ -1115,6 +2364,180 @@ int main()
             value = menu();
         }
         
+        else if(value == "M")
+        {
+            cout << input_filename << endl;
+            cout << endl;
+            const Image& image = load_image(image_cache, input_filename);
+            cout << "Enter the size of the longer side in pixels: ";
+            int side;
+            cin >> side;
+            if(cin.fail())
+            {
+                cout << endl;
+                cout << "Error, invalid input type. Start over and try again." << endl;
+                cout << endl;
+                return 1;
+            }
+            while (side < 1)
+            {
+                cout << endl;
+                cout << "Error, please enter a number of at least 1 ";
+                cin >> side;
+                if(cin.fail())
+                {
+                cout << endl;
+                cout << "Error, invalid input type. Start over and try again." << endl;
+                cout << endl;
+                return 1;
+                }
+            }
+            
+            cout << "Enter X for box (fastest), B for bilinear or A for area (smoothest): ";
+            string mode;
+            cin >> mode;
+            while (mode != "X" && mode != "B" && mode != "A")
+            {
+                cout << endl;
+                cout << "Error, please enter X, B or A: ";
+                cin >> mode;
+            }
+            
+            cout << endl;
+            
+            DownscaleFilter filter = mode == "X" ? DownscaleFilter::Box
+                                   : mode == "B" ? DownscaleFilter::Bilinear : DownscaleFilter::Area;
+            Image new_image = thumbnail(image, side, filter);
+            
+            cout << "Success! The process worked and the image was created. Add in save name below." << endl;
+            
+            cout << endl;
+            
+            cout << "Enter your new BMP save filename: ";
+            string new_filename;
+            cin >> new_filename;
+            int n2 = new_filename.length();
+            while (new_filename.substr(n2-4,4) != ".bmp" || new_filename == input_filename)
+            {
+                cout << endl;
+                cout << "Error, please enter a name that ends in .bmp: ";
+                new_filename;
+                cin >> new_filename;
+                n2 = new_filename.length();
+            }
+            cout << endl;
+            
+            bool success = write_image(new_filename, new_image);
+            cout << endl;
+            cout << "Success! A new file called " << new_filename << " has been created!" << endl;
+            cout << endl;
+            value = menu();
+        }
+        
+        else if(value == "N")
+        {
+            cout << input_filename << endl;
+            cout << endl;
+            const Image& image = load_image(image_cache, input_filename);
+            cout << "Enter G for Gaussian blur, X for box blur, S for sharpen or E for edges: ";
+            string mode;
+            cin >> mode;
+            while (mode != "G" && mode != "X" && mode != "S" && mode != "E")
+            {
+                cout << endl;
+                cout << "Error, please enter G, X, S or E: ";
+                cin >> mode;
+            }
+            
+            double amount = 0;
+            double lowest = 0;
+            double highest = 0;
+            if (mode == "G")
+            {
+                cout << "Enter the blur size (standard deviation) in pixels, above 0 and up to 100: ";
+                highest = 100;
+            }
+            else if (mode == "X")
+            {
+                cout << "Enter the blur radius in whole pixels, from 1 to 1000: ";
+                lowest = 1;
+                highest = 1000;
+            }
+            else if (mode == "S")
+            {
+                cout << "Enter the sharpening amount, above 0 and up to 4: ";
+                highest = 4;
+            }
+            if (mode != "E")
+            {
+                cin >> amount;
+                if(cin.fail())
+                {
+                    cout << endl;
+                    cout << "Error, invalid input type. Start over and try again." << endl;
+                    cout << endl;
+                    return 1;
+                }
+                while (amount <= 0 || amount < lowest || amount > highest || (mode == "X" && amount != (int)amount))
+                {
+                    cout << endl;
+                    cout << "Error, please enter a value in the range above: ";
+                    cin >> amount;
+                    if(cin.fail())
+                    {
+                    cout << endl;
+                    cout << "Error, invalid input type. Start over and try again." << endl;
+                    cout << endl;
+                    return 1;
+                    }
+                }
+            }
+            
+            cout << endl;
+            
+            Image new_image;
+            if (mode == "G")
+            {
+                new_image = gaussian_blur(image, amount, BorderMode::Reflect);
+            }
+            else if (mode == "X")
+            {
+                new_image = box_blur(image, (int)amount, BorderMode::Reflect);
+            }
+            else if (mode == "S")
+            {
+                new_image = sharpen(image, amount, BorderMode::Reflect);
+            }
+            else
+            {
+                new_image = sobel_edges(image, BorderMode::Reflect);
+            }
+            
+            cout << "Success! The process worked and the image was created. Add in save name below." << endl;
+            
+            cout << endl;
+            
+            cout << "Enter your new BMP save filename: ";
+            string new_filename;
+            cin >> new_filename;
+            int n2 = new_filename.length();
+            while (new_filename.substr(n2-4,4) != ".bmp" || new_filename == input_filename)
+            {
+                cout << endl;
+                cout << "Error, please enter a name that ends in .bmp: ";
+                new_filename;
+                cin >> new_filename;
+                n2 = new_filename.length();
+            }
+            cout << endl;
+            
+            bool success = write_image(new_filename, new_image);
+            cout << endl;
+            cout << "Success! A new file called " << new_filename << " has been created!" << endl;
+            cout << endl;
+            value = menu();
+        }
+        
         else
         {
             cout << endl;
@@ -0,0 +1,499 @@
+// Checks that the filters give the same bytes at every SIMD level the CPU
+// supports and with any number of filter threads, and that the point
+// filters still match the formulas of the original program: exhaustively
+// over all 2^24 colors for grayscale, high contrast and quantize, and for
+// the default (exact) scale mode of vignette, clarendon, lighten and
+// darken, which the fast mode must stay within 1 of. Built and run next
+// to the program:
+//
+//     g++ -O2 -pthread -c image_processing.cpp
+//     g++ -O2 -pthread simd_test.cpp image_processing.o -o simd_test
+//     ./simd_test
+//
+// Every mismatch is printed, and the exit status is 1 if there were any.
+#include "image_processing.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <random>
+#include <functional>
+using namespace std;
+
+long long checks = 0;
+long long failures = 0;
+
+/**
+ * Compares two images byte for byte, printing the first pixel that differs
+ * @param actual   the image a filter made
+ * @param expected the image it should have made
+ * @param what     the filter and settings, for the message
+ * @return nothing
+ */
+void expect_same(const Image& actual, const Image& expected, const string& what)
+{
+    checks++;
+    if (actual.width != expected.width || actual.height != expected.height)
+    {
+        failures++;
+        cout << "FAIL " << what << ": " << actual.width << "x" << actual.height << " instead of "
+             << expected.width << "x" << expected.height << endl;
+        return;
+    }
+    for (int row = 0; row < actual.height; row++)
+    {
+        for (int col = 0; col < actual.width; col++)
+        {
+            Pixel a = actual[row][col];
+            Pixel e = expected[row][col];
+            if (a.red != e.red || a.green != e.green || a.blue != e.blue)
+            {
+                failures++;
+                cout << "FAIL " << what << ": pixel (" << col << ", " << row << ") of " << actual.width << "x"
+                     << actual.height << " is " << (int)a.red << "," << (int)a.green << "," << (int)a.blue
+                     << " instead of " << (int)e.red << "," << (int)e.green << "," << (int)e.blue << endl;
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * Checks that no channel of two images differs by more than 1, printing
+ * the first pixel that does
+ * @param actual   the image a filter made
+ * @param expected the image it should be close to
+ * @param what     the filter and settings, for the message
+ * @return nothing
+ */
+void expect_close(const Image& actual, const Image& expected, const string& what)
+{
+    checks++;
+    for (int row = 0; row < actual.height; row++)
+    {
+        for (int col = 0; col < actual.width; col++)
+        {
+            Pixel a = actual[row][col];
+            Pixel e = expected[row][col];
+            if (abs(a.red - e.red) > 1 || abs(a.green - e.green) > 1 || abs(a.blue - e.blue) > 1)
+            {
+                failures++;
+                cout << "FAIL " << what << ": pixel (" << col << ", " << row << ") of " << actual.width << "x"
+                     << actual.height << " is " << (int)a.red << "," << (int)a.green << "," << (int)a.blue
+                     << ", more than 1 from " << (int)e.red << "," << (int)e.green << "," << (int)e.blue << endl;
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * Makes an image of random pixels
+ * @param width  image width
+ * @param height image height
+ * @param random the generator
+ * @return the image
+ */
+Image random_image(int width, int height, mt19937& random)
+{
+    Image image(width, height);
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            image[row][col] = Pixel{(unsigned char)random(), (unsigned char)random(), (unsigned char)random()};
+        }
+    }
+    return image;
+}
+
+/**
+ * Makes a 4096x4096 image holding every 24-bit color once
+ * @return the image
+ */
+Image every_color()
+{
+    Image image(4096, 4096);
+    for (int row = 0; row < 4096; row++)
+    {
+        for (int col = 0; col < 4096; col++)
+        {
+            int color = row * 4096 + col;
+            image[row][col] = Pixel{(unsigned char)color, (unsigned char)(color >> 8), (unsigned char)(color >> 16)};
+        }
+    }
+    return image;
+}
+
+/**
+ * Applies a formula to every pixel, the way the original filters did
+ * @param image   the input image
+ * @param formula gives an output pixel from an input pixel and its row
+ *                and column
+ * @return the new image
+ */
+Image reference(const Image& image, const function<Pixel(const Pixel&, int, int)>& formula)
+{
+    Image new_image(image.width, image.height);
+    for (int row = 0; row < image.height; row++)
+    {
+        for (int col = 0; col < image.width; col++)
+        {
+            new_image[row][col] = formula(image[row][col], row, col);
+        }
+    }
+    return new_image;
+}
+
+/**
+ * Lists the SIMD levels the CPU supports, scalar first
+ * @return the levels
+ */
+vector<SimdLevel> supported_levels()
+{
+    vector<SimdLevel> levels;
+    for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::SSSE3, SimdLevel::AVX2, SimdLevel::AVX512})
+    {
+        if (set_simd_level(level) == level)
+        {
+            levels.push_back(level);
+        }
+    }
+    return levels;
+}
+
+/**
+ * Grayscale, high contrast and quantize against the original formulas, for
+ * every color, including the truncating division of (r+g+b)/3
+ * @param levels the SIMD levels to check
+ * @return nothing
+ */
+void test_every_color(const vector<SimdLevel>& levels)
+{
+    Image colors = every_color();
+    Image gray = reference(colors, [](const Pixel& p, int, int)
+    {
+        unsigned char average = (p.red + p.green + p.blue) / 3;
+        return Pixel{average, average, average};
+    });
+    Image contrast = reference(colors, [](const Pixel& p, int, int)
+    {
+        double gray_value = (p.red + p.green + p.blue) / 3;
+        unsigned char value = gray_value >= 255 / 2 ? 255 : 0;
+        return Pixel{value, value, value};
+    });
+    Image primary = reference(colors, [](const Pixel& p, int, int)
+    {
+        int sum = p.red + p.green + p.blue;
+        int max_color = max(max(p.red, p.green), p.blue);
+        if (sum >= 550)
+        {
+            return Pixel{255, 255, 255};
+        }
+        if (sum <= 150)
+        {
+            return Pixel{0, 0, 0};
+        }
+        if (max_color == p.red)
+        {
+            return Pixel{0, 0, 255};
+        }
+        if (max_color == p.green)
+        {
+            return Pixel{0, 255, 0};
+        }
+        return Pixel{255, 0, 0};
+    });
+
+    for (SimdLevel level : levels)
+    {
+        set_simd_level(level);
+        string name = simd_level_name(level);
+        expect_same(process_3(colors), gray, "grayscale, " + name);
+        expect_same(process_7(colors), contrast, "high contrast, " + name);
+        expect_same(process_10(colors), primary, "quantize, " + name);
+        expect_same(process_3(Image(colors)), gray, "grayscale in place, " + name);
+        expect_same(process_7(Image(colors)), contrast, "high contrast in place, " + name);
+        expect_same(process_10(Image(colors)), primary, "quantize in place, " + name);
+    }
+}
+
+/**
+ * Vignette, clarendon, lighten and darken in the exact scale mode against
+ * the original double formulas, which truncate the scaled channel to int
+ * (and a negative one wraps when it is stored as a byte)
+ * @param levels the SIMD levels to check
+ * @param random the generator
+ * @return nothing
+ */
+void test_scale_filters(const vector<SimdLevel>& levels, mt19937& random)
+{
+    set_scale_mode(ScaleMode::Exact);
+    vector<double> factors = {0, 1, 0.5, 0.25, 0.3, 0.7, 0.999, 0.001};
+    uniform_real_distribution<double> factor(0, 1);
+    for (int i = 0; i < 200; i++)
+    {
+        factors.push_back(factor(random));
+    }
+
+    // Odd sizes leave a scalar tail after the vector loops
+    for (auto size : vector<pair<int, int>>{{1, 1}, {7, 3}, {333, 120}, {640, 481}})
+    {
+        Image image = random_image(size.first, size.second, random);
+        int num_rows = image.height;
+        int num_columns = image.width;
+        Image vignette = reference(image, [&](const Pixel& p, int row, int col)
+        {
+            double distance = sqrt(pow(col - num_columns / 2, 2) + pow(row - num_rows / 2, 2));
+            double scaling_factor = (num_rows - distance) / num_rows;
+            return Pixel{(unsigned char)(int)(p.blue * scaling_factor), (unsigned char)(int)(p.green * scaling_factor),
+                         (unsigned char)(int)(p.red * scaling_factor)};
+        });
+        string size_name = to_string(num_columns) + "x" + to_string(num_rows);
+        for (SimdLevel level : levels)
+        {
+            set_simd_level(level);
+            expect_same(process_1(image), vignette, "vignette " + size_name + ", " + simd_level_name(level));
+        }
+    }
+
+    Image image = random_image(103, 77, random);
+    for (double scaling_factor : factors)
+    {
+        auto scale = [&](int color) { return (unsigned char)(int)(color * scaling_factor); };
+        auto lift = [&](int color) { return (unsigned char)(int)(255 - (255 - color) * scaling_factor); };
+        Image clarendon = reference(image, [&](const Pixel& p, int, int)
+        {
+            int average_value = (p.red + p.green + p.blue) / 3;
+            if (average_value >= 170)
+            {
+                return Pixel{lift(p.blue), lift(p.green), lift(p.red)};
+            }
+            if (average_value < 90)
+            {
+                return Pixel{scale(p.blue), scale(p.green), scale(p.red)};
+            }
+            return p;
+        });
+        Image lighten = reference(image, [&](const Pixel& p, int, int)
+        {
+            return Pixel{lift(p.blue), lift(p.green), lift(p.red)};
+        });
+        Image darken = reference(image, [&](const Pixel& p, int, int)
+        {
+            return Pixel{scale(p.blue), scale(p.green), scale(p.red)};
+        });
+        for (SimdLevel level : levels)
+        {
+            set_simd_level(level);
+            string name = to_string(scaling_factor) + ", " + simd_level_name(level);
+            expect_same(process_2(image, scaling_factor), clarendon, "clarendon " + name);
+            expect_same(process_8(image, scaling_factor), lighten, "lighten " + name);
+            expect_same(process_9(image, scaling_factor), darken, "darken " + name);
+        }
+    }
+}
+
+/**
+ * Vignette, clarendon, lighten and darken in the fast scale mode, which
+ * can differ from the exact mode by 1, even where the vignette factor is
+ * negative and the exact channel wraps around
+ * @param levels the SIMD levels to check
+ * @param random the generator
+ * @return nothing
+ */
+void test_fast_scale_mode(const vector<SimdLevel>& levels, mt19937& random)
+{
+    // Every pixel goes through all 256 values of each channel, since only
+    // a few products land next to a whole number
+    for (auto size : vector<pair<int, int>>{{7, 3}, {333, 120}, {1200, 90}})
+    {
+        string size_name = to_string(size.first) + "x" + to_string(size.second);
+        Image image(size.first, size.second);
+        for (int shift = 0; shift < 256; shift += 3)
+        {
+            for (int row = 0; row < image.height; row++)
+            {
+                for (int col = 0; col < image.width; col++)
+                {
+                    int value = shift + row * 7 + col;
+                    image[row][col] = Pixel{(unsigned char)value, (unsigned char)(value + 1), (unsigned char)(value + 2)};
+                }
+            }
+            for (SimdLevel level : levels)
+            {
+                set_simd_level(level);
+                set_scale_mode(ScaleMode::Exact);
+                Image exact = process_1(image);
+                set_scale_mode(ScaleMode::Fast);
+                expect_close(process_1(image), exact, "fast vignette " + size_name + ", " + simd_level_name(level));
+            }
+        }
+    }
+
+    Image image = random_image(103, 77, random);
+    uniform_real_distribution<double> factor(0, 1);
+    for (int i = 0; i < 200; i++)
+    {
+        double scaling_factor = factor(random);
+        for (SimdLevel level : levels)
+        {
+            set_simd_level(level);
+            set_scale_mode(ScaleMode::Exact);
+            Image clarendon = process_2(image, scaling_factor);
+            Image lighten = process_8(image, scaling_factor);
+            Image darken = process_9(image, scaling_factor);
+            set_scale_mode(ScaleMode::Fast);
+            string name = to_string(scaling_factor) + ", " + simd_level_name(level);
+            expect_close(process_2(image, scaling_factor), clarendon, "fast clarendon " + name);
+            expect_close(process_8(image, scaling_factor), lighten, "fast lighten " + name);
+            expect_close(process_9(image, scaling_factor), darken, "fast darken " + name);
+        }
+    }
+    set_scale_mode(ScaleMode::Exact);
+}
+
+/**
+ * The rounded mean of the square around each pixel, the box blur formula
+ * @param image  the image
+ * @param radius the radius of the square
+ * @param border the border mode
+ * @return the blurred image
+ */
+Image reference_box_blur(const Image& image, int radius, BorderMode border)
+{
+    // Where a row or column index past the edge reads, or -1 for black
+    auto source = [&](int i, int size)
+    {
+        while (i < 0 || i >= size)
+        {
+            if (border == BorderMode::Zero)
+            {
+                return -1;
+            }
+            if (border == BorderMode::Clamp)
+            {
+                i = i < 0 ? 0 : size - 1;
+            }
+            else if (border == BorderMode::Wrap)
+            {
+                i = i < 0 ? i + size : i - size;
+            }
+            else
+            {
+                i = size == 1 ? 0 : i < 0 ? -i : 2 * (size - 1) - i;
+            }
+        }
+        return i;
+    };
+    long long count = (2 * radius + 1) * (2 * radius + 1);
+    return reference(image, [&](const Pixel&, int row, int col)
+    {
+        long long sum[3] = {0, 0, 0};
+        for (int y = row - radius; y <= row + radius; y++)
+        {
+            for (int x = col - radius; x <= col + radius; x++)
+            {
+                int source_row = source(y, image.height);
+                int source_col = source(x, image.width);
+                if (source_row >= 0 && source_col >= 0)
+                {
+                    const Pixel& p = image[source_row][source_col];
+                    sum[0] += p.blue;
+                    sum[1] += p.green;
+                    sum[2] += p.red;
+                }
+            }
+        }
+        auto mean = [&](long long total) { return (unsigned char)((2 * total + count) / (2 * count)); };
+        return Pixel{mean(sum[0]), mean(sum[1]), mean(sum[2])};
+    });
+}
+
+/**
+ * The neighbourhood filters at every SIMD level and with several threads
+ * against the scalar kernels on one thread, and the box blur against its
+ * formula
+ * @param levels the SIMD levels to check
+ * @param random the generator
+ * @return nothing
+ */
+void test_neighbourhood_filters(const vector<SimdLevel>& levels, mt19937& random)
+{
+    uniform_real_distribution<double> weight(-1, 1);
+    ConvolutionKernel kernel;
+    kernel.width = 5;
+    kernel.height = 3;
+    for (int i = 0; i < kernel.width * kernel.height; i++)
+    {
+        kernel.weights.push_back(weight(random));
+    }
+    kernel.weights[7] += 2;
+    vector<double> column = {1, 4, 6, 4, 1};
+    vector<double> row = {0.2, 1, 3, 0.5, 0.1, 0.7, 2};
+
+    vector<pair<string, function<Image(const Image&, BorderMode)>>> filters = {
+        {"gaussian 0.8", [](const Image& image, BorderMode border) { return gaussian_blur(image, 0.8, border); }},
+        {"gaussian 3", [](const Image& image, BorderMode border) { return gaussian_blur(image, 3, border); }},
+        {"gaussian 12", [](const Image& image, BorderMode border) { return gaussian_blur(image, 12, border); }},
+        {"separable", [&](const Image& image, BorderMode border) { return convolve_separable(image, column, row, border); }},
+        {"convolve", [&](const Image& image, BorderMode border) { return convolve(image, kernel, border); }},
+        {"box 1", [](const Image& image, BorderMode border) { return box_blur(image, 1, border); }},
+        {"box 40", [](const Image& image, BorderMode border) { return box_blur(image, 40, border); }},
+        {"sharpen", [](const Image& image, BorderMode border) { return sharpen(image, 1.5, border); }},
+        {"sobel", [](const Image& image, BorderMode border) { return sobel_edges(image, border); }},
+    };
+    vector<pair<string, BorderMode>> borders = {
+        {"clamp", BorderMode::Clamp}, {"reflect", BorderMode::Reflect},
+        {"wrap", BorderMode::Wrap}, {"zero", BorderMode::Zero}};
+
+    for (auto size : vector<pair<int, int>>{{1, 1}, {2, 3}, {7, 5}, {70, 33}, {257, 19}})
+    {
+        Image image = random_image(size.first, size.second, random);
+        string size_name = to_string(size.first) + "x" + to_string(size.second);
+        for (auto& border : borders)
+        {
+            set_filter_threads(1);
+            set_simd_level(SimdLevel::Scalar);
+            expect_same(box_blur(image, 3, border.second), reference_box_blur(image, 3, border.second),
+                        "box 3 formula " + size_name + " " + border.first);
+            for (auto& filter : filters)
+            {
+                set_filter_threads(1);
+                set_simd_level(SimdLevel::Scalar);
+                Image expected = filter.second(image, border.second);
+                for (SimdLevel level : levels)
+                {
+                    set_simd_level(level);
+                    for (int threads : {1, 3})
+                    {
+                        set_filter_threads(threads);
+                        expect_same(filter.second(image, border.second), expected,
+                                    filter.first + " " + size_name + " " + border.first + ", " + simd_level_name(level)
+                                    + ", " + to_string(threads) + " threads");
+                    }
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    mt19937 random(2024);
+    vector<SimdLevel> levels = supported_levels();
+    cout << "SIMD levels:";
+    for (SimdLevel level : levels)
+    {
+        cout << " " << simd_level_name(level);
+    }
+    cout << endl;
+
+    test_every_color(levels);
+    test_scale_filters(levels, random);
+    test_fast_scale_mode(levels, random);
+    test_neighbourhood_filters(levels, random);
+
+    cout << checks << " checks, " << failures << " failures" << endl;
+    return failures == 0 ? 0 : 1;
+}